@@ -16,13 +16,22 @@
 #ifndef OCL_SOLVER_H_
 #define OCL_SOLVER_H_
 
-namespace ocl {
+#include <algorithm>  // copy
+#include <memory>     // unique_ptr
+#include <string>
+#include <vector>
 
+#include "utils/exceptions.h"  // OclException
+#include "tensor/tree_tensor.h"
+#include "thread_pool.h"
+#include "system.h"
+#include "ocp.h"
+#include "simultaneuous.h"
+#include "multiple_shooting.h"
+#include "solver/horizon_shift.h"
+#include "solver/interior_point.h"
 
-struct FunctionHandle
-{
-  const void* fh;
-}
+namespace ocl {
 
 struct Options
 {
@@ -34,48 +43,93 @@ struct Options
   bool path_constraints_at_boundary    = true;
 
   // nlp
-  std::string discretization  = "collocation";
+  std::string discretization  = "collocation";  // or "multiple_shooting"
   int control_intervals       = 20;
   int collocation_order       = 3;
-  std::string solver          = "ipopt";
+  int steps_per_interval      = 10;             // multiple shooting
+  std::string solver          = "ipopt";        // or "interior_point"
   bool auto_interpolation     = true;
+  int threads                 = 1;
 
-  // casadi options
-
-  // ipopt options
+  // casadi options, passed to nlpsol (e.g. {"ipopt.print_level", 0})
+  ::casadi::Dict casadi_options;
 
-}
-
-struct Bound
-{
-  double lower;
-  double upper;
-}
+  // interior point options
+  int max_iterations          = 100;
+  double tolerance            = 1e-8;
+};
 
 struct OcpDefinition
 {
+  OcpDefinition()
+      : variables(nullptr), equations(nullptr), path_costs(nullptr), arrival_costs(nullptr),
+        path_constraints(nullptr), boundary_conditions(nullptr) { }
+
   // mandatory
-  FunctionHandle variables;
-  FunctionHandle equations;
+  VariablesFunctionPtr variables;
+  EquationsFunctionPtr equations;
 
   // optional
-  FunctionHandle path_costs;
-  FunctionHandle arrival_costs;
-  FunctionHandle path_constraints;
-  FunctionHandle boundary_conditions;
+  PathCostsFunctionPtr path_costs;
+  ArrivalCostsFunctionPtr arrival_costs;
+  PathConstraintsFunctionPtr path_constraints;
+  BoundaryConditionsFunctionPtr boundary_conditions;
+};
+
+// Initial guess of the NLP variables in the layout of the discretization,
+// empty for the default guess (zero moved into the bounds)
+typedef std::vector<double> InitialGuess;
+
+// Values of the NLP variables after a solve, e.g.
+// solution.variables().get("interval").get("x").get("p")
+class Solution
+{
+public:
+
+  Solution(const Tree& tree, const std::vector<double>& values, const double objective,
+           const int iterations, const bool success)
+      : objective(objective), iterations(iterations), success(success), tree(tree),
+        storage(Matrix(values)) { }
+
+  // Only the TreeTensors refer to the storage, copies would dangle
+  Solution(const Solution&) = delete;
+  Solution& operator=(const Solution&) = delete;
+  Solution(Solution&&) = default;
 
-  // optional discrete
-  FunctionHandle discrete_costs;
-  FunctionHandle discrete_constraints;
-}
+  TreeTensor variables() { return TreeTensor(tree, storage); }
+  std::vector<double> values() const { return storage.data(); }
 
+  double objective;
+  int iterations;
+  bool success;
+
+  // Iterate of the interior point solver, for warm starts
+  InteriorPointResult iterate;
+
+  // Multipliers of the bounds and constraints from ipopt, for warm starts
+  std::vector<double> lam_x, lam_g;
+
+private:
+  Tree tree;
+  ValueStorage storage;
+};
+
+// Discretizes and solves an optimal control problem with horizon T.
+//
+//   discretization "collocation" with solver "ipopt" (through casadi)
+//   discretization "multiple_shooting" with solver "interior_point"
+//
+// The options are read at the first solve, bounds can be changed between
+// solves.
 class Solver
 {
 public:
-  Solver(const FunctionHandle variables, const FunctionHandle equations,
-         const FunctionHandle path_costs, const FunctionHandle arrival_costs,
-         const FunctionHandle path_constraints,
-         const FunctionHandle boundary_conditions)
+  Solver(const double T, const VariablesFunctionPtr variables, const EquationsFunctionPtr equations,
+         const PathCostsFunctionPtr path_costs = nullptr,
+         const ArrivalCostsFunctionPtr arrival_costs = nullptr,
+         const PathConstraintsFunctionPtr path_constraints = nullptr,
+         const BoundaryConditionsFunctionPtr boundary_conditions = nullptr)
+      : options(), T(T)
   {
     OcpDefinition ocp;
     ocp.variables = variables;
@@ -84,28 +138,233 @@ public:
     ocp.arrival_costs = arrival_costs;
     ocp.path_constraints = path_constraints;
     ocp.boundary_conditions = boundary_conditions;
-    Solver(ocp);
+    setup(ocp);
   }
 
-  Solver(OcpDefinition ocp {
-    Solver({ocp});
+  Solver(const double T, const OcpDefinition& ocp) : options(), T(T)
+  {
+    setup(ocp);
   }
 
-  Solver(const std::vector<OcpDefinition>& ocp) :
-      options(), ocp(ocp) { }
+  void setInitialBounds(const std::string& var, const Bound bound) { bounds.push_back({INITIAL, var, bound}); }
+  void setEndBounds(const std::string& var, const Bound bound) { bounds.push_back({END, var, bound}); }
+  void setBounds(const std::string& var, const Bound bound) { bounds.push_back({ALL, var, bound}); }
 
-  void setInitialBounds(const std::string& var, const Bound bound);
-  void setEndBounds(const std::string& var, const Bound bound);
-  void setBounds(const std::string& var, const Bound bound);
+  Solution solve() { return solve(this->initial_guess); }
 
-  Solution solve() { return solve(this->initialGuess); }
-  Solution solve(const InitialGuess& initial_guess);
+  Solution solve(const InitialGuess& initial_guess)
+  {
+    discretize();
+    if (!initial_guess.empty() && (int)initial_guess.size() != nv()) {
+      throw OclException("Size of the initial guess does not match the number of variables.");
+    }
+    if (collocation) {
+      return solveIpopt(initial_guess.empty() ? collocation->initialGuess() : initial_guess, nullptr);
+    }
+    return solveInteriorPoint(initial_guess.empty() ? shooting->initialGuess() : initial_guess, nullptr);
+  }
+
+  // Warm start from a previous solution with its multipliers. ipopt only
+  // uses the multipliers with the casadi option
+  // {"ipopt.warm_start_init_point", "yes"}, otherwise just the variables.
+  Solution solve(const Solution& previous)
+  {
+    discretize();
+    if (collocation) {
+      return solveIpopt(previous.values(), &previous);
+    }
+    return solveInteriorPoint(previous.values(), &previous.iterate);
+  }
+
+  // Shifts a solution by one control interval to warm start the next sample
+  // of model predictive control, e.g. solver.solve(solver.shift(solution)).
+  // The last interval is duplicated, the multipliers are shifted with their
+  // stages. Multipliers of the constraints after the intervals (path
+  // constraints of the final state, boundary conditions) are kept.
+  Solution shift(const Solution& previous)
+  {
+    discretize();
+    std::vector<double> values = previous.values();
+    if ((int)values.size() != nv()) {
+      throw OclException("Size of the solution does not match the number of variables.");
+    }
+    if (collocation)
+    {
+      if (!collocation_shift) {
+        collocation_shift.reset(new HorizonShift(collocation->variables(),
+                                                 collocation->numIntervalConstraints()));
+      }
+      Solution solution(collocation->variables(), collocation_shift->variables(values),
+                        previous.objective, 0, false);
+      if ((int)previous.lam_x.size() == nv() && (int)previous.lam_g.size() == collocation->ng())
+      {
+        const int n = collocation->variables().get("interval").size()*collocation->numIntervalConstraints();
+        solution.lam_x = collocation_shift->variables(previous.lam_x);
+        solution.lam_g = previous.lam_g;
+        const std::vector<double> intervals = collocation_shift->multipliers(
+            std::vector<double>(previous.lam_g.begin(), previous.lam_g.begin() + n));
+        std::copy(intervals.begin(), intervals.end(), solution.lam_g.begin());
+      }
+      return solution;
+    }
+    InteriorPointResult iterate = previous.iterate;
+    iterate.w = values;
+    InteriorPointResult shifted = interior_point->shift(iterate);
+    Solution solution(shooting->variables(), shifted.w, previous.objective, 0, false);
+    solution.iterate = shifted;
+    return solution;
+  }
 
   Options options;
   InitialGuess initial_guess;
+
 private:
-  std::vector<OcpDefinition> ocp;
-}
+
+  enum BoundType { INITIAL, END, ALL };
+
+  struct BoundSetting
+  {
+    BoundType type;
+    std::string id;
+    Bound bound;
+  };
+
+  void setup(const OcpDefinition& ocp)
+  {
+    if (!ocp.variables || !ocp.equations) {
+      throw OclException("Variables and equations of the optimal control problem are mandatory.");
+    }
+    system.reset(new System(ocp.variables, ocp.equations));
+    this->ocp.reset(new OCP(*system, ocp.path_costs, ocp.arrival_costs, ocp.path_constraints,
+                            ocp.boundary_conditions));
+  }
+
+  // Builds the discretization from the options at the first solve
+  void discretize()
+  {
+    if (!collocation && !shooting)
+    {
+      if (options.discretization == "collocation")
+      {
+        if (options.solver != "ipopt") {
+          throw OclException("Collocation is only supported with the solver ipopt.");
+        }
+        CollocationOptions opts;
+        opts.control_intervals = options.control_intervals;
+        opts.collocation_order = options.collocation_order;
+        opts.path_constraints_at_boundary = options.path_constraints_at_boundary;
+        collocation.reset(new Collocation(*ocp, T, opts));
+      }
+      else if (options.discretization == "multiple_shooting")
+      {
+        if (options.solver != "interior_point") {
+          throw OclException("Multiple shooting is only supported with the solver interior_point.");
+        }
+        MultipleShootingOptions opts;
+        opts.control_intervals = options.control_intervals;
+        opts.steps_per_interval = options.steps_per_interval;
+        opts.path_constraints_at_boundary = options.path_constraints_at_boundary;
+        pool.reset(new ThreadPool(options.threads));
+        shooting.reset(new MultipleShooting(*ocp, T, *pool, opts));
+
+        InteriorPointOptions ip_opts;
+        ip_opts.max_iterations = options.max_iterations;
+        ip_opts.tolerance = options.tolerance;
+        ip_opts.controls_regularization = options.controls_regularization ?
+                                          options.controls_regularization_value : 0.;
+        interior_point.reset(new InteriorPoint(*shooting, *pool, ip_opts));
+      }
+      else
+      {
+        throw OclException(("Unknown discretization " + options.discretization).c_str());
+      }
+    }
+
+    for (const BoundSetting& b : bounds)
+    {
+      const double lower = b.bound.lower_bound;
+      const double upper = b.bound.upper_bound;
+      if (collocation)
+      {
+        if (b.type == INITIAL) {
+          collocation->setInitialBounds(b.id, lower, upper);
+        } else if (b.type == END) {
+          collocation->setEndBounds(b.id, lower, upper);
+        } else {
+          collocation->setBounds(b.id, lower, upper);
+        }
+      }
+      else
+      {
+        if (b.type == INITIAL) {
+          shooting->setInitialBounds(b.id, lower, upper);
+        } else if (b.type == END) {
+          shooting->setEndBounds(b.id, lower, upper);
+        } else {
+          shooting->setBounds(b.id, lower, upper);
+        }
+      }
+    }
+    bounds.clear();
+  }
+
+  int nv() const { return collocation ? collocation->nv() : shooting->nv(); }
+
+  Solution solveIpopt(const std::vector<double>& guess, const Solution* warm)
+  {
+    if (!nlp_solver) {
+      nlp_solver.reset(new ::casadi::Function(::casadi::nlpsol("solver", "ipopt", collocation->nlp(),
+                                                               options.casadi_options)));
+    }
+    ::casadi::DMDict arg = {
+        {"x0", ::casadi::DM(guess)},
+        {"lbx", ::casadi::DM(collocation->variableLowerBounds())},
+        {"ubx", ::casadi::DM(collocation->variableUpperBounds())},
+        {"lbg", ::casadi::DM(collocation->constraintLowerBounds())},
+        {"ubg", ::casadi::DM(collocation->constraintUpperBounds())}};
+    if (warm && (int)warm->lam_x.size() == nv() && (int)warm->lam_g.size() == collocation->ng())
+    {
+      arg["lam_x0"] = ::casadi::DM(warm->lam_x);
+      arg["lam_g0"] = ::casadi::DM(warm->lam_g);
+    }
+    ::casadi::DMDict res = (*nlp_solver)(arg);
+    ::casadi::Dict stats = nlp_solver->stats();
+    Solution solution(collocation->variables(), res.at("x").nonzeros(), static_cast<double>(res.at("f")),
+                      stats.count("iter_count") ? stats.at("iter_count").to_int() : 0,
+                      stats.at("success").to_bool());
+    solution.lam_x = res.at("lam_x").nonzeros();
+    solution.lam_g = res.at("lam_g").nonzeros();
+    return solution;
+  }
+
+  Solution solveInteriorPoint(const std::vector<double>& guess, const InteriorPointResult* warm)
+  {
+    InteriorPointResult result;
+    if (warm && (int)warm->w.size() == nv()) {
+      InteriorPointResult initial = *warm;
+      initial.w = guess;
+      result = interior_point->solve(initial);
+    } else {
+      result = interior_point->solve(guess);
+    }
+    Solution solution(shooting->variables(), result.w, result.objective, result.iterations, result.success);
+    solution.iterate = result;
+    return solution;
+  }
+
+  double T;
+  std::unique_ptr<System> system;
+  std::unique_ptr<OCP> ocp;
+  std::vector<BoundSetting> bounds;
+
+  std::unique_ptr<Collocation> collocation;
+  std::unique_ptr< ::casadi::Function> nlp_solver;
+  std::unique_ptr<HorizonShift> collocation_shift;
+
+  std::unique_ptr<ThreadPool> pool;
+  std::unique_ptr<MultipleShooting> shooting;
+  std::unique_ptr<InteriorPoint> interior_point;
+};
 
 } // namespace ocl
 #endif // OCL_SOLVER_H_
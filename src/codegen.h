@@ -0,0 +1,219 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_CODEGEN_H_
+#define OCL_CODEGEN_H_
+
+#include <atomic>
+#include <cstdint>     // uint64_t
+#include <cstdio>      // rename, remove, popen
+#include <cstdlib>     // getenv, system
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <unistd.h>    // access, getpid
+#include <sys/stat.h>  // mkdir
+
+#include "utils/exceptions.h"  // OclException
+#include "tensor/casadi.h"     // casadi
+
+namespace ocl {
+
+struct CodegenOptions
+{
+  CodegenOptions()
+      : compiler("gcc"), flags("-O3 -fPIC -shared"), cache_dir(defaultCacheDir()) { }
+
+  std::string compiler;   // e.g. gcc or clang
+  std::string flags;      // with -march=native the CPU model is part of the cache key
+  std::string cache_dir;  // compiled functions are kept here across runs
+
+  // $OCL_CACHE_DIR, otherwise ~/.cache/ocl, otherwise /tmp/ocl_cache
+  static std::string defaultCacheDir()
+  {
+    const char* dir = std::getenv("OCL_CACHE_DIR");
+    if (dir && dir[0]) {
+      return dir;
+    }
+    const char* home = std::getenv("HOME");
+    if (home && home[0]) {
+      return std::string(home) + "/.cache/ocl";
+    }
+    return "/tmp/ocl_cache";
+  }
+};
+
+namespace codegen {
+
+// Creates dir and its parents, existing directories are fine.
+inline void makeDirectories(const std::string& dir)
+{
+  for (std::size_t pos = dir.find('/', 1); ; pos = dir.find('/', pos+1))
+  {
+    std::string sub = dir.substr(0, pos);
+    if (::mkdir(sub.c_str(), 0755) != 0 && ::access(sub.c_str(), F_OK) != 0) {
+      throw OclException(("Could not create directory " + sub).c_str());
+    }
+    if (pos == std::string::npos) {
+      return;
+    }
+  }
+}
+
+inline bool fileExists(const std::string& path) { return ::access(path.c_str(), F_OK) == 0; }
+
+// Path in single quotes for the shell
+inline std::string quote(const std::string& path)
+{
+  std::string q = "'";
+  for (char c : path) {
+    q += c == '\'' ? std::string("'\\''") : std::string(1, c);
+  }
+  return q + "'";
+}
+
+// Number of compiler runs in this process, cache hits do not count
+inline std::atomic<int>& compilations()
+{
+  static std::atomic<int> n(0);
+  return n;
+}
+
+// 64 bit FNV-1a, the same on every platform and standard library
+inline uint64_t fnv1a(const std::string& data, uint64_t h = 14695981039346656037ULL)
+{
+  for (unsigned char c : data)
+  {
+    h ^= c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+// First line of the output of cmd, empty if it fails
+inline std::string firstLine(const std::string& cmd)
+{
+  std::string line;
+  FILE* pipe = ::popen(cmd.c_str(), "r");
+  if (!pipe) {
+    return line;
+  }
+  char buffer[256];
+  if (std::fgets(buffer, sizeof(buffer), pipe)) {
+    line = buffer;
+  }
+  ::pclose(pipe);
+  return line;
+}
+
+// Version string of the compiler, queried once per compiler
+inline std::string compilerVersion(const std::string& compiler)
+{
+  static std::mutex mutex;
+  static std::map<std::string, std::string> versions;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = versions.find(compiler);
+  if (it == versions.end()) {
+    it = versions.insert(std::make_pair(compiler, firstLine(compiler + " --version 2>/dev/null"))).first;
+  }
+  return it->second;
+}
+
+// CPU model of the host, code compiled with -march=native only runs there
+inline std::string cpuModel()
+{
+  std::ifstream cpuinfo("/proc/cpuinfo");
+  std::string line;
+  while (std::getline(cpuinfo, line)) {
+    if (line.compare(0, 10, "model name") == 0) {
+      return line;
+    }
+  }
+  return "";
+}
+
+// Key of the generated code. The C source is a complete description of the
+// expression graph, together with the compiler, its version and the flags
+// it determines the shared library. Cache directories can be shared between
+// machines.
+inline std::string hash(const std::string& source, const CodegenOptions& opts)
+{
+  uint64_t h = fnv1a(source);
+  h = fnv1a('\n' + opts.compiler + ' ' + opts.flags, h);
+  h = fnv1a('\n' + compilerVersion(opts.compiler), h);
+  if (opts.flags.find("native") != std::string::npos) {
+    h = fnv1a('\n' + cpuModel(), h);
+  }
+  std::ostringstream ss;
+  ss << std::hex << h;
+  return ss.str();
+}
+
+// Path of the shared library for fcn in the cache, compiles it if it is not
+// in the cache yet.
+inline std::string compile(const ::casadi::Function& fcn, const CodegenOptions& opts = CodegenOptions())
+{
+  ::casadi::CodeGenerator gen(fcn.name() + ".c");
+  gen.add(fcn);
+  const std::string source = gen.dump();
+
+  const std::string base = opts.cache_dir + "/" + fcn.name() + "_" + hash(source, opts);
+  const std::string lib = base + ".so";
+  if (fileExists(lib)) {
+    return lib;
+  }
+
+  makeDirectories(opts.cache_dir);
+
+  // compile to a file specific to this process and call and move it into
+  // place, so that concurrent processes and threads never load a partially
+  // written library
+  static std::atomic<int> counter(0);
+  const std::string tmp = base + "_" + std::to_string(::getpid()) + "_" + std::to_string(counter++);
+  {
+    std::ofstream out(tmp + ".c");
+    out << source;
+    if (!out) {
+      throw OclException(("Could not write " + tmp + ".c").c_str());
+    }
+  }
+
+  const std::string cmd = opts.compiler + " " + opts.flags + " " + quote(tmp + ".c") +
+                          " -o " + quote(tmp + ".so") + " -lm";
+  compilations()++;
+  const int status = std::system(cmd.c_str());
+  std::remove((tmp + ".c").c_str());
+  if (status != 0) {
+    std::remove((tmp + ".so").c_str());
+    throw OclException(("Compilation of generated code failed: " + cmd).c_str());
+  }
+  if (std::rename((tmp + ".so").c_str(), lib.c_str()) != 0) {
+    std::remove((tmp + ".so").c_str());
+    throw OclException(("Could not move compiled library to " + lib).c_str());
+  }
+  return lib;
+}
+
+// Compiled version of fcn, loaded from the cache. Input and output
+// dimensions and raw evaluation are the same as for fcn.
+inline ::casadi::Function load(const ::casadi::Function& fcn, const CodegenOptions& opts = CodegenOptions())
+{
+  return ::casadi::external(fcn.name(), compile(fcn, opts));
+}
+
+} // namespace codegen
+} // namespace ocl
+#endif // OCL_CODEGEN_H_
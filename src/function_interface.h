@@ -15,29 +15,218 @@
 #ifndef OCL_FUNCTION_INTERFACE_H_
 #define OCL_FUNCTION_INTERFACE_H_
 
+#include <utility>              // move
+
+#include "utils/assertions.h"  // assertEqual
+#include "utils/exceptions.h"  // OclException
+#include "tensor/casadi.h"     // CasadiMatrix
+#include "tensor/matrix.h"     // Matrix
+#include "tensor/tree.h"       // Tree
+#include "codegen.h"           // CodegenOptions
+
 namespace ocl {
 
+// Preallocated buffers and a casadi memory object for evaluating a compiled
+// function without allocations.
+//
+// A workspace is confined to one thread at a time. For parallel evaluation
+// create one workspace per thread, preferably before starting the threads.
+class FunctionWorkspace
+{
+public:
+
+  FunctionWorkspace() : mem(-1) { }
+
+  FunctionWorkspace(const ::casadi::Function& fcn)
+      : fcn(fcn), arg(fcn.sz_arg()), res(fcn.sz_res()), iw(fcn.sz_iw()), w(fcn.sz_w()),
+        mem(fcn.checkout()) { }
+
+  FunctionWorkspace(FunctionWorkspace&& other)
+      : fcn(other.fcn), arg(std::move(other.arg)), res(std::move(other.res)),
+        iw(std::move(other.iw)), w(std::move(other.w)), mem(other.mem)
+  {
+    other.mem = -1;
+  }
+
+  FunctionWorkspace& operator=(FunctionWorkspace&& other)
+  {
+    if (this != &other) {
+      releaseMemory();
+      fcn = other.fcn;
+      arg = std::move(other.arg);
+      res = std::move(other.res);
+      iw = std::move(other.iw);
+      w = std::move(other.w);
+      mem = other.mem;
+      other.mem = -1;
+    }
+    return *this;
+  }
+
+  // owns the casadi memory object, can not be copied
+  FunctionWorkspace(const FunctionWorkspace&) = delete;
+  FunctionWorkspace& operator=(const FunctionWorkspace&) = delete;
+
+  ~FunctionWorkspace() { releaseMemory(); }
+
+  // Evaluates the function. inputs and outputs are arrays with one pointer
+  // per function input/output, pointing to the (dense) values. Null inputs
+  // are treated as zero, null outputs are not computed.
+  void evaluate(const double* const* inputs, double* const* outputs)
+  {
+    for (int i=0; i < fcn.n_in(); i++) {
+      arg[i] = inputs[i];
+    }
+    for (int i=0; i < fcn.n_out(); i++) {
+      res[i] = outputs[i];
+    }
+    int flag = fcn(arg.data(), res.data(), iw.data(), w.data(), mem);
+    if (flag) {
+      throw OclException("Evaluation of the function failed.");
+    }
+  }
+
+  const ::casadi::Function& function() const { return fcn; }
+
+private:
+  void releaseMemory()
+  {
+    if (mem >= 0) {
+      fcn.release(mem);
+      mem = -1;
+    }
+  }
+
+  ::casadi::Function fcn;
+  std::vector<const double*> arg;
+  std::vector<double*> res;
+  std::vector< ::casadi::casadi_int > iw;
+  std::vector<double> w;
+  int mem;
+};
+
+// Base class of functions given by user code (e.g. the system equations).
+//
+// fcnEvaluate is traced once on symbolic inputs which are sized by the input
+// trees, the resulting expression graph is stored as casadi::Function.
+// All evaluations run the compiled function only.
 class FunctionInterface
 {
 public:
 
-  FunctionInterface() {}
+  FunctionInterface() : n_outputs(0) { }
   FunctionInterface(const std::vector<Tree>& inputs, const int n_outputs)
+      : input_structs(inputs), n_outputs(n_outputs) { }
+
+  virtual std::vector<Matrix> fcnEvaluate(const std::vector<Matrix>& args) const = 0;
+
+  // Traces fcnEvaluate on symbolic column vector inputs and compiles the
+  // expression graph. Called on the first evaluation if not called before.
+  void compile(const std::string& name = "f")
   {
-    // does nothing, disables warning of unused input
-    (void)inputs;
-    (void)n_outputs;
+    std::vector<Matrix> args;
+    for (unsigned int i=0; i < input_structs.size(); i++) {
+      args.push_back(Matrix::Sym(input_structs[i].numel(), 1));
+    }
+
+    std::vector<Matrix> outputs = this->fcnEvaluate(args);
+    assertEqual(outputs.size(), n_outputs, "Number of outputs of the function is not as declared.");
+
+    std::vector<CasadiMatrix> casadi_args(args.size());
+    std::vector<CasadiMatrix> casadi_outputs(outputs.size());
+    std::transform(args.begin(), args.end(), casadi_args.begin(), raw);
+    std::transform(outputs.begin(), outputs.end(), casadi_outputs.begin(), raw);
+
+    // dense outputs, so that raw output buffers always have numel entries
+    for (unsigned int i=0; i < casadi_outputs.size(); i++) {
+      casadi_outputs[i] = CasadiMatrix::densify(casadi_outputs[i]);
+    }
+
+    this->sym_inputs = casadi_args;
+    this->sym_outputs = casadi_outputs;
+    this->fcn = ::casadi::Function(name, casadi_args, casadi_outputs);
   }
 
-  virtual std::vector<Matrix> fcnEvaluate(const std::vector<Matrix>& args) const = 0;
+  bool isCompiled() const { return !fcn.is_null(); }
+
+  // Generates C code of the compiled function, builds it with the system
+  // compiler and loads it (see codegen.h). Afterwards numeric and raw
+  // evaluations run the generated code, symbolic evaluations still use the
+  // expression graph.
+  void generate(const CodegenOptions& opts = CodegenOptions())
+  {
+    if (!isCompiled()) {
+      compile();
+    }
+    generated_fcn = codegen::load(fcn, opts);
+  }
+
+  bool isGenerated() const { return !generated_fcn.is_null(); }
 
+  // Evaluates the compiled function. Numeric arguments are evaluated
+  // numerically, symbolic arguments give symbolic outputs.
   std::vector<Matrix> evaluate(const std::vector<Matrix>& args)
   {
-    return this->fcnEvaluate(args);
+    if (!isCompiled()) {
+      compile();
+    }
+    assertEqual(args.size(), input_structs.size(), "Wrong number of function arguments.");
+
+    bool numeric = true;
+    for (unsigned int i=0; i < args.size(); i++) {
+      numeric = numeric && args[i].raw().is_constant();
+    }
+
+    std::vector<Matrix> outputs;
+    if (numeric)
+    {
+      std::vector< ::casadi::DM > dm_args(args.size());
+      for (unsigned int i=0; i < args.size(); i++) {
+        dm_args[i] = ::casadi::DM(column(args[i]).raw());
+      }
+      std::vector< ::casadi::DM > dm_outputs;
+      casadiFunction().call(dm_args, dm_outputs);
+      for (unsigned int i=0; i < dm_outputs.size(); i++) {
+        outputs.push_back(Matrix(dm_outputs[i]));
+      }
+    }
+    else
+    {
+      std::vector<CasadiMatrix> sx_args(args.size());
+      for (unsigned int i=0; i < args.size(); i++) {
+        sx_args[i] = column(args[i]).raw();
+      }
+      std::vector<CasadiMatrix> sx_outputs;
+      fcn.call(sx_args, sx_outputs);
+      for (unsigned int i=0; i < sx_outputs.size(); i++) {
+        outputs.push_back(Matrix(sx_outputs[i]));
+      }
+    }
+    return outputs;
   }
 
-private:
+  // The compiled (or generated) function, its symbolic inputs and outputs
+  const ::casadi::Function& casadiFunction() const { return isGenerated() ? generated_fcn : fcn; }
+  const std::vector<CasadiMatrix>& symbolicInputs() const { return sym_inputs; }
 
+  // The traced expression graph, also after generate (e.g. for symbolic calls)
+  const ::casadi::Function& expressionFunction() const { return fcn; }
+  const std::vector<CasadiMatrix>& symbolicOutputs() const { return sym_outputs; }
+
+  const std::vector<Tree>& inputStructs() const { return input_structs; }
+
+  // Workspace for allocation free evaluation of the compiled function
+  FunctionWorkspace workspace() const { return FunctionWorkspace(casadiFunction()); }
+
+protected:
+  std::vector<Tree> input_structs;
+  int n_outputs;
+
+private:
+  ::casadi::Function fcn;
+  ::casadi::Function generated_fcn;
+  std::vector<CasadiMatrix> sym_inputs;
+  std::vector<CasadiMatrix> sym_outputs;
 };
 
 } // namespace ocl
@@ -0,0 +1,463 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_BDF_H_
+#define OCL_BDF_H_
+
+#include <algorithm>  // copy, min, max
+#include <cmath>      // sqrt, pow, fabs
+#include <deque>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "system.h"
+
+namespace ocl {
+
+struct BDFOptions
+{
+  BDFOptions()
+      : rel_tol(1e-6), abs_tol(1e-8), max_order(5), initial_step(0), min_step(1e-12),
+        max_step(std::numeric_limits<double>::infinity()), max_steps(100000),
+        max_jacobian_age(20), max_leading_change(0.3), newton_iterations(4),
+        linear_solver("csparse") { }
+
+  double rel_tol;
+  double abs_tol;
+  int max_order;              // 1 to 5
+  double initial_step;        // 0 for an automatic guess
+  double min_step;
+  double max_step;
+  int max_steps;
+  int max_jacobian_age;       // steps before the Jacobian is reevaluated
+  double max_leading_change;  // relative change of c0 that requires a new factorization
+  int newton_iterations;
+  std::string linear_solver;  // casadi::Linsol plugin, sparse LU by default
+};
+
+// Variable order (1 to 5), variable step BDF integrator for stiff ODEs and
+// semi-explicit index-1 DAEs x' = f(x,z,u,p), 0 = g(x,z,u,p).
+//
+// A step to t solves for w = [x; z]
+//
+//   c_0*x + sum_j c_j*x_j - f(x,z) = 0,   g(x,z) = 0
+//
+// where c_j are the derivatives at t of the Lagrange polynomials through the
+// last q accepted points x_j (variable step coefficients). Newton uses the
+// sparse Jacobian c_0*I - [f_x f_z; g_x g_z], which is reevaluated only
+// after max_jacobian_age steps or when Newton fails, and refactorized when
+// c_0 changed by more than max_leading_change. The local error is estimated
+// from the difference to the polynomial predictor (Milne's device) and
+// controls step size and order. Algebraic variables are not part of the
+// error control.
+class BDF
+{
+public:
+
+  BDF(System& system, const BDFOptions& opts = BDFOptions())
+      : opts(opts), nx(system.nx()), nz(system.nz()), n(system.nx()+system.nz()), order(1),
+        jacobian_age(0), jacobian_valid(false), c0_factorized(0),
+        n_steps(0), n_rejected(0), n_jacobians(0), n_factorizations(0), n_iterations(0)
+  {
+    if (system.ni() != nz) {
+      throw OclException("BDF requires one implicit equation per algebraic variable.");
+    }
+    if (opts.max_order < 1 || opts.max_order > 5) {
+      throw OclException("BDF supports orders 1 to 5.");
+    }
+    setupFunctions(system);
+
+    w.resize(n);
+    dw.resize(n);
+    residual.resize(n);
+    b.resize(nx);
+    x_pred.resize(nx);
+    f0.resize(nx);
+    jac_nz.resize(jacobian_fcn.nnz_out(0));
+    jac0_nz.resize(jac_nz.size());
+    scale.resize(n);
+
+    // nonzeros of the c0*I part of the Jacobian
+    std::vector< ::casadi::casadi_int > rows, cols;
+    jacobian_fcn.sparsity_out(0).get_triplet(rows, cols);
+    for (unsigned int k = 0; k < rows.size(); k++) {
+      if (rows[k] == cols[k] && rows[k] < nx) {
+        diagonal_nz.push_back(k);
+      }
+    }
+
+    residual_ws = FunctionWorkspace(residual_fcn);
+    jacobian_ws = FunctionWorkspace(jacobian_fcn);
+    ode_ws = system.workspace();
+
+    linsol = ::casadi::Linsol("bdf_linsol", opts.linear_solver, jacobian_fcn.sparsity_out(0));
+    linsol_mem = linsol.checkout();
+  }
+
+  ~BDF() { linsol.release(linsol_mem); }
+
+  BDF(const BDF&) = delete;
+  BDF& operator=(const BDF&) = delete;
+
+  // Integrates from t0 to tf. z0 is the initial guess for the algebraic
+  // variables, which are made consistent in the first step. xf and zf may
+  // alias x0 and z0, null controls, parameters or z0 are treated as zero.
+  void integrate(const double* x0, const double* z0, const double* u, const double* p,
+                 const double t0, const double tf, double* xf, double* zf)
+  {
+    n_steps = n_rejected = n_jacobians = n_factorizations = n_iterations = 0;
+    jacobian_valid = false;
+    order = 1;
+    int steps_at_order = 0;
+
+    history_t.assign(1, t0);
+    history_x.assign(1, std::vector<double>(x0, x0+nx));
+    std::vector<double> z(nz, 0.);
+    if (z0) {
+      std::copy(z0, z0+nz, z.begin());
+    }
+
+    const double* inputs[4] = {x0, z.data(), u, p};
+    double* outputs[2] = {f0.data(), nullptr};
+    ode_ws.evaluate(inputs, outputs);
+
+    double t = t0;
+    double h = opts.initial_step > 0 ? opts.initial_step : initialStep(x0, tf - t0);
+
+    int n_attempts = 0;
+    while (t < tf)
+    {
+      if (n_attempts++ >= opts.max_steps) {
+        throw OclException("BDF reached the maximum number of steps.");
+      }
+      if (h < opts.min_step) {
+        throw OclException("BDF step size below the minimum.");
+      }
+      const bool last = h >= tf - t;
+      const double t_new = last ? tf : t + h;
+      h = t_new - t;
+
+      // predictor and BDF coefficients on the history
+      const bool start = history_t.size() == 1;
+      if (start) {
+        for (int e = 0; e < nx; e++) {
+          x_pred[e] = history_x[0][e] + h*f0[e];
+        }
+      } else {
+        extrapolate(order, t_new, x_pred);
+      }
+      const double c0 = coefficients(t_new);
+
+      for (int e = 0; e < n; e++) {
+        scale[e] = opts.abs_tol + opts.rel_tol*std::fabs(e < nx ? history_x[0][e] : z[e-nx]);
+      }
+
+      if (!newton(x_pred, z, u, p, c0))
+      {
+        // Newton failed with a fresh Jacobian, retry with a smaller step
+        n_rejected++;
+        h *= 0.25;
+        continue;
+      }
+
+      // local error estimate from the predictor
+      const double milne = start ? 0.5 : 1./(order+2);
+      double err = milne*norm(x_pred);
+      if (err > 1.)
+      {
+        n_rejected++;
+        h *= std::max(0.2, 0.9*std::pow(err, -1./(order+1)));
+        continue;
+      }
+
+      // error estimates of the neighbouring orders for the order selection
+      const int q = order;
+      double err_lower = std::numeric_limits<double>::infinity();
+      double err_higher = std::numeric_limits<double>::infinity();
+      steps_at_order++;
+      if (!start && steps_at_order > q)
+      {
+        if (q > 1) {
+          extrapolate(q-1, t_new, x_pred);
+          err_lower = norm(x_pred)/(q+1);
+        }
+        if (q < opts.max_order && (int)history_t.size() >= q+2) {
+          extrapolate(q+1, t_new, x_pred);
+          err_higher = norm(x_pred)/(q+3);
+        }
+      }
+
+      // accept
+      n_steps++;
+      t = t_new;
+      history_t.push_front(t);
+      history_x.push_front(std::vector<double>(w.begin(), w.begin()+nx));
+      if ((int)history_t.size() > opts.max_order + 2) {
+        history_t.pop_back();
+        history_x.pop_back();
+      }
+      std::copy(w.begin()+nx, w.end(), z.begin());
+
+      double factor = stepFactor(err, q);
+      if (stepFactor(err_lower, q-1) > factor) {
+        factor = stepFactor(err_lower, q-1);
+        order = q-1;
+      }
+      if (stepFactor(err_higher, q+1) > factor) {
+        factor = stepFactor(err_higher, q+1);
+        order = q+1;
+      }
+      if (order != q) {
+        steps_at_order = 0;
+      }
+      h = std::min(h*std::min(2., std::max(1., factor)), opts.max_step);
+    }
+
+    std::copy(history_x[0].begin(), history_x[0].end(), xf);
+    if (zf) {
+      std::copy(z.begin(), z.end(), zf);
+    }
+  }
+
+  // Sparsity of the Newton matrix, the factorization works on its nonzeros
+  const ::casadi::Sparsity& jacobianSparsity() const { return jacobian_fcn.sparsity_out(0); }
+
+  // Statistics of the last integration
+  int numSteps() const { return n_steps; }
+  int numRejectedSteps() const { return n_rejected; }
+  int numJacobianEvaluations() const { return n_jacobians; }
+  int numFactorizations() const { return n_factorizations; }
+  int numNewtonIterations() const { return n_iterations; }
+  int currentOrder() const { return order; }
+
+private:
+
+  void setupFunctions(const System& system)
+  {
+    CasadiMatrix x = CasadiMatrix::sym("x", nx);
+    CasadiMatrix z = CasadiMatrix::sym("z", nz);
+    CasadiMatrix u = CasadiMatrix::sym("u", system.nu());
+    CasadiMatrix p = CasadiMatrix::sym("p", system.np());
+    CasadiMatrix c0 = CasadiMatrix::sym("c0");
+    CasadiMatrix history = CasadiMatrix::sym("b", nx);
+
+    std::vector<CasadiMatrix> out = system.expressionFunction()(std::vector<CasadiMatrix>{x, z, u, p});
+    CasadiMatrix w_sym = CasadiMatrix::vertcat({x, z});
+    CasadiMatrix r = CasadiMatrix::vertcat({c0*x + history - out[0], out[1]});
+    std::vector<CasadiMatrix> in = {w_sym, u, p, c0, history};
+
+    residual_fcn = ::casadi::Function("bdf_residual", in, {r});
+    jacobian_fcn = ::casadi::Function("bdf_jacobian", in, {CasadiMatrix::jacobian(r, w_sym)});
+  }
+
+  // Derivative coefficients of the Lagrange polynomials through t_new and
+  // the last order points at t_new. Sets b = sum_j c_j*x_j, returns c_0.
+  double coefficients(const double t_new)
+  {
+    const int q = std::min(order, (int)history_t.size());
+    double c0 = 0;
+    for (int k = 0; k < q; k++) {
+      c0 += 1./(t_new - history_t[k]);
+    }
+    std::fill(b.begin(), b.end(), 0.);
+    for (int j = 0; j < q; j++)
+    {
+      double cj = 1./(history_t[j] - t_new);
+      for (int k = 0; k < q; k++) {
+        if (k != j) {
+          cj *= (t_new - history_t[k])/(history_t[j] - history_t[k]);
+        }
+      }
+      for (int e = 0; e < nx; e++) {
+        b[e] += cj*history_x[j][e];
+      }
+    }
+    return c0;
+  }
+
+  // Value at t of the polynomial of degree k through the last k+1 points
+  void extrapolate(const int k, const double t, std::vector<double>& out) const
+  {
+    const int m = std::min(k+1, (int)history_t.size());
+    std::fill(out.begin(), out.end(), 0.);
+    for (int j = 0; j < m; j++)
+    {
+      double l = 1.;
+      for (int i = 0; i < m; i++) {
+        if (i != j) {
+          l *= (t - history_t[i])/(history_t[j] - history_t[i]);
+        }
+      }
+      for (int e = 0; e < nx; e++) {
+        out[e] += l*history_x[j][e];
+      }
+    }
+  }
+
+  void evaluateJacobian(const double* u, const double* p, const double c0)
+  {
+    const double* inputs[5] = {w.data(), u, p, &c0, b.data()};
+    double* outputs[1] = {jac0_nz.data()};
+    jacobian_ws.evaluate(inputs, outputs);
+    for (int k : diagonal_nz) {
+      jac0_nz[k] -= c0;
+    }
+    n_jacobians++;
+    jacobian_age = 0;
+    jacobian_valid = true;
+  }
+
+  void factorize(const double c0)
+  {
+    std::copy(jac0_nz.begin(), jac0_nz.end(), jac_nz.begin());
+    for (int k : diagonal_nz) {
+      jac_nz[k] += c0;
+    }
+    if (linsol.nfact(jac_nz.data(), linsol_mem)) {
+      throw OclException("Factorization of the BDF Newton matrix failed.");
+    }
+    n_factorizations++;
+    c0_factorized = c0;
+  }
+
+  // Simplified Newton from the predictor, the solution is left in w.
+  // Returns false if it did not converge with a fresh Jacobian.
+  bool newton(const std::vector<double>& x0, const std::vector<double>& z0,
+              const double* u, const double* p, const double c0)
+  {
+    bool fresh = false;
+    if (!jacobian_valid || jacobian_age >= opts.max_jacobian_age)
+    {
+      std::copy(x0.begin(), x0.end(), w.begin());
+      std::copy(z0.begin(), z0.end(), w.begin()+nx);
+      evaluateJacobian(u, p, c0);
+      factorize(c0);
+      fresh = true;
+    }
+    else if (std::fabs(c0/c0_factorized - 1.) > opts.max_leading_change)
+    {
+      factorize(c0);
+    }
+    jacobian_age++;
+
+    while (true)
+    {
+      std::copy(x0.begin(), x0.end(), w.begin());
+      std::copy(z0.begin(), z0.end(), w.begin()+nx);
+
+      double previous = 0;
+      for (int iter = 0; iter < opts.newton_iterations; iter++)
+      {
+        const double* inputs[5] = {w.data(), u, p, &c0, b.data()};
+        double* outputs[1] = {residual.data()};
+        residual_ws.evaluate(inputs, outputs);
+
+        std::copy(residual.begin(), residual.end(), dw.begin());
+        if (linsol.solve(jac_nz.data(), dw.data(), 1, false, linsol_mem)) {
+          throw OclException("Solution of the BDF Newton system failed.");
+        }
+        n_iterations++;
+
+        double sum = 0;
+        for (int e = 0; e < n; e++) {
+          w[e] -= dw[e];
+          sum += (dw[e]/scale[e])*(dw[e]/scale[e]);
+        }
+        double size = std::sqrt(sum/n);
+        if (size <= 0.1) {
+          return true;
+        }
+        if (iter > 0 && size > 0.9*previous) {
+          break;  // not contracting
+        }
+        previous = size;
+      }
+
+      if (fresh) {
+        return false;
+      }
+      // retry with a Jacobian at the predictor
+      std::copy(x0.begin(), x0.end(), w.begin());
+      std::copy(z0.begin(), z0.end(), w.begin()+nx);
+      evaluateJacobian(u, p, c0);
+      factorize(c0);
+      fresh = true;
+    }
+  }
+
+  // Weighted RMS norm of x - v for the current solution x
+  double norm(const std::vector<double>& v) const
+  {
+    double sum = 0;
+    for (int e = 0; e < nx; e++) {
+      double d = (w[e] - v[e])/scale[e];
+      sum += d*d;
+    }
+    return nx > 0 ? std::sqrt(sum/nx) : 0.;
+  }
+
+  static double stepFactor(const double err, const int q)
+  {
+    if (q < 1 || std::isinf(err)) {
+      return 0.;
+    }
+    return err > 0 ? 0.9*std::pow(err, -1./(q+1)) : 2.;
+  }
+
+  double initialStep(const double* x0, const double span) const
+  {
+    double d0 = 0, d1 = 0;
+    for (int e = 0; e < nx; e++)
+    {
+      double sc = opts.abs_tol + opts.rel_tol*std::fabs(x0[e]);
+      d0 += (x0[e]/sc)*(x0[e]/sc);
+      d1 += (f0[e]/sc)*(f0[e]/sc);
+    }
+    double h = (d0 < 1e-10 || d1 < 1e-10) ? 1e-6*span : 0.01*std::sqrt(d0/d1);
+    return std::min(std::min(h, span), opts.max_step);
+  }
+
+  BDFOptions opts;
+  int nx, nz, n;
+  int order;
+
+  ::casadi::Function residual_fcn;
+  ::casadi::Function jacobian_fcn;
+  FunctionWorkspace residual_ws;
+  FunctionWorkspace jacobian_ws;
+  FunctionWorkspace ode_ws;
+
+  ::casadi::Linsol linsol;
+  int linsol_mem;
+  std::vector<int> diagonal_nz;
+
+  std::deque<double> history_t;                // most recent first
+  std::deque<std::vector<double> > history_x;
+
+  std::vector<double> w, dw, residual, b, x_pred, f0, jac_nz, jac0_nz, scale;
+  int jacobian_age;
+  bool jacobian_valid;
+  double c0_factorized;
+
+  int n_steps;
+  int n_rejected;
+  int n_jacobians;
+  int n_factorizations;
+  int n_iterations;
+};
+
+} // namespace ocl
+#endif // OCL_BDF_H_
@@ -0,0 +1,146 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_BUTCHER_TABLEAU_H_
+#define OCL_BUTCHER_TABLEAU_H_
+
+#include <cmath>   // sqrt
+#include <string>
+#include <vector>
+
+#include "utils/assertions.h"  // assertEqual
+#include "utils/exceptions.h"  // NotImplemented
+
+namespace ocl {
+
+// Coefficients of a Runge-Kutta method with s stages
+//
+//   c | A
+//   --+---
+//     | b
+//
+struct ButcherTableau
+{
+  ButcherTableau() : order(0) { }
+
+  ButcherTableau(const std::string& name, const int order, const std::vector<std::vector<double> >& A,
+                 const std::vector<double>& b, const std::vector<double>& c)
+      : name(name), order(order), A(A), b(b), c(c)
+  {
+    assertEqual(A.size(), b.size(), "Butcher tableau: A must have one row per stage.");
+    assertEqual(c.size(), b.size(), "Butcher tableau: c must have one entry per stage.");
+    for (unsigned int i=0; i < A.size(); i++) {
+      assertEqual(A[i].size(), b.size(), "Butcher tableau: A must be square.");
+    }
+  }
+
+  int stages() const { return b.size(); }
+
+  // A is strictly lower triangular
+  bool isExplicit() const
+  {
+    for (unsigned int i=0; i < A.size(); i++) {
+      for (unsigned int j=i; j < A[i].size(); j++) {
+        if (A[i][j] != 0.) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  static ButcherTableau Euler()
+  {
+    return ButcherTableau("euler", 1, {{0.}}, {1.}, {0.});
+  }
+
+  static ButcherTableau Heun()
+  {
+    return ButcherTableau("heun", 2, {{0., 0.}, {1., 0.}}, {0.5, 0.5}, {0., 1.});
+  }
+
+  static ButcherTableau RK4()
+  {
+    return ButcherTableau("rk4", 4,
+                          {{0.,  0.,  0., 0.},
+                           {0.5, 0.,  0., 0.},
+                           {0.,  0.5, 0., 0.},
+                           {0.,  0.,  1., 0.}},
+                          {1./6, 1./3, 1./3, 1./6},
+                          {0., 0.5, 0.5, 1.});
+  }
+
+  // Gauss-Legendre collocation with s = 1, 2, 3 stages, order 2s
+  static ButcherTableau GaussLegendre(const int s)
+  {
+    const double r3 = std::sqrt(3.);
+    const double r15 = std::sqrt(15.);
+    switch (s)
+    {
+      case 1:
+        return ButcherTableau("gauss1", 2, {{0.5}}, {1.}, {0.5});
+      case 2:
+        return ButcherTableau("gauss2", 4,
+                              {{0.25,        0.25 - r3/6},
+                               {0.25 + r3/6, 0.25}},
+                              {0.5, 0.5},
+                              {0.5 - r3/6, 0.5 + r3/6});
+      case 3:
+        return ButcherTableau("gauss3", 6,
+                              {{5./36,          2./9 - r15/15, 5./36 - r15/30},
+                               {5./36 + r15/24, 2./9,          5./36 - r15/24},
+                               {5./36 + r15/30, 2./9 + r15/15, 5./36}},
+                              {5./18, 4./9, 5./18},
+                              {0.5 - r15/10, 0.5, 0.5 + r15/10});
+      default:
+        throw NotImplemented("Gauss-Legendre is available for 1 to 3 stages.");
+    }
+  }
+
+  // Radau IIA collocation with s = 1, 2, 3 stages, order 2s-1, stiffly
+  // accurate (the last stage is the end of the step)
+  static ButcherTableau RadauIIA(const int s)
+  {
+    const double r6 = std::sqrt(6.);
+    switch (s)
+    {
+      case 1:
+        return ButcherTableau("radau1", 1, {{1.}}, {1.}, {1.});
+      case 2:
+        return ButcherTableau("radau2", 3,
+                              {{5./12, -1./12},
+                               {3./4,   1./4}},
+                              {3./4, 1./4},
+                              {1./3, 1.});
+      case 3:
+        return ButcherTableau("radau3", 5,
+                              {{(88 - 7*r6)/360,     (296 - 169*r6)/1800, (-2 + 3*r6)/225},
+                               {(296 + 169*r6)/1800, (88 + 7*r6)/360,     (-2 - 3*r6)/225},
+                               {(16 - r6)/36,        (16 + r6)/36,        1./9}},
+                              {(16 - r6)/36, (16 + r6)/36, 1./9},
+                              {(4 - r6)/10, (4 + r6)/10, 1.});
+      default:
+        throw NotImplemented("Radau IIA is available for 1 to 3 stages.");
+    }
+  }
+
+  std::string name;
+  int order;
+  std::vector<std::vector<double> > A;
+  std::vector<double> b;
+  std::vector<double> c;
+};
+
+} // namespace ocl
+#endif // OCL_BUTCHER_TABLEAU_H_
@@ -0,0 +1,293 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_DORMAND_PRINCE_H_
+#define OCL_DORMAND_PRINCE_H_
+
+#include <algorithm>  // copy, min, max
+#include <cmath>      // sqrt, pow, fabs
+#include <limits>
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "tensor/tree_builder.h"
+#include "tensor/tree_tensor.h"
+#include "system.h"
+
+namespace ocl {
+
+// States of a simulation sampled on a time grid, stored stage major
+// (all states of sample 0, then of sample 1, ...).
+class Trajectory
+{
+public:
+
+  Trajectory(const Tree& states, const std::vector<double>& times, const std::vector<double>& data)
+      : sample_times(times), values(data), storage(Matrix(data))
+  {
+    TreeBuilder tb;
+    tb.addRepeated({"x"}, {states}, times.size());
+    tree = tb.tree().get("x");
+  }
+
+  // Only the TreeTensor refers to the storage, copies would dangle
+  Trajectory(const Trajectory&) = delete;
+  Trajectory& operator=(const Trajectory&) = delete;
+  Trajectory(Trajectory&&) = default;
+
+  const std::vector<double>& times() const { return sample_times; }
+
+  // Raw values, nx-by-number of samples, column major
+  const std::vector<double>& data() const { return values; }
+
+  // e.g. trajectory.states().get("p") is a tensor with one matrix per sample.
+  // Valid as long as the trajectory exists.
+  TreeTensor states() { return TreeTensor(tree, storage); }
+
+private:
+  std::vector<double> sample_times;
+  std::vector<double> values;
+  ValueStorage storage;
+  Tree tree;
+};
+
+struct DormandPrinceOptions
+{
+  DormandPrinceOptions()
+      : rel_tol(1e-6), abs_tol(1e-8), initial_step(0), min_step(1e-12),
+        max_step(std::numeric_limits<double>::infinity()), max_steps(100000) { }
+
+  double rel_tol;
+  double abs_tol;
+  double initial_step;  // 0 for an automatic guess
+  double min_step;
+  double max_step;
+  int max_steps;
+};
+
+// Adaptive step explicit Runge-Kutta integrator with the Dormand-Prince 5(4)
+// pair for systems without algebraic variables.
+//
+// The last stage of a step is the derivative at the new state, it is reused
+// as first stage of the next step (first same as last, 6 evaluations per
+// step). Samples on the output grid are interpolated with the 4th order
+// dense output of the method, the step size is chosen by error control only.
+class DormandPrince
+{
+public:
+
+  DormandPrince(System& system, const DormandPrinceOptions& opts = DormandPrinceOptions())
+      : system(system), opts(opts), nx(system.nx()), ws(system.workspace()),
+        k(7, std::vector<double>(system.nx())), y(system.nx()), y_new(system.nx()), stage_state(system.nx()),
+        n_evaluations(0), n_accepted(0), n_rejected(0)
+  {
+    if (system.nz() > 0) {
+      throw OclException("Dormand-Prince does not support algebraic variables.");
+    }
+  }
+
+  // Integrates from times[0] with state x0 to times[n_times-1] and writes the
+  // state at all (ascending) times to out (nx-by-n_times, column major).
+  void simulate(const double* x0, const double* u, const double* p, const double* times,
+                const int n_times, double* out)
+  {
+    n_evaluations = n_accepted = n_rejected = 0;
+    if (n_times <= 0) {
+      return;
+    }
+    std::copy(x0, x0+nx, y.begin());
+    std::copy(x0, x0+nx, out);
+    int next_sample = 1;
+
+    // samples at the initial time, e.g. a grid of zero length
+    double t = times[0];
+    while (next_sample < n_times && times[next_sample] <= t) {
+      std::copy(x0, x0+nx, &out[nx*next_sample++]);
+    }
+    if (next_sample == n_times) {
+      return;
+    }
+    const double tf = times[n_times-1];
+
+    evaluate(y.data(), u, p, k[0].data());
+    double h = opts.initial_step > 0 ? opts.initial_step : initialStep(tf - t);
+
+    int n_steps = 0;
+    while (next_sample < n_times)
+    {
+      if (n_steps++ >= opts.max_steps) {
+        throw OclException("Dormand-Prince reached the maximum number of steps.");
+      }
+      const bool last = h >= tf - t;
+      if (last) {
+        h = tf - t;
+      }
+
+      double err = attemptStep(u, p, h);
+      double factor = err > 0 ? 0.9*std::pow(err, -0.2) : 5.;
+
+      if (err <= 1.)
+      {
+        n_accepted++;
+
+        // dense output for all samples in this step
+        const double t_end = last ? tf : t + h;
+        while (next_sample < n_times && times[next_sample] <= t_end) {
+          interpolate(std::min(1., (times[next_sample] - t)/h), h, &out[next_sample*nx]);
+          next_sample++;
+        }
+
+        t += h;
+        y.swap(y_new);
+        k[0].swap(k[6]);  // first same as last
+        if (next_sample == n_times) {
+          break;  // the last step may be shorter than min_step
+        }
+        h *= std::min(5., std::max(0.2, factor));
+      }
+      else
+      {
+        n_rejected++;
+        h *= std::max(0.2, factor);
+      }
+
+      h = std::min(h, opts.max_step);
+      if (h < opts.min_step) {
+        throw OclException("Dormand-Prince step size below the minimum.");
+      }
+    }
+  }
+
+  // Trajectory of the states on the given time grid
+  Trajectory simulate(const std::vector<double>& x0, const std::vector<double>& u, const std::vector<double>& p,
+                      const std::vector<double>& times)
+  {
+    assertEqual(x0.size(), nx, "Size of the initial state does not match nx.");
+    std::vector<double> out(nx*times.size());
+    simulate(x0.data(), u.empty() ? nullptr : u.data(), p.empty() ? nullptr : p.data(),
+             times.data(), times.size(), out.data());
+    return Trajectory(system.states(), times, out);
+  }
+
+  // Statistics of the last simulation
+  int numEvaluations() const { return n_evaluations; }
+  int numAcceptedSteps() const { return n_accepted; }
+  int numRejectedSteps() const { return n_rejected; }
+
+private:
+
+  void evaluate(const double* x, const double* u, const double* p, double* dx)
+  {
+    system.evaluate(x, nullptr, u, p, dx, nullptr, ws);
+    n_evaluations++;
+  }
+
+  // Stages 2 to 7 from y and k[0], returns the scaled error norm
+  double attemptStep(const double* u, const double* p, const double h)
+  {
+    static const double kA[7][6] = {
+      {0, 0, 0, 0, 0, 0},
+      {1./5, 0, 0, 0, 0, 0},
+      {3./40, 9./40, 0, 0, 0, 0},
+      {44./45, -56./15, 32./9, 0, 0, 0},
+      {19372./6561, -25360./2187, 64448./6561, -212./729, 0, 0},
+      {9017./3168, -355./33, 46732./5247, 49./176, -5103./18656, 0},
+      {35./384, 0, 500./1113, 125./192, -2187./6784, 11./84}};
+
+    // difference of the 5th and 4th order weights
+    static const double kE[7] = {71./57600, 0, -71./16695, 71./1920, -17253./339200, 22./525, -1./40};
+
+    for (int i = 1; i < 7; i++)
+    {
+      for (int e = 0; e < nx; e++)
+      {
+        double dx = 0;
+        for (int j = 0; j < i; j++) {
+          dx += kA[i][j]*k[j][e];
+        }
+        stage_state[e] = y[e] + h*dx;
+      }
+      if (i == 6) {
+        // the last stage is evaluated at the 5th order solution
+        std::copy(stage_state.begin(), stage_state.end(), y_new.begin());
+      }
+      evaluate(stage_state.data(), u, p, k[i].data());
+    }
+
+    double sum = 0;
+    for (int e = 0; e < nx; e++)
+    {
+      double err = 0;
+      for (int i = 0; i < 7; i++) {
+        err += kE[i]*k[i][e];
+      }
+      double scale = opts.abs_tol + opts.rel_tol*std::max(std::fabs(y[e]), std::fabs(y_new[e]));
+      sum += (h*err/scale)*(h*err/scale);
+    }
+    return nx > 0 ? std::sqrt(sum/nx) : 0.;
+  }
+
+  // Continuous extension at theta in [0,1] of the last accepted step
+  void interpolate(const double theta, const double h, double* out) const
+  {
+    static const double kD[7] = {-12715105075./11282082432, 0, 87487479700./32700410799,
+                                 -10690763975./1880347072, 701980252875./199316789632,
+                                 -1453857185./822651844, 69997945./29380423};
+
+    const double theta1 = 1. - theta;
+    for (int e = 0; e < nx; e++)
+    {
+      double diff = y_new[e] - y[e];
+      double r3 = h*k[0][e] - diff;
+      double r4 = diff - h*k[6][e] - r3;
+      double r5 = 0;
+      for (int i = 0; i < 7; i++) {
+        r5 += kD[i]*k[i][e];
+      }
+      r5 *= h;
+      out[e] = y[e] + theta*(diff + theta1*(r3 + theta*(r4 + theta1*r5)));
+    }
+  }
+
+  // Step with y/dy ~ 1% of the state scale
+  double initialStep(const double span) const
+  {
+    double d0 = 0, d1 = 0;
+    for (int e = 0; e < nx; e++)
+    {
+      double scale = opts.abs_tol + opts.rel_tol*std::fabs(y[e]);
+      d0 += (y[e]/scale)*(y[e]/scale);
+      d1 += (k[0][e]/scale)*(k[0][e]/scale);
+    }
+    double h = (d0 < 1e-10 || d1 < 1e-10) ? 1e-6 : 0.01*std::sqrt(d0/d1);
+    return std::min(std::min(h, span), opts.max_step);
+  }
+
+  System& system;
+  DormandPrinceOptions opts;
+  int nx;
+  FunctionWorkspace ws;
+
+  std::vector<std::vector<double> > k;  // stages, k[0] is the derivative at y
+  std::vector<double> y;
+  std::vector<double> y_new;
+  std::vector<double> stage_state;
+
+  int n_evaluations;
+  int n_accepted;
+  int n_rejected;
+};
+
+} // namespace ocl
+#endif // OCL_DORMAND_PRINCE_H_
@@ -0,0 +1,185 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_ENSEMBLE_H_
+#define OCL_ENSEMBLE_H_
+
+#include <algorithm>  // copy, min
+#include <string>
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "utils/functions.h"   // range
+#include "tensor/tree_builder.h"
+#include "tensor/tree_tensor.h"
+#include "system.h"
+#include "integrator/butcher_tableau.h"
+#include "integrator/explicit_rk.h"
+
+namespace ocl {
+
+// Sampled states of K trajectories on a common time grid, trajectory major:
+// all samples of trajectory 0, then all samples of trajectory 1, ... Within
+// a trajectory the layout is the same as for Trajectory.
+class EnsembleTrajectories
+{
+public:
+
+  EnsembleTrajectories(const Tree& states, const int K, const std::vector<double>& times,
+                       const std::vector<double>& data)
+      : K(K), sample_times(times), storage(Matrix(data))
+  {
+    TreeBuilder tb;
+    tb.addRepeated({"x"}, {states}, K*times.size());
+    tree = tb.tree().get("x");
+  }
+
+  // Only the TreeTensors refer to the storage, copies would dangle
+  EnsembleTrajectories(const EnsembleTrajectories&) = delete;
+  EnsembleTrajectories& operator=(const EnsembleTrajectories&) = delete;
+  EnsembleTrajectories(EnsembleTrajectories&&) = default;
+
+  int numTrajectories() const { return K; }
+  const std::vector<double>& times() const { return sample_times; }
+
+  // Raw values, nx-by-(number of samples * K), column major
+  std::vector<double> data() const { return storage.data(); }
+
+  // All samples of all trajectories, e.g. states().get("p")
+  TreeTensor states() { return TreeTensor(tree, storage); }
+
+  // Samples of trajectory k. Valid as long as the ensemble exists.
+  TreeTensor trajectory(const int k)
+  {
+    const int n = sample_times.size();
+    return TreeTensor(tree.at(range(k*n, (k+1)*n)), storage);
+  }
+
+private:
+  int K;
+  std::vector<double> sample_times;
+  ValueStorage storage;
+  Tree tree;
+};
+
+// Integrates many trajectories of one system, e.g. for Monte-Carlo studies
+// with perturbed initial states, controls and parameters.
+//
+// The trajectories are processed in chunks of `lanes` trajectories. All
+// lanes of a chunk share the same step sequence and every stage is one
+// batched evaluation of the system for the whole chunk (see
+// ExplicitRungeKutta). A short last chunk is padded with copies of its last
+// trajectory, the lane buffers are allocated once.
+class Ensemble
+{
+public:
+
+  Ensemble(System& system, const ButcherTableau& tableau, const int lanes = 8,
+           const std::string& parallelization = "serial")
+      : system(system), lanes(lanes), nx(system.nx()), nu(system.nu()), np(system.np()),
+        rk(system, tableau, lanes, parallelization),
+        x_lanes(nx*lanes), u_lanes(nu*lanes), p_lanes(np*lanes) { }
+
+  int numLanes() const { return lanes; }
+
+  // Integrates K trajectories with n_steps steps of size h from t=0. x0, u
+  // and p hold one column per trajectory (nx-by-K, nu-by-K, np-by-K). The
+  // states are sampled every sample_every steps including t=0 and written
+  // trajectory major to out (nx-by-(n_steps/sample_every+1)*K).
+  void simulate(const double* x0, const double* u, const double* p, const int K, const double h,
+                const int n_steps, const int sample_every, double* out)
+  {
+    const int n_samples = numSamples(n_steps, sample_every);
+
+    for (int k0 = 0; k0 < K; k0 += lanes)
+    {
+      const int n_active = std::min(lanes, K-k0);
+      for (int l = 0; l < lanes; l++)
+      {
+        const int k = k0 + std::min(l, n_active-1);
+        std::copy(x0 + k*nx, x0 + (k+1)*nx, x_lanes.begin() + l*nx);
+        copyColumn(u, k, nu, u_lanes.data() + l*nu);
+        copyColumn(p, k, np, p_lanes.data() + l*np);
+      }
+
+      store(k0, n_active, n_samples, 0, out);
+      for (int step = 1; step <= n_steps; step++)
+      {
+        rk.step(x_lanes.data(), u_lanes.data(), p_lanes.data(), h, x_lanes.data());
+        if (step % sample_every == 0) {
+          store(k0, n_active, n_samples, step/sample_every, out);
+        }
+      }
+    }
+  }
+
+  EnsembleTrajectories simulate(const std::vector<double>& x0, const std::vector<double>& u,
+                                const std::vector<double>& p, const int K, const double h,
+                                const int n_steps, const int sample_every = 1)
+  {
+    assertEqual(x0.size(), nx*K, "Size of the initial states does not match nx*K.");
+    assertEqual(u.size(), nu*K, "Size of the controls does not match nu*K.");
+    assertEqual(p.size(), np*K, "Size of the parameters does not match np*K.");
+
+    const int n_samples = numSamples(n_steps, sample_every);
+    std::vector<double> out(nx*n_samples*K);
+    simulate(x0.data(), u.data(), p.data(), K, h, n_steps, sample_every, out.data());
+
+    std::vector<double> times(n_samples);
+    for (int s = 0; s < n_samples; s++) {
+      times[s] = s*sample_every*h;
+    }
+    return EnsembleTrajectories(system.states(), K, times, out);
+  }
+
+private:
+
+  static int numSamples(const int n_steps, const int sample_every)
+  {
+    if (sample_every <= 0 || n_steps % sample_every != 0) {
+      throw OclException("Number of steps must be a multiple of the sampling interval.");
+    }
+    return n_steps/sample_every + 1;
+  }
+
+  static void copyColumn(const double* values, const int k, const int n, double* dest)
+  {
+    if (values) {
+      std::copy(values + k*n, values + (k+1)*n, dest);
+    } else {
+      std::fill(dest, dest+n, 0.);
+    }
+  }
+
+  // lane l of the chunk is trajectory k0+l, padding lanes are skipped
+  void store(const int k0, const int n_active, const int n_samples, const int sample, double* out) const
+  {
+    for (int l = 0; l < n_active; l++) {
+      std::copy(x_lanes.begin() + l*nx, x_lanes.begin() + (l+1)*nx,
+                out + ((k0+l)*n_samples + sample)*nx);
+    }
+  }
+
+  System& system;
+  int lanes;
+  int nx, nu, np;
+  ExplicitRungeKutta rk;
+
+  std::vector<double> x_lanes;  // nx-by-lanes
+  std::vector<double> u_lanes;
+  std::vector<double> p_lanes;
+};
+
+} // namespace ocl
+#endif // OCL_ENSEMBLE_H_
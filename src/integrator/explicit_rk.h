@@ -0,0 +1,139 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_EXPLICIT_RK_H_
+#define OCL_EXPLICIT_RK_H_
+
+#include <algorithm>  // copy
+#include <string>
+#include <utility>    // pair
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "system.h"
+#include "integrator/butcher_tableau.h"
+
+namespace ocl {
+
+// Fixed step explicit Runge-Kutta integrator for systems without algebraic
+// variables.
+//
+// Integrates N trajectories in lockstep: states are column stacked (nx-by-N),
+// controls and parameters as well (nu-by-N, np-by-N), and each stage is one
+// batched evaluation of the system for all trajectories. All buffers are
+// allocated in the constructor.
+class ExplicitRungeKutta
+{
+public:
+
+  ExplicitRungeKutta(System& system, const ButcherTableau& tableau, const int N = 1,
+                     const std::string& parallelization = "serial")
+      : system(system), tableau(tableau), N(N), n(system.nx()*N),
+        stage_values(tableau.stages(), std::vector<double>(system.nx()*N)),
+        stage_state(system.nx()*N),
+        ws(N == 1 ? system.workspace() : system.batchWorkspace(N, parallelization))
+  {
+    if (!tableau.isExplicit()) {
+      throw OclException("Explicit Runge-Kutta requires a strictly lower triangular Butcher tableau.");
+    }
+    if (system.nz() > 0) {
+      throw OclException("Explicit Runge-Kutta does not support algebraic variables.");
+    }
+
+    // nonzero coefficients of A only
+    for (int i = 0; i < tableau.stages(); i++)
+    {
+      std::vector<std::pair<int, double> > row;
+      for (int j = 0; j < i; j++) {
+        if (tableau.A[i][j] != 0.) {
+          row.push_back(std::make_pair(j, tableau.A[i][j]));
+        }
+      }
+      a_nz.push_back(row);
+    }
+  }
+
+  int numTrajectories() const { return N; }
+  const ButcherTableau& butcherTableau() const { return tableau; }
+
+  // One step of size h from x0 to xf, xf may be x0.
+  // Null controls or parameters are treated as zero.
+  void step(const double* x0, const double* u, const double* p, const double h, double* xf)
+  {
+    for (int i = 0; i < tableau.stages(); i++)
+    {
+      const double* xi = x0;
+      if (!a_nz[i].empty())
+      {
+        std::copy(x0, x0+n, stage_state.begin());
+        for (auto& a : a_nz[i]) {
+          axpy(h*a.second, stage_values[a.first].data(), stage_state.data());
+        }
+        xi = stage_state.data();
+      }
+      system.evaluate(xi, nullptr, u, p, stage_values[i].data(), nullptr, ws);
+    }
+
+    if (xf != x0) {
+      std::copy(x0, x0+n, xf);
+    }
+    for (int i = 0; i < tableau.stages(); i++) {
+      if (tableau.b[i] != 0.) {
+        axpy(h*tableau.b[i], stage_values[i].data(), xf);
+      }
+    }
+  }
+
+  // n_steps steps of size h, controls and parameters constant.
+  void integrate(const double* x0, const double* u, const double* p, const double h,
+                 const int n_steps, double* xf)
+  {
+    if (xf != x0) {
+      std::copy(x0, x0+n, xf);
+    }
+    for (int k = 0; k < n_steps; k++) {
+      step(xf, u, p, h, xf);
+    }
+  }
+
+  void integrate(const std::vector<double>& x0, const std::vector<double>& u, const std::vector<double>& p,
+                 const double h, const int n_steps, std::vector<double>& xf)
+  {
+    assertEqual(x0.size(), n, "Size of the initial states does not match nx*N.");
+    xf.resize(n);
+    integrate(x0.data(), u.empty() ? nullptr : u.data(), p.empty() ? nullptr : p.data(), h, n_steps, xf.data());
+  }
+
+private:
+  // y += a*x
+  void axpy(const double a, const double* x, double* y) const
+  {
+    for (int e = 0; e < n; e++) {
+      y[e] += a*x[e];
+    }
+  }
+
+  System& system;
+  ButcherTableau tableau;
+  int N;
+  int n;  // nx*N
+  std::vector<std::vector<std::pair<int, double> > > a_nz;
+
+  std::vector<std::vector<double> > stage_values;  // k_i
+  std::vector<double> stage_state;
+  FunctionWorkspace ws;
+};
+
+} // namespace ocl
+#endif // OCL_EXPLICIT_RK_H_
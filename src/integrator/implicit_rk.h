@@ -0,0 +1,370 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_IMPLICIT_RK_H_
+#define OCL_IMPLICIT_RK_H_
+
+#include <algorithm>  // copy, fill
+#include <cmath>      // fabs
+#include <string>
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "system.h"
+#include "integrator/butcher_tableau.h"
+
+namespace ocl {
+
+struct ImplicitRungeKuttaOptions
+{
+  ImplicitRungeKuttaOptions()
+      : tolerance(1e-10), max_iterations(20), reuse_jacobian(true), max_contraction(0.3),
+        linear_solver("csparse") { }
+
+  double tolerance;          // on the max norm of the Newton step
+  int max_iterations;
+  bool reuse_jacobian;       // keep the factorization across iterations and steps
+  double max_contraction;    // slower Newton contraction refreshes the Jacobian
+  std::string linear_solver; // casadi::Linsol plugin, sparse LU by default
+};
+
+// Fixed step implicit Runge-Kutta (collocation) integrator for semi-explicit
+// index-1 DAEs x' = f(x,z,u,p), 0 = g(x,z,u,p), e.g. with Gauss-Legendre or
+// Radau IIA tableaus.
+//
+// The stage unknowns w = [K_1; Z_1; ...; K_s; Z_s] solve
+//
+//   K_i - f(x0 + h*sum_j a_ij*K_j, Z_i) = 0
+//         g(x0 + h*sum_j a_ij*K_j, Z_i) = 0
+//
+// with simplified Newton: the sparse Jacobian is factorized once and reused
+// over iterations and steps as long as Newton contracts fast enough.
+// Forward sensitivities follow from the implicit function theorem with one
+// additional (exact) factorization at the solution.
+class ImplicitRungeKutta
+{
+public:
+
+  ImplicitRungeKutta(System& system, const ButcherTableau& tableau,
+                     const ImplicitRungeKuttaOptions& opts = ImplicitRungeKuttaOptions())
+      : tableau(tableau), opts(opts), nx(system.nx()), nz(system.nz()), nu(system.nu()), np(system.np()),
+        s(tableau.stages()), nw((system.nx()+system.nz())*tableau.stages()),
+        current_h(0), jacobian_valid(false), refresh_jacobian(true),
+        n_jacobians(0), n_factorizations(0), n_iterations(0)
+  {
+    if (system.ni() != nz) {
+      throw OclException("Implicit Runge-Kutta requires one implicit equation per algebraic variable.");
+    }
+    setupFunctions(system);
+
+    w.resize(nw);
+    dw.resize(nw);
+    residual.resize(nw);
+    jac_nz.resize(jacobian_fcn.nnz_out(0));
+    jac_q.resize(nw*nq());
+    f0.resize(nx);
+
+    residual_ws = FunctionWorkspace(residual_fcn);
+    jacobian_ws = FunctionWorkspace(jacobian_fcn);
+    sensitivity_ws = FunctionWorkspace(sensitivity_fcn);
+    ode_ws = system.workspace();
+
+    linsol = ::casadi::Linsol("irk_linsol", opts.linear_solver, jacobian_fcn.sparsity_out(0));
+    linsol_mem = linsol.checkout();
+  }
+
+  ~ImplicitRungeKutta() { linsol.release(linsol_mem); }
+
+  ImplicitRungeKutta(const ImplicitRungeKutta&) = delete;
+  ImplicitRungeKutta& operator=(const ImplicitRungeKutta&) = delete;
+
+  // Number of sensitivity columns, q = [x0; u; p]
+  int nq() const { return nx + nu + np; }
+
+  // One step of size h. z0 is the initial guess for the algebraic variables,
+  // zf the algebraic variables of the last stage (at the end of the step for
+  // stiffly accurate methods like Radau IIA). xf and zf may alias x0 and z0.
+  // If sens is given, it receives dxf/d[x0; u; p] (nx-by-nq, column major).
+  // Null controls, parameters or z0 are treated as zero.
+  void step(const double* x0, const double* z0, const double* u, const double* p, const double h,
+            double* xf, double* zf, double* sens = nullptr)
+  {
+    if (h != current_h) {
+      current_h = h;
+      refresh_jacobian = true;
+    }
+    initialGuess(x0, z0, u, p);
+    solveStageEquations(x0, u, p);
+
+    if (sens) {
+      sensitivities(x0, u, p, sens);
+    }
+
+    for (int e = 0; e < nx; e++)
+    {
+      double dx = 0;
+      for (int i = 0; i < s; i++) {
+        dx += tableau.b[i]*w[i*(nx+nz) + e];
+      }
+      xf[e] = x0[e] + h*dx;
+    }
+    if (zf) {
+      std::copy(&w[(s-1)*(nx+nz) + nx], &w[s*(nx+nz)], zf);
+    }
+  }
+
+  // n_steps steps of size h with constant controls and parameters. With sens
+  // the sensitivities of the final state are chained over the steps.
+  void integrate(const double* x0, const double* z0, const double* u, const double* p, const double h,
+                 const int n_steps, double* xf, double* zf, double* sens = nullptr)
+  {
+    std::vector<double> x(x0, x0+nx);
+    std::vector<double> z(nz, 0.);
+    if (z0) {
+      std::copy(z0, z0+nz, z.begin());
+    }
+
+    std::vector<double> step_sens, total_sens;
+    if (sens)
+    {
+      step_sens.resize(nx*nq());
+      total_sens.assign(nx*nq(), 0.);
+      for (int e = 0; e < nx; e++) {
+        total_sens[e*nx + e] = 1.;
+      }
+    }
+
+    for (int k = 0; k < n_steps; k++)
+    {
+      step(x.data(), z.data(), u, p, h, x.data(), z.data(), sens ? step_sens.data() : nullptr);
+      if (sens) {
+        chain(step_sens, total_sens);
+      }
+    }
+
+    std::copy(x.begin(), x.end(), xf);
+    if (zf) {
+      std::copy(z.begin(), z.end(), zf);
+    }
+    if (sens) {
+      std::copy(total_sens.begin(), total_sens.end(), sens);
+    }
+  }
+
+  // Sparsity of the stage equation Jacobian d(residual)/dw
+  const ::casadi::Sparsity& jacobianSparsity() const { return jacobian_fcn.sparsity_out(0); }
+
+  // Statistics, e.g. to check how often the factorization is reused
+  int numJacobianEvaluations() const { return n_jacobians; }
+  int numFactorizations() const { return n_factorizations; }
+  int numNewtonIterations() const { return n_iterations; }
+
+private:
+
+  void setupFunctions(const System& system)
+  {
+    CasadiMatrix x0 = CasadiMatrix::sym("x0", nx);
+    CasadiMatrix u = CasadiMatrix::sym("u", nu);
+    CasadiMatrix p = CasadiMatrix::sym("p", np);
+    CasadiMatrix h = CasadiMatrix::sym("h");
+
+    std::vector<CasadiMatrix> K, Z;
+    for (int i = 0; i < s; i++) {
+      K.push_back(CasadiMatrix::sym("K_" + std::to_string(i), nx));
+      Z.push_back(CasadiMatrix::sym("Z_" + std::to_string(i), nz));
+    }
+
+    std::vector<CasadiMatrix> w_parts, r_parts;
+    for (int i = 0; i < s; i++)
+    {
+      CasadiMatrix xi = x0;
+      for (int j = 0; j < s; j++) {
+        if (tableau.A[i][j] != 0.) {
+          xi = xi + h*tableau.A[i][j]*K[j];
+        }
+      }
+      std::vector<CasadiMatrix> out = system.expressionFunction()(std::vector<CasadiMatrix>{xi, Z[i], u, p});
+      w_parts.push_back(K[i]);
+      w_parts.push_back(Z[i]);
+      r_parts.push_back(K[i] - out[0]);
+      r_parts.push_back(out[1]);
+    }
+
+    CasadiMatrix w_sym = CasadiMatrix::vertcat(w_parts);
+    CasadiMatrix r = CasadiMatrix::vertcat(r_parts);
+    CasadiMatrix q = CasadiMatrix::vertcat({x0, u, p});
+    std::vector<CasadiMatrix> in = {x0, w_sym, u, p, h};
+
+    residual_fcn = ::casadi::Function("irk_residual", in, {r});
+    jacobian_fcn = ::casadi::Function("irk_jacobian", in, {CasadiMatrix::jacobian(r, w_sym)});
+    sensitivity_fcn = ::casadi::Function("irk_sensitivity", in,
+                                         {CasadiMatrix::densify(CasadiMatrix::jacobian(r, q))});
+  }
+
+  // All stages start at the derivative at x0, algebraics at z0
+  void initialGuess(const double* x0, const double* z0, const double* u, const double* p)
+  {
+    const double* inputs[4] = {x0, z0, u, p};
+    double* outputs[2] = {f0.data(), nullptr};
+    ode_ws.evaluate(inputs, outputs);
+    for (int i = 0; i < s; i++)
+    {
+      std::copy(f0.begin(), f0.end(), &w[i*(nx+nz)]);
+      if (z0) {
+        std::copy(z0, z0+nz, &w[i*(nx+nz) + nx]);
+      } else {
+        std::fill(&w[i*(nx+nz) + nx], &w[(i+1)*(nx+nz)], 0.);
+      }
+    }
+  }
+
+  void factorize(const double* x0, const double* u, const double* p)
+  {
+    const double* inputs[5] = {x0, w.data(), u, p, &current_h};
+    double* outputs[1] = {jac_nz.data()};
+    jacobian_ws.evaluate(inputs, outputs);
+    n_jacobians++;
+
+    if (linsol.nfact(jac_nz.data(), linsol_mem)) {
+      throw OclException("Factorization of the stage equation Jacobian failed.");
+    }
+    n_factorizations++;
+    jacobian_valid = true;
+    refresh_jacobian = false;
+  }
+
+  void solveStageEquations(const double* x0, const double* u, const double* p)
+  {
+    // Jacobian evaluated in this step (not reused from an earlier one)
+    bool fresh = false;
+    if (!opts.reuse_jacobian || !jacobian_valid || refresh_jacobian) {
+      factorize(x0, u, p);
+      fresh = true;
+    }
+
+    double previous_norm = 0;
+    for (int iter = 0; iter < opts.max_iterations; iter++)
+    {
+      const double* inputs[5] = {x0, w.data(), u, p, &current_h};
+      double* outputs[1] = {residual.data()};
+      residual_ws.evaluate(inputs, outputs);
+
+      std::copy(residual.begin(), residual.end(), dw.begin());
+      if (linsol.solve(jac_nz.data(), dw.data(), 1, false, linsol_mem)) {
+        throw OclException("Solution of the stage equations failed.");
+      }
+      n_iterations++;
+
+      double norm = 0;
+      for (int k = 0; k < nw; k++) {
+        w[k] -= dw[k];
+        norm = std::max(norm, std::fabs(dw[k]));
+      }
+      if (norm <= opts.tolerance) {
+        return;
+      }
+
+      if (iter > 0 && norm > opts.max_contraction*previous_norm)
+      {
+        if (!fresh) {
+          // the reused Jacobian is too far off, refresh it at the current iterate
+          factorize(x0, u, p);
+          fresh = true;
+        } else if (norm >= previous_norm) {
+          throw OclException("Newton iteration of the implicit Runge-Kutta step diverged.");
+        }
+      }
+      previous_norm = norm;
+    }
+    throw OclException("Newton iteration of the implicit Runge-Kutta step did not converge.");
+  }
+
+  // dxf/dq = [I 0] + h*sum_i b_i*dK_i/dq with dw/dq = -J^-1*dR/dq at the solution
+  void sensitivities(const double* x0, const double* u, const double* p, double* sens)
+  {
+    factorize(x0, u, p);
+
+    const double* inputs[5] = {x0, w.data(), u, p, &current_h};
+    double* outputs[1] = {jac_q.data()};
+    sensitivity_ws.evaluate(inputs, outputs);
+    if (linsol.solve(jac_nz.data(), jac_q.data(), nq(), false, linsol_mem)) {
+      throw OclException("Solution of the sensitivity equations failed.");
+    }
+
+    for (int c = 0; c < nq(); c++)
+    {
+      for (int e = 0; e < nx; e++)
+      {
+        double dk = 0;
+        for (int i = 0; i < s; i++) {
+          dk += tableau.b[i]*jac_q[c*nw + i*(nx+nz) + e];
+        }
+        sens[c*nx + e] = (c == e ? 1. : 0.) - current_h*dk;
+      }
+    }
+  }
+
+  // total = step*[total_x, total_up] + [0, step_up]
+  void chain(const std::vector<double>& step_sens, std::vector<double>& total)
+  {
+    std::vector<double> result(nx*nq(), 0.);
+    for (int c = 0; c < nq(); c++)
+    {
+      for (int k = 0; k < nx; k++)
+      {
+        const double t = total[c*nx + k];
+        if (t != 0.) {
+          for (int e = 0; e < nx; e++) {
+            result[c*nx + e] += step_sens[k*nx + e]*t;
+          }
+        }
+      }
+      if (c >= nx) {
+        for (int e = 0; e < nx; e++) {
+          result[c*nx + e] += step_sens[c*nx + e];
+        }
+      }
+    }
+    total = result;
+  }
+
+  ButcherTableau tableau;
+  ImplicitRungeKuttaOptions opts;
+  int nx, nz, nu, np;
+  int s;
+  int nw;
+
+  ::casadi::Function residual_fcn;
+  ::casadi::Function jacobian_fcn;
+  ::casadi::Function sensitivity_fcn;
+  FunctionWorkspace residual_ws;
+  FunctionWorkspace jacobian_ws;
+  FunctionWorkspace sensitivity_ws;
+  FunctionWorkspace ode_ws;
+
+  ::casadi::Linsol linsol;
+  int linsol_mem;
+
+  std::vector<double> w, dw, residual, jac_nz, jac_q, f0;
+  double current_h;
+  bool jacobian_valid;
+  bool refresh_jacobian;
+
+  int n_jacobians;
+  int n_factorizations;
+  int n_iterations;
+};
+
+} // namespace ocl
+#endif // OCL_IMPLICIT_RK_H_
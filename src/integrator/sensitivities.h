@@ -0,0 +1,263 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_SENSITIVITIES_H_
+#define OCL_SENSITIVITIES_H_
+
+#include <algorithm>  // copy, fill, min
+#include <cmath>      // sqrt, ceil
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "system.h"
+#include "integrator/butcher_tableau.h"
+
+namespace ocl {
+
+// Fixed step explicit Runge-Kutta integrator with derivatives of the final
+// state with respect to w = [x0; u; p].
+//
+// The derivatives are those of the discrete integration map (discretize,
+// then differentiate), so they are exact up to rounding for the computed
+// final state and consistent with finite differences of integrate.
+//
+// forward propagates the full sensitivity matrix dxf/dw with the variational
+// equations of the stages, one directional derivative per column of w.
+// adjoint computes seed'*dxf/dw with one backward sweep. The states are only
+// stored at checkpoints every checkpoint_interval steps (default sqrt of the
+// number of steps) and recomputed per segment in the backward sweep, so the
+// memory is O(sqrt(N)) states for N steps at the cost of one additional
+// forward integration.
+class RungeKuttaSensitivities
+{
+public:
+
+  RungeKuttaSensitivities(System& system, const ButcherTableau& tableau, const int checkpoint_interval = 0)
+      : system(system), tableau(tableau), interval(checkpoint_interval),
+        nx(system.nx()), nu(system.nu()), np(system.np()), nw(nx+nu+np),
+        ws(system.workspace()), forward_ws(system.forwardWorkspace()), adjoint_ws(system.adjointWorkspace()),
+        k(tableau.stages(), std::vector<double>(nx)), stage_states(tableau.stages(), std::vector<double>(nx)),
+        seed(nw), n_checkpoints(0)
+  {
+    if (!tableau.isExplicit()) {
+      throw OclException("Sensitivities require a strictly lower triangular Butcher tableau.");
+    }
+    if (system.nz() > 0) {
+      throw OclException("Sensitivities of explicit Runge-Kutta do not support algebraic variables.");
+    }
+  }
+
+  // Final state xf and the sensitivities dxf/d[x0;u;p] (nx-by-(nx+nu+np),
+  // column major) after n_steps steps of size h.
+  void forward(const double* x0, const double* u, const double* p, const double h, const int n_steps,
+               double* xf, double* dxf)
+  {
+    // dk_i and dX_i, nx-by-nw each
+    std::vector<std::vector<double> > dk(tableau.stages(), std::vector<double>(nx*nw));
+    std::vector<double> dxi(nx*nw);
+
+    std::vector<double> x(x0, x0+nx);
+    std::fill(dxf, dxf+nx*nw, 0.);
+    for (int e = 0; e < nx; e++) {
+      dxf[e*nx+e] = 1.;
+    }
+
+    for (int step = 0; step < n_steps; step++)
+    {
+      for (int i = 0; i < tableau.stages(); i++)
+      {
+        stageState(x.data(), h, i, stage_states[i].data());
+        std::copy(dxf, dxf+nx*nw, dxi.begin());
+        for (int j = 0; j < i; j++) {
+          if (tableau.A[i][j] != 0.) {
+            axpy(nx*nw, h*tableau.A[i][j], dk[j].data(), dxi.data());
+          }
+        }
+        evaluate(stage_states[i].data(), u, p, k[i].data());
+
+        // dk_i = df/dv*[dX_i; du; dp] column by column
+        for (int c = 0; c < nw; c++)
+        {
+          std::copy(&dxi[c*nx], &dxi[c*nx]+nx, seed.begin());
+          for (int e = nx; e < nw; e++) {
+            seed[e] = e == c ? 1. : 0.;
+          }
+          system.forwardDerivative(stage_states[i].data(), nullptr, u, p, seed.data(), &dk[i][c*nx], forward_ws);
+        }
+      }
+
+      for (int i = 0; i < tableau.stages(); i++) {
+        if (tableau.b[i] != 0.) {
+          axpy(nx, h*tableau.b[i], k[i].data(), x.data());
+          axpy(nx*nw, h*tableau.b[i], dk[i].data(), dxf);
+        }
+      }
+    }
+    std::copy(x.begin(), x.end(), xf);
+  }
+
+  // Final state xf and the gradient of seed_xf'*xf with respect to [x0;u;p]
+  // (size nx+nu+np) after n_steps steps of size h.
+  void adjoint(const double* x0, const double* u, const double* p, const double h, const int n_steps,
+               const double* seed_xf, double* xf, double* grad)
+  {
+    const int m = interval > 0 ? interval : std::max(1, (int)std::ceil(std::sqrt((double)n_steps)));
+
+    // forward sweep, keeps the state at the start of every segment
+    n_checkpoints = (n_steps + m - 1)/m;
+    std::vector<std::vector<double> > checkpoints(n_checkpoints, std::vector<double>(nx));
+    std::vector<double> x(x0, x0+nx);
+    for (int step = 0; step < n_steps; step++)
+    {
+      if (step % m == 0) {
+        std::copy(x.begin(), x.end(), checkpoints[step/m].begin());
+      }
+      this->step(x.data(), u, p, h, x.data());
+    }
+    std::copy(x.begin(), x.end(), xf);
+
+    // backward sweep, lambda = d(seed'*xf)/dx of the current step
+    std::vector<double> lambda(seed_xf, seed_xf+nx);
+    std::fill(grad, grad+nw, 0.);
+    std::vector<std::vector<double> > segment(m, std::vector<double>(nx));
+    std::vector<std::vector<double> > mu(tableau.stages(), std::vector<double>(nw));
+    std::vector<double> kappa(nx);
+
+    for (int s = n_checkpoints-1; s >= 0; s--)
+    {
+      // recompute the states at the start of the steps of this segment
+      const int first = s*m;
+      const int n_segment = std::min(m, n_steps - first);
+      segment[0] = checkpoints[s];
+      for (int i = 1; i < n_segment; i++) {
+        this->step(segment[i-1].data(), u, p, h, segment[i].data());
+      }
+
+      for (int i = n_segment-1; i >= 0; i--)
+      {
+        // stage states of the step
+        for (int j = 0; j < tableau.stages(); j++) {
+          stageState(segment[i].data(), h, j, stage_states[j].data());
+          if (j+1 < tableau.stages()) {
+            evaluate(stage_states[j].data(), u, p, k[j].data());
+          }
+        }
+
+        // kappa_j = h*b_j*lambda + h*sum_{l>j} a_lj*mu_l[x]
+        // mu_j = (df/dv(X_j))'*kappa_j
+        for (int j = tableau.stages()-1; j >= 0; j--)
+        {
+          for (int e = 0; e < nx; e++) {
+            kappa[e] = h*tableau.b[j]*lambda[e];
+          }
+          for (int l = j+1; l < tableau.stages(); l++) {
+            if (tableau.A[l][j] != 0.) {
+              axpy(nx, h*tableau.A[l][j], mu[l].data(), kappa.data());
+            }
+          }
+          system.adjointDerivative(stage_states[j].data(), nullptr, u, p, kappa.data(), mu[j].data(), adjoint_ws);
+        }
+
+        for (int j = 0; j < tableau.stages(); j++)
+        {
+          axpy(nx, 1., mu[j].data(), lambda.data());
+          axpy(nu+np, 1., mu[j].data()+nx, grad+nx);
+        }
+      }
+    }
+    std::copy(lambda.begin(), lambda.end(), grad);
+  }
+
+  void forward(const std::vector<double>& x0, const std::vector<double>& u, const std::vector<double>& p,
+               const double h, const int n_steps, std::vector<double>& xf, std::vector<double>& dxf)
+  {
+    assertEqual(x0.size(), nx, "Size of the initial state does not match nx.");
+    xf.resize(nx);
+    dxf.resize(nx*nw);
+    forward(x0.data(), u.empty() ? nullptr : u.data(), p.empty() ? nullptr : p.data(), h, n_steps,
+            xf.data(), dxf.data());
+  }
+
+  void adjoint(const std::vector<double>& x0, const std::vector<double>& u, const std::vector<double>& p,
+               const double h, const int n_steps, const std::vector<double>& seed_xf,
+               std::vector<double>& xf, std::vector<double>& grad)
+  {
+    assertEqual(x0.size(), nx, "Size of the initial state does not match nx.");
+    assertEqual(seed_xf.size(), nx, "Size of the adjoint seed does not match nx.");
+    xf.resize(nx);
+    grad.resize(nw);
+    adjoint(x0.data(), u.empty() ? nullptr : u.data(), p.empty() ? nullptr : p.data(), h, n_steps,
+            seed_xf.data(), xf.data(), grad.data());
+  }
+
+  // Number of stored states of the last adjoint computation
+  int numCheckpoints() const { return n_checkpoints; }
+
+private:
+
+  // X_i = x + h*sum_j a_ij*k_j
+  void stageState(const double* x, const double h, const int i, double* xi) const
+  {
+    std::copy(x, x+nx, xi);
+    for (int j = 0; j < i; j++) {
+      if (tableau.A[i][j] != 0.) {
+        axpy(nx, h*tableau.A[i][j], k[j].data(), xi);
+      }
+    }
+  }
+
+  void step(const double* x0, const double* u, const double* p, const double h, double* xf)
+  {
+    for (int i = 0; i < tableau.stages(); i++) {
+      stageState(x0, h, i, stage_states[i].data());
+      evaluate(stage_states[i].data(), u, p, k[i].data());
+    }
+    if (xf != x0) {
+      std::copy(x0, x0+nx, xf);
+    }
+    for (int i = 0; i < tableau.stages(); i++) {
+      axpy(nx, h*tableau.b[i], k[i].data(), xf);
+    }
+  }
+
+  void evaluate(const double* x, const double* u, const double* p, double* dx)
+  {
+    system.evaluate(x, nullptr, u, p, dx, nullptr, ws);
+  }
+
+  // y += a*x
+  static void axpy(const int n, const double a, const double* x, double* y)
+  {
+    for (int e = 0; e < n; e++) {
+      y[e] += a*x[e];
+    }
+  }
+
+  System& system;
+  ButcherTableau tableau;
+  int interval;
+  int nx, nu, np, nw;
+
+  FunctionWorkspace ws;
+  FunctionWorkspace forward_ws;
+  FunctionWorkspace adjoint_ws;
+
+  std::vector<std::vector<double> > k;             // stage derivatives
+  std::vector<std::vector<double> > stage_states;  // X_i
+  std::vector<double> seed;
+  int n_checkpoints;
+};
+
+} // namespace ocl
+#endif // OCL_SENSITIVITIES_H_
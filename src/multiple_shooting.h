@@ -0,0 +1,387 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_MULTIPLE_SHOOTING_H_
+#define OCL_MULTIPLE_SHOOTING_H_
+
+#include <algorithm>  // copy, min, max
+#include <limits>
+#include <memory>     // unique_ptr
+#include <string>
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "tensor/casadi.h"
+#include "tensor/tree_builder.h"
+#include "integrator/butcher_tableau.h"
+#include "integrator/explicit_rk.h"
+#include "integrator/sensitivities.h"
+#include "function_interface.h"
+#include "thread_pool.h"
+#include "system.h"
+#include "ocp.h"
+
+namespace ocl {
+
+struct MultipleShootingOptions
+{
+  MultipleShootingOptions()
+      : control_intervals(20), steps_per_interval(10), tableau(ButcherTableau::RK4()),
+        path_constraints_at_boundary(true) { }
+
+  int control_intervals;
+  int steps_per_interval;             // integrator steps per control interval
+  ButcherTableau tableau;             // explicit Runge-Kutta method
+  bool path_constraints_at_boundary;  // also at the first and last node
+};
+
+// Multiple shooting transcription of an optimal control problem with
+// horizon T into a nonlinear program min J(w) s.t. lbg <= g(w) <= ubg,
+// lbw <= w <= ubw, for systems without algebraic variables.
+//
+//   w = [interval_0, ..., interval_N-1, xf, p],  interval_k = [x, u]
+//   g = [c_0; path_0; ...; c_N-1; path_N-1; path_N; boundary conditions]
+//
+// The continuity constraints c_k = F(x_k, u_k, p) - x_k+1 integrate each
+// control interval independently with a fixed step explicit Runge-Kutta
+// method. The intervals are integrated in parallel on the thread pool with
+// one integrator per worker, their sensitivities dF/d[x_k; u_k; p] are the
+// Jacobian blocks of the continuity constraints.
+//
+// Costs, path constraints and boundary conditions only depend on the nodes
+// and are evaluated from one symbolic function of w with its Jacobian. The
+// path costs are integrated with the rectangle rule on the nodes (controls
+// are constant on the intervals).
+class MultipleShooting
+{
+public:
+
+  MultipleShooting(OCP& ocp, const double T, ThreadPool& pool,
+                   const MultipleShootingOptions& opts = MultipleShootingOptions())
+      : ocp(ocp), pool(pool), opts(opts), N(opts.control_intervals), h(T/opts.control_intervals)
+  {
+    System& system = ocp.system();
+    if (system.nz() > 0) {
+      throw OclException("Multiple shooting does not support algebraic variables.");
+    }
+    nx = system.nx();
+    nu = system.nu();
+    np = system.np();
+    nw_sens = nx + nu + np;
+    n_path = ocp.numPathConstraints();
+    n_stage = nx + n_path;
+
+    TreeBuilder ib;
+    ib.add("x", system.states());
+    ib.add("u", system.controls());
+
+    TreeBuilder tb;
+    tb.addRepeated({"interval"}, {ib.tree()}, N);
+    tb.add("xf", system.states());
+    tb.add("p", system.parameters());
+    tree = tb.tree();
+
+    for (int i = 0; i < pool.size(); i++)
+    {
+      integrators.push_back(std::unique_ptr<ExplicitRungeKutta>(new ExplicitRungeKutta(system, opts.tableau)));
+      sensitivities.push_back(std::unique_ptr<RungeKuttaSensitivities>(
+          new RungeKuttaSensitivities(system, opts.tableau)));
+    }
+    x_end.resize(nx*N);
+    sens.resize(nx*nw_sens*N);
+
+    buildNodeFunctions();
+    buildJacobianStructure();
+    setupBounds(system);
+  }
+
+  // NLP variables, e.g. variables().get("interval").get("u") are the
+  // controls of all intervals
+  const Tree& variables() const { return tree; }
+
+  int nv() const { return tree.numel(); }
+  int ng() const { return N*n_stage + n_path + ocp.numBoundaryConditions(); }
+
+  int numIntervals() const { return N; }
+
+  // First of the nx rows of the continuity constraints of interval k in g
+  int continuityRow(const int k) const { return k*n_stage; }
+
+  // Objective and constraints at w
+  void evaluate(const double* w, double& J, double* g)
+  {
+    pool.parallelFor(N, [this, w](int k, int worker) {
+      integrators[worker]->integrate(&w[node(k)], &w[node(k)+nx], param(w), h/opts.steps_per_interval,
+                                     opts.steps_per_interval, &x_end[k*nx]);
+    });
+    evaluateNodes(w, J, g, nullptr, nullptr);
+  }
+
+  // Objective, constraints, gradient of the objective (size nv) and the
+  // nonzeros of the constraint Jacobian at w, see jacobianRows/Cols.
+  void evaluate(const double* w, double& J, double* g, double* grad, double* jac_nz)
+  {
+    pool.parallelFor(N, [this, w](int k, int worker) {
+      sensitivities[worker]->forward(&w[node(k)], &w[node(k)+nx], param(w), h/opts.steps_per_interval,
+                                     opts.steps_per_interval, &x_end[k*nx], &sens[k*nx*nw_sens]);
+    });
+    evaluateNodes(w, J, g, grad, jac_nz);
+
+    // continuity blocks dF/d[x_k; u_k; p] and -I for x_k+1
+    int nz = 0;
+    for (int k = 0; k < N; k++)
+    {
+      std::copy(&sens[k*nx*nw_sens], &sens[(k+1)*nx*nw_sens], &jac_nz[nz]);
+      nz += nx*nw_sens;
+      for (int e = 0; e < nx; e++) {
+        jac_nz[nz++] = -1.;
+      }
+    }
+  }
+
+  // Structure of the constraint Jacobian as triplets, in the order of the
+  // nonzeros written by evaluate
+  const std::vector<int>& jacobianRows() const { return jac_rows; }
+  const std::vector<int>& jacobianCols() const { return jac_cols; }
+
+  // Nonzeros of the lower triangle of the Hessian of the objective at w,
+  // see hessianRows/Cols. Curvature of the constraints is not included.
+  void evaluateCostHessian(const double* w, double* hess_nz)
+  {
+    const double* inputs[1] = {w};
+    double* outputs[1] = {hess_nz};
+    cost_hess_ws.evaluate(inputs, outputs);
+  }
+
+  const std::vector<int>& hessianRows() const { return hess_rows; }
+  const std::vector<int>& hessianCols() const { return hess_cols; }
+
+  const std::vector<double>& constraintLowerBounds() const { return lbg; }
+  const std::vector<double>& constraintUpperBounds() const { return ubg; }
+  const std::vector<double>& variableLowerBounds() const { return lbw; }
+  const std::vector<double>& variableUpperBounds() const { return ubw; }
+
+  // Bounds of a variable on all nodes
+  void setBounds(const std::string& id, const double lower, const double upper)
+  {
+    Tree intervals = tree.get("interval");
+    setBounds(intervals.get("x"), id, lower, upper);
+    setBounds(intervals.get("u"), id, lower, upper);
+    setBounds(tree.get("xf"), id, lower, upper);
+    setBounds(tree.get("p"), id, lower, upper);
+  }
+
+  // Bounds of a state at the start and at the end of the horizon
+  void setInitialBounds(const std::string& id, const double lower, const double upper)
+  {
+    setBounds(tree.get("interval").at(0).get("x"), id, lower, upper);
+  }
+
+  void setEndBounds(const std::string& id, const double lower, const double upper)
+  {
+    setBounds(tree.get("xf"), id, lower, upper);
+  }
+
+  // Zero, moved into the variable bounds
+  std::vector<double> initialGuess() const
+  {
+    std::vector<double> guess(nv());
+    for (int i = 0; i < nv(); i++) {
+      guess[i] = std::min(std::max(0., lbw[i]), ubw[i]);
+    }
+    return guess;
+  }
+
+private:
+
+  // Offset of the state of node k in w, the last node is xf
+  int node(const int k) const { return k < N ? k*(nx+nu) : N*(nx+nu); }
+  const double* param(const double* w) const { return np > 0 ? &w[N*(nx+nu)+nx] : nullptr; }
+
+  // Costs, path constraints and boundary conditions, and the continuity
+  // residuals from x_end
+  void evaluateNodes(const double* w, double& J, double* g, double* grad, double* jac_nz)
+  {
+    const double* inputs[1] = {w};
+    double* outputs[2] = {&J, node_g.data()};
+    if (grad)
+    {
+      double* jac_outputs[2] = {grad, node_jac_nz.data()};
+      node_jac_ws.evaluate(inputs, jac_outputs);
+    }
+    node_ws.evaluate(inputs, outputs);
+
+    for (int k = 0; k < N; k++)
+    {
+      for (int e = 0; e < nx; e++) {
+        g[k*n_stage + e] = x_end[k*nx+e] - w[node(k+1)+e];
+      }
+    }
+    for (unsigned int i = 0; i < node_g.size(); i++) {
+      g[node_rows[i]] = node_g[i];
+    }
+    if (jac_nz)
+    {
+      std::copy(node_jac_nz.begin(), node_jac_nz.end(), jac_nz + jac_rows.size() - node_jac_nz.size());
+    }
+  }
+
+  // Costs, path constraints on all nodes and boundary conditions as one
+  // function of w, g_nodes = [path_0, ..., path_N, boundary conditions]
+  void buildNodeFunctions()
+  {
+    CasadiMatrix w = CasadiMatrix::sym("w", nv());
+    CasadiMatrix X = treeColumns(w, tree.get("interval").get("x"), N);
+    CasadiMatrix U = treeColumns(w, tree.get("interval").get("u"), N);
+    CasadiMatrix xf = w(flatIndizes(tree.get("xf")));
+    std::vector< ::casadi::casadi_int > p_idz = flatIndizes(tree.get("p"));
+    CasadiMatrix p = p_idz.empty() ? CasadiMatrix::zeros(0,1) : w(p_idz);
+
+    std::vector<CasadiMatrix> l = ocp.pathCosts().map(N)(std::vector<CasadiMatrix>{
+        X, CasadiMatrix::zeros(0, N), U, CasadiMatrix::repmat(p, 1, N)});
+    CasadiMatrix J = h*CasadiMatrix::sum2(l[0]) + ocp.arrivalCosts()(std::vector<CasadiMatrix>{xf, p})[0];
+
+    std::vector<CasadiMatrix> path = ocp.pathConstraints().map(N+1)(std::vector<CasadiMatrix>{
+        CasadiMatrix::horzcat(std::vector<CasadiMatrix>{X, xf}), CasadiMatrix::repmat(p, 1, N+1)});
+    std::vector<CasadiMatrix> bc = ocp.boundaryConditions()(std::vector<CasadiMatrix>{
+        X(::casadi::Slice(), ::casadi::Slice(0)), xf, p});
+    CasadiMatrix g = CasadiMatrix::vertcat(std::vector<CasadiMatrix>{CasadiMatrix::vec(path[0]), bc[0]});
+
+    ::casadi::Function node_fcn("shooting_nodes", {w}, {J, g});
+    ::casadi::Function node_jac_fcn("shooting_nodes_jac", {w},
+                                    {CasadiMatrix::densify(CasadiMatrix::gradient(J, w)), CasadiMatrix::jacobian(g, w)});
+    ::casadi::Function cost_hess_fcn("shooting_cost_hess", {w}, {CasadiMatrix::tril(CasadiMatrix::hessian(J, w))});
+    node_ws = FunctionWorkspace(node_fcn);
+    node_jac_ws = FunctionWorkspace(node_jac_fcn);
+    cost_hess_ws = FunctionWorkspace(cost_hess_fcn);
+    node_g.resize(casadi::size(g, 0));
+    node_jac_nz.resize(node_jac_fcn.nnz_out(1));
+
+    // rows of g_nodes in g
+    for (int k = 0; k <= N; k++) {
+      for (int i = 0; i < n_path; i++) {
+        node_rows.push_back(k*n_stage + nx + i);
+      }
+    }
+    for (int i = 0; i < ocp.numBoundaryConditions(); i++) {
+      node_rows.push_back(N*n_stage + n_path + i);
+    }
+  }
+
+  void buildJacobianStructure()
+  {
+    for (int k = 0; k < N; k++)
+    {
+      for (int c = 0; c < nw_sens; c++)
+      {
+        int col = c < nx+nu ? k*(nx+nu) + c : N*(nx+nu) + nx + (c-nx-nu);
+        for (int e = 0; e < nx; e++)
+        {
+          jac_rows.push_back(k*n_stage + e);
+          jac_cols.push_back(col);
+        }
+      }
+      for (int e = 0; e < nx; e++)
+      {
+        jac_rows.push_back(k*n_stage + e);
+        jac_cols.push_back(node(k+1) + e);
+      }
+    }
+
+    std::vector< ::casadi::casadi_int > rows, cols;
+    node_jac_ws.function().sparsity_out(1).get_triplet(rows, cols);
+    for (unsigned int i = 0; i < rows.size(); i++)
+    {
+      jac_rows.push_back(node_rows[rows[i]]);
+      jac_cols.push_back(cols[i]);
+    }
+    cost_hess_ws.function().sparsity_out(0).get_triplet(rows, cols);
+    hess_rows.assign(rows.begin(), rows.end());
+    hess_cols.assign(cols.begin(), cols.end());
+
+    // bounds of the constraints
+    const double inf = std::numeric_limits<double>::infinity();
+    const std::vector<double> path_lb = ocp.pathConstraintsLowerBounds();
+    const std::vector<double> path_ub = ocp.pathConstraintsUpperBounds();
+    for (int k = 0; k <= N; k++)
+    {
+      if (k < N) {
+        lbg.insert(lbg.end(), nx, 0.);
+        ubg.insert(ubg.end(), nx, 0.);
+      }
+      const bool active = opts.path_constraints_at_boundary || (k > 0 && k < N);
+      for (int i = 0; i < n_path; i++)
+      {
+        lbg.push_back(active ? path_lb[i] : -inf);
+        ubg.push_back(active ? path_ub[i] : inf);
+      }
+    }
+    const std::vector<double> bc_lb = ocp.boundaryConditionsLowerBounds();
+    const std::vector<double> bc_ub = ocp.boundaryConditionsUpperBounds();
+    lbg.insert(lbg.end(), bc_lb.begin(), bc_lb.end());
+    ubg.insert(ubg.end(), bc_ub.begin(), bc_ub.end());
+  }
+
+  void setupBounds(System& system)
+  {
+    lbw.assign(nv(), -std::numeric_limits<double>::infinity());
+    ubw.assign(nv(), std::numeric_limits<double>::infinity());
+    for (auto& kv : system.bounds()) {
+      setBounds(kv.first, kv.second.lower_bound, kv.second.upper_bound);
+    }
+  }
+
+  void setBounds(const Tree& t, const std::string& id, const double lower, const double upper)
+  {
+    if (t.branches().count(id) == 0) {
+      return;
+    }
+    for (::casadi::casadi_int i : flatIndizes(t.get(id)))
+    {
+      lbw[i] = lower;
+      ubw[i] = upper;
+    }
+  }
+
+  OCP& ocp;
+  ThreadPool& pool;
+  MultipleShootingOptions opts;
+  int N;
+  double h;
+  int nx, nu, np, nw_sens;
+  int n_path;
+  int n_stage;  // constraints per interval
+  Tree tree;
+
+  // one integrator of each kind per worker
+  std::vector<std::unique_ptr<ExplicitRungeKutta> > integrators;
+  std::vector<std::unique_ptr<RungeKuttaSensitivities> > sensitivities;
+  std::vector<double> x_end;  // nx-by-N
+  std::vector<double> sens;   // nx-by-(nx+nu+np) per interval
+
+  FunctionWorkspace node_ws;
+  FunctionWorkspace node_jac_ws;
+  FunctionWorkspace cost_hess_ws;
+  std::vector<double> node_g;
+  std::vector<double> node_jac_nz;
+  std::vector<int> node_rows;
+
+  std::vector<int> jac_rows, jac_cols;
+  std::vector<int> hess_rows, hess_cols;
+  std::vector<double> lbg, ubg;
+  std::vector<double> lbw, ubw;
+};
+
+} // namespace ocl
+#endif // OCL_MULTIPLE_SHOOTING_H_
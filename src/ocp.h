@@ -15,91 +15,254 @@
 #ifndef OCL_OCP_H_
 #define OCL_OCP_H_
 
+#include <functional>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "tensor/tree_tensor.h"
+#include "function_interface.h"
+#include "system.h"
+
 namespace ocl {
 
-class OcpHandler
+// Collects cost terms, all elements of all terms are summed up.
+class CostHandler
 {
+public:
+  void add(const Tensor& cost) { costs.push_back(cost); }
 
-}
+  Matrix value() const
+  {
+    std::vector<CasadiMatrix> columns;
+    for (const Tensor& c : costs) {
+      OutputAssemblyPlan::appendColumns(c, columns);
+    }
+    CasadiMatrix v = CasadiMatrix::zeros(1,1);
+    for (const CasadiMatrix& c : columns) {
+      v = v + CasadiMatrix::sum1(c);
+    }
+    return Matrix(v);
+  }
 
-class CostsHandler
+private:
+  std::vector<Tensor> costs;
+};
+
+// Collects constraints lhs op rhs with op one of "<=", ">=", "==", e.g.
+// ch.add(x.get("v"), "<=", 1). A scalar side is compared with all elements
+// of the other side.
+class ConstraintHandler
 {
+public:
+  void add(const Tensor& lhs, const std::string& op, const Tensor& rhs)
+  {
+    CasadiMatrix l = flatten(lhs);
+    CasadiMatrix r = flatten(rhs);
+    if (l.numel() == 1 && r.numel() > 1) {
+      l = CasadiMatrix::repmat(l, r.numel(), 1);
+    } else if (r.numel() == 1 && l.numel() > 1) {
+      r = CasadiMatrix::repmat(r, l.numel(), 1);
+    }
+    if (l.numel() != r.numel()) {
+      throw OclException("Sizes of the left and right hand side of a constraint do not match.");
+    }
 
-}
+    const double inf = std::numeric_limits<double>::infinity();
+    double lower, upper;
+    if (op == "<=") {
+      lower = -inf; upper = 0.;
+    } else if (op == ">=") {
+      lower = 0.; upper = inf;
+    } else if (op == "==") {
+      lower = 0.; upper = 0.;
+    } else {
+      throw OclException(("Unknown constraint operator " + op).c_str());
+    }
 
-class ConstraintHandler
+    values.push_back(l - r);
+    lower_bounds.insert(lower_bounds.end(), l.numel(), lower);
+    upper_bounds.insert(upper_bounds.end(), l.numel(), upper);
+  }
+
+  // Constraint values lhs-rhs and their bounds as column vectors
+  Matrix value() const { return values.empty() ? Matrix::Zero(0,1) : Matrix(CasadiMatrix::vertcat(values)); }
+  Matrix lowerBounds() const { return lower_bounds.empty() ? Matrix::Zero(0,1) : Matrix(lower_bounds); }
+  Matrix upperBounds() const { return upper_bounds.empty() ? Matrix::Zero(0,1) : Matrix(upper_bounds); }
+
+private:
+  static CasadiMatrix flatten(const Tensor& t)
+  {
+    std::vector<CasadiMatrix> columns;
+    OutputAssemblyPlan::appendColumns(t, columns);
+    return CasadiMatrix::vertcat(columns);
+  }
+
+  std::vector<CasadiMatrix> values;
+  std::vector<double> lower_bounds;
+  std::vector<double> upper_bounds;
+};
+
+// All indizes of all repetitions of t, e.g. to select NLP variables
+static inline std::vector< ::casadi::casadi_int > flatIndizes(const Tree& t)
 {
+  std::vector< ::casadi::casadi_int > idz;
+  for (const std::vector<int>& i : t.indizes()) {
+    idz.insert(idz.end(), i.begin(), i.end());
+  }
+  return idz;
+}
 
+// Elements of w at the repetitions of t in n_cols columns, e.g. one column
+// per control interval
+static inline CasadiMatrix treeColumns(const CasadiMatrix& w, const Tree& t, const int n_cols)
+{
+  std::vector< ::casadi::casadi_int > idz = flatIndizes(t);
+  CasadiMatrix v = idz.empty() ? CasadiMatrix::zeros(0,1) : w(idz);
+  return CasadiMatrix::reshape(v, idz.size()/n_cols, n_cols);
 }
 
+typedef CostHandler CH;
+typedef ConstraintHandler CNH;
+
+typedef void (*PathCostsFunctionPtr)(CostHandler& ch, const TreeTensor& x, const TreeTensor& z, const TreeTensor& u, const TreeTensor& p);
+typedef void (*ArrivalCostsFunctionPtr)(CostHandler& ch, const TreeTensor& x, const TreeTensor& p);
+typedef void (*PathConstraintsFunctionPtr)(ConstraintHandler& ch, const TreeTensor& x, const TreeTensor& p);
+typedef void (*BoundaryConditionsFunctionPtr)(ConstraintHandler& ch, const TreeTensor& x0, const TreeTensor& xf, const TreeTensor& p);
+
+// Calls user code with tree tensors of the inputs and collects the results
+// in a handler. The handler callback is empty for terms not given by the
+// user, which gives zero costs or no constraints.
+template<class Handler>
+class HandlerFunction : public FunctionInterface
+{
+public:
+  typedef std::function<void(Handler&, const std::vector<TreeTensor>&)> Callback;
+
+  HandlerFunction(const Callback& callback, const std::vector<Tree>& inputs, const int n_outputs)
+      : FunctionInterface(inputs, n_outputs), callback(callback) { }
+
+  std::vector<Matrix> fcnEvaluate(const std::vector<Matrix>& args) const override
+  {
+    std::vector<ValueStorage> storages;
+    for (const Matrix& a : args) {
+      storages.push_back(ValueStorage(a));
+    }
+    std::vector<TreeTensor> tensors;
+    for (unsigned int i=0; i < args.size(); i++) {
+      tensors.push_back(TreeTensor(this->input_structs[i], storages[i]));
+    }
+
+    Handler h;
+    if (callback) {
+      callback(h, tensors);
+    }
+    return outputs(h);
+  }
+
+private:
+  static std::vector<Matrix> outputs(const CostHandler& h) { return {h.value()}; }
+  static std::vector<Matrix> outputs(const ConstraintHandler& h)
+  {
+    return {h.value(), h.lowerBounds(), h.upperBounds()};
+  }
+
+  Callback callback;
+};
+
+typedef HandlerFunction<CostHandler> CostFunction;
+typedef HandlerFunction<ConstraintHandler> ConstraintFunction;
+
+// Optimal control problem on a system: costs along the path and at the end,
+// constraints along the path and at the boundaries. All functions are traced
+// once and compiled like the system equations.
+//
+//   path costs           (x, z, u, p) -> scalar
+//   arrival costs        (x, p) -> scalar
+//   path constraints     (x, p) -> (g, lower bounds, upper bounds)
+//   boundary conditions  (x0, xf, p) -> (g, lower bounds, upper bounds)
 class OCP
 {
 public:
-  OCP(const System& system,
-      const FunctionHandle& path_costs,
-      const FunctionHandle& arrival_costs,
-      const FunctionHandle& path_constraints,
-      const FunctionHandle& boundary_conditions)
+  OCP(System& system,
+      const PathCostsFunctionPtr path_costs = nullptr,
+      const ArrivalCostsFunctionPtr arrival_costs = nullptr,
+      const PathConstraintsFunctionPtr path_constraints = nullptr,
+      const BoundaryConditionsFunctionPtr boundary_conditions = nullptr)
+      : sys(system),
+        path_cost_fcn(callback(path_costs), {system.states(), system.algebraics(), system.controls(), system.parameters()}, 1),
+        arrival_cost_fcn(callback(arrival_costs), {system.states(), system.parameters()}, 1),
+        path_constraints_fcn(callback(path_constraints), {system.states(), system.parameters()}, 3),
+        boundary_conditions_fcn(callback(boundary_conditions), {system.states(), system.states(), system.parameters()}, 3)
   {
+    path_cost_fcn.compile("path_costs");
+    arrival_cost_fcn.compile("arrival_costs");
+    path_constraints_fcn.compile("path_constraints");
+    boundary_conditions_fcn.compile("boundary_conditions");
+  }
+
+  System& system() { return sys; }
 
-    int sx = system.sx();
-    int sz = system.sz();
-    int su = system.su();
-    int sp = system.sp();
+  // Expression graphs, for building the transcription from symbolic calls
+  const ::casadi::Function& pathCosts() const { return path_cost_fcn.expressionFunction(); }
+  const ::casadi::Function& arrivalCosts() const { return arrival_cost_fcn.expressionFunction(); }
+  const ::casadi::Function& pathConstraints() const { return path_constraints_fcn.expressionFunction(); }
+  const ::casadi::Function& boundaryConditions() const { return boundary_conditions_fcn.expressionFunction(); }
 
-    path_cost_fcn = Function(path_costs, {sx,sz,su,sp}, 1);
-    arrival_cost_fcn = Function(arrival_costs, {sx,sp}, 1);
-    path_constraints_fcn = Function(path_constraints, {sx,sx,sp}, 3);
-    boundary_conditions_fcn = Function(boundary_conditions, {sx,sp}, 3);
+  int numPathConstraints() const { return path_constraints_fcn.casadiFunction().numel_out(0); }
+  int numBoundaryConditions() const { return boundary_conditions_fcn.casadiFunction().numel_out(0); }
+
+  // Bounds of the constraints, they do not depend on the inputs
+  std::vector<double> pathConstraintsLowerBounds() const { return constant(path_constraints_fcn, 1); }
+  std::vector<double> pathConstraintsUpperBounds() const { return constant(path_constraints_fcn, 2); }
+  std::vector<double> boundaryConditionsLowerBounds() const { return constant(boundary_conditions_fcn, 1); }
+  std::vector<double> boundaryConditionsUpperBounds() const { return constant(boundary_conditions_fcn, 2); }
+
+private:
+  static CostFunction::Callback callback(const PathCostsFunctionPtr f)
+  {
+    if (!f) {
+      return CostFunction::Callback();
+    }
+    return [f](CostHandler& h, const std::vector<TreeTensor>& a) { f(h, a[0], a[1], a[2], a[3]); };
   }
 
-  CostTerm evalPathCosts(const NumericVector& states, const NumericVector& algvars,
-                         const NumericVector& controls, const NumericVector& parameters)
+  static CostFunction::Callback callback(const ArrivalCostsFunctionPtr f)
   {
-    CostHandler ch;
-    x = TreeTensor.create(states_struct, states);
-    z = TreeTensor.create(algvars_struct, algvars);
-    u = TreeTensor.create(controls_struct, controls);
-    p = TreeTensor.create(parameters_struct, parameters);
-    path_cost_fcn.eval(ch, x, z, u, p);
-    return ch.costs();
+    if (!f) {
+      return CostFunction::Callback();
+    }
+    return [f](CostHandler& h, const std::vector<TreeTensor>& a) { f(h, a[0], a[1]); };
   }
 
-  CostTerm evalArrivalCosts(const NumericVector& states, const NumericVector& parameters)
+  static ConstraintFunction::Callback callback(const PathConstraintsFunctionPtr f)
   {
-    CostHandler ch;
-    x = TreeTensor.create(states_struct, states);
-    p = TreeTensor.create(parameters_struct, parameters);
-    path_cost_fcn.eval(ch, x, p);
-    return ch.costs();
+    if (!f) {
+      return ConstraintFunction::Callback();
+    }
+    return [f](ConstraintHandler& h, const std::vector<TreeTensor>& a) { f(h, a[0], a[1]); };
   }
 
-  Constraint evalPathConstraints(const NumericVector& states, const NumericVector& parameters)
+  static ConstraintFunction::Callback callback(const BoundaryConditionsFunctionPtr f)
   {
-    ConstraintHandler ch;
-    x = TreeTensor.create(states_struct, states);
-    p = TreeTensor.create(parameters_struct, parameters);
-    path_constraints_fcn.eval(ch, x, p);
-    return ch.constraints();
+    if (!f) {
+      return ConstraintFunction::Callback();
+    }
+    return [f](ConstraintHandler& h, const std::vector<TreeTensor>& a) { f(h, a[0], a[1], a[2]); };
   }
 
-  Constraint evalBoundaryConditions(const NumericVector& states0, const NumericVector& statesF,
-                               const NumericVector& parameters)
+  static std::vector<double> constant(const ConstraintFunction& f, const int output)
   {
-    ConstraintHandler ch;
-    x0 = TreeTensor.create(states_struct, states0);
-    xF = TreeTensor.create(states_struct, statesF);
-    p = TreeTensor.create(parameters_struct, parameters);
-    boundary_conditions_fcn.eval(ch, x0, xF, p);
-    return ch.constraints();
+    return ::ocl::casadi::full(f.symbolicOutputs()[output]);
   }
 
-private:
-  Function path_cost_fcn;
-  Function arrival_cost_fcn;
-  Function path_constraints_fcn;
-  Function boundary_conditions_fcn;
-}
+  System& sys;
+  CostFunction path_cost_fcn;
+  CostFunction arrival_cost_fcn;
+  ConstraintFunction path_constraints_fcn;
+  ConstraintFunction boundary_conditions_fcn;
+};
 
 } // namespace ocl
 #endif // OCL_OCP_H_
@@ -0,0 +1,366 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_SIMULTANEOUS_H_
+#define OCL_SIMULTANEOUS_H_
+
+#include <algorithm>  // min, max
+#include <cmath>      // pow
+#include <limits>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "tensor/casadi.h"
+#include "tensor/tree_builder.h"
+#include "integrator/butcher_tableau.h"
+#include "system.h"
+#include "ocp.h"
+
+namespace ocl {
+
+// Lagrange basis polynomials on [0,1] through tau_0 = 0 and the collocation
+// points tau_1..tau_d (Radau IIA or Gauss-Legendre points).
+struct CollocationCoefficients
+{
+  CollocationCoefficients(const int order, const std::string& scheme = "radau")
+  {
+    // the collocation points are the stage times of the Runge-Kutta methods
+    ButcherTableau tableau;
+    if (scheme == "radau") {
+      tableau = ButcherTableau::RadauIIA(order);
+    } else if (scheme == "legendre") {
+      tableau = ButcherTableau::GaussLegendre(order);
+    } else {
+      throw OclException(("Unknown collocation scheme " + scheme).c_str());
+    }
+    points.push_back(0.);
+    points.insert(points.end(), tableau.c.begin(), tableau.c.end());
+    B.push_back(0.);
+    B.insert(B.end(), tableau.b.begin(), tableau.b.end());
+
+    const int d = order;
+    C.assign(d+1, std::vector<double>(d+1));
+    D.assign(d+1, 0.);
+    for (int j = 0; j <= d; j++)
+    {
+      // coefficients of the basis polynomial, ascending powers
+      std::vector<double> poly = {1.};
+      for (int r = 0; r <= d; r++)
+      {
+        if (r == j) {
+          continue;
+        }
+        const double denom = points[j] - points[r];
+        std::vector<double> next(poly.size()+1, 0.);
+        for (unsigned int i = 0; i < poly.size(); i++)
+        {
+          next[i+1] += poly[i]/denom;
+          next[i] -= poly[i]*points[r]/denom;
+        }
+        poly = next;
+      }
+
+      for (unsigned int i = 0; i < poly.size(); i++) {
+        D[j] += poly[i];
+      }
+      for (int r = 0; r <= d; r++) {
+        for (unsigned int i = 1; i < poly.size(); i++) {
+          C[j][r] += i*poly[i]*std::pow(points[r], i-1);
+        }
+      }
+    }
+  }
+
+  int order() const { return points.size()-1; }
+
+  std::vector<double> points;          // tau_0..tau_d
+  std::vector<std::vector<double> > C; // C[j][r], derivative of basis j at tau_r
+  std::vector<double> D;               // basis j at 1, state at the end of an interval
+  std::vector<double> B;               // quadrature weights of the collocation points, B[0] = 0
+};
+
+struct CollocationOptions
+{
+  CollocationOptions()
+      : control_intervals(20), collocation_order(3), scheme("radau"),
+        path_constraints_at_boundary(true), parallelization("serial") { }
+
+  int control_intervals;
+  int collocation_order;
+  std::string scheme;                 // "radau" or "legendre"
+  bool path_constraints_at_boundary;  // also at the first and last node
+  std::string parallelization;        // of the mapped interval function
+};
+
+// Direct collocation transcription of an optimal control problem with
+// horizon T into a nonlinear program min J(w) s.t. lbg <= g(w) <= ubg,
+// lbw <= w <= ubw.
+//
+// The variables of one control interval are the state at its start, states
+// and algebraic variables at the collocation points and the control:
+//
+//   w = [interval_0, ..., interval_N-1, xf, p]
+//   interval_k = [x, xc_1, zc_1, ..., xc_d, zc_d, u]
+//
+// The collocation equations, the end state and the quadrature of the path
+// costs of one interval are one function, which is built once and mapped
+// over all intervals. The constraints are ordered by interval
+// (collocation equations, continuity, path constraints of interval k), so
+// the constraint Jacobian is block banded with the stage structure.
+class Collocation
+{
+public:
+
+  Collocation(OCP& ocp, const double T, const CollocationOptions& opts = CollocationOptions())
+      : ocp(ocp), opts(opts), N(opts.control_intervals), coeffs(opts.collocation_order, opts.scheme)
+  {
+    System& system = ocp.system();
+    nx = system.nx();
+    nz = system.nz();
+    nu = system.nu();
+    np = system.np();
+    const int d = coeffs.order();
+
+    TreeBuilder ib;
+    ib.add("x", system.states());
+    ib.addRepeated({"xc", "zc"}, {system.states(), system.algebraics()}, d);
+    ib.add("u", system.controls());
+
+    TreeBuilder tb;
+    tb.addRepeated({"interval"}, {ib.tree()}, N);
+    tb.add("xf", system.states());
+    tb.add("p", system.parameters());
+    tree = tb.tree();
+
+    interval_fcn = buildIntervalFunction(system, T/N);
+    buildNlp();
+    setupBounds(system);
+  }
+
+  // NLP variables, e.g. variables().get("interval").get("u") are the
+  // controls of all intervals
+  const Tree& variables() const { return tree; }
+
+  int nv() const { return tree.numel(); }
+  int ng() const { return casadi::size(g, 0); }
+
+  // Constraints of one interval (collocation equations, continuity, path
+  // constraints), the first N times this many rows of g are by interval
+  int numIntervalConstraints() const
+  {
+    return N > 0 ? (ng() - ocp.numPathConstraints() - (int)ocp.boundaryConditionsLowerBounds().size())/N : 0;
+  }
+
+  const CollocationCoefficients& coefficients() const { return coeffs; }
+
+  // (x, xc, zc, u, p) -> (collocation equations, end state, path costs)
+  const ::casadi::Function& intervalFunction() const { return interval_fcn; }
+
+  // w -> J and w -> g
+  const ::casadi::Function& costFunction() const { return cost_fcn; }
+  const ::casadi::Function& constraintFunction() const { return constraint_fcn; }
+
+  // Symbolic NLP {"x": w, "f": J, "g": g}, e.g. for casadi::nlpsol
+  ::casadi::SXDict nlp() const { return {{"x", w}, {"f", J}, {"g", g}}; }
+
+  const std::vector<double>& constraintLowerBounds() const { return lbg; }
+  const std::vector<double>& constraintUpperBounds() const { return ubg; }
+  const std::vector<double>& variableLowerBounds() const { return lbw; }
+  const std::vector<double>& variableUpperBounds() const { return ubw; }
+
+  // Bounds of a variable in all intervals (including the collocation points)
+  void setBounds(const std::string& id, const double lower, const double upper)
+  {
+    Tree intervals = tree.get("interval");
+    for (const char* branch : {"x", "xc", "zc", "u"}) {
+      setBounds(intervals.get(branch), id, lower, upper);
+    }
+    setBounds(tree.get("xf"), id, lower, upper);
+    setBounds(tree.get("p"), id, lower, upper);
+  }
+
+  // Bounds of a state at the start and at the end of the horizon
+  void setInitialBounds(const std::string& id, const double lower, const double upper)
+  {
+    setBounds(tree.get("interval").at(0).get("x"), id, lower, upper);
+  }
+
+  void setEndBounds(const std::string& id, const double lower, const double upper)
+  {
+    setBounds(tree.get("xf"), id, lower, upper);
+  }
+
+  // Zero, moved into the variable bounds
+  std::vector<double> initialGuess() const
+  {
+    std::vector<double> guess(nv());
+    for (int i = 0; i < nv(); i++) {
+      guess[i] = std::min(std::max(0., lbw[i]), ubw[i]);
+    }
+    return guess;
+  }
+
+private:
+
+  ::casadi::Function buildIntervalFunction(System& system, const double h)
+  {
+    const int d = coeffs.order();
+    CasadiMatrix x = CasadiMatrix::sym("x", nx);
+    CasadiMatrix xc = CasadiMatrix::sym("xc", nx, d);
+    CasadiMatrix zc = CasadiMatrix::sym("zc", nz, d);
+    CasadiMatrix u = CasadiMatrix::sym("u", nu);
+    CasadiMatrix p = CasadiMatrix::sym("p", np);
+
+    std::vector<CasadiMatrix> X = {x};
+    for (int j = 0; j < d; j++) {
+      X.push_back(xc(::casadi::Slice(), ::casadi::Slice(j)));
+    }
+
+    std::vector<CasadiMatrix> equations;
+    CasadiMatrix cost = CasadiMatrix::zeros(1,1);
+    for (int r = 1; r <= d; r++)
+    {
+      CasadiMatrix z_r = zc(::casadi::Slice(), ::casadi::Slice(r-1));
+
+      // derivative of the state polynomial at tau_r
+      CasadiMatrix xp = CasadiMatrix::zeros(nx,1);
+      for (int j = 0; j <= d; j++) {
+        xp = xp + coeffs.C[j][r]*X[j];
+      }
+
+      std::vector<CasadiMatrix> f = system.expressionFunction()(std::vector<CasadiMatrix>{X[r], z_r, u, p});
+      equations.push_back(h*f[0] - xp);
+      equations.push_back(f[1]);
+
+      std::vector<CasadiMatrix> l = ocp.pathCosts()(std::vector<CasadiMatrix>{X[r], z_r, u, p});
+      cost = cost + h*coeffs.B[r]*l[0];
+    }
+
+    CasadiMatrix x_end = CasadiMatrix::zeros(nx,1);
+    for (int j = 0; j <= d; j++) {
+      x_end = x_end + coeffs.D[j]*X[j];
+    }
+
+    return ::casadi::Function("collocation_interval",
+                              {x, CasadiMatrix::vec(xc), CasadiMatrix::vec(zc), u, p},
+                              {CasadiMatrix::vertcat(equations), x_end, cost});
+  }
+
+  void buildNlp()
+  {
+    w = CasadiMatrix::sym("w", nv());
+    CasadiMatrix X = treeColumns(w, tree.get("interval").get("x"), N);
+    CasadiMatrix xf = w(flatIndizes(tree.get("xf")));
+    std::vector< ::casadi::casadi_int > p_idz = flatIndizes(tree.get("p"));
+    CasadiMatrix p = p_idz.empty() ? CasadiMatrix::zeros(0,1) : w(p_idz);
+
+    // all intervals at once
+    Tree intervals = tree.get("interval");
+    std::vector<CasadiMatrix> out = interval_fcn.map(N, opts.parallelization)(std::vector<CasadiMatrix>{
+        X, treeColumns(w, intervals.get("xc"), N), treeColumns(w, intervals.get("zc"), N),
+        treeColumns(w, intervals.get("u"), N), CasadiMatrix::repmat(p, 1, N)});
+
+    // continuity, start of the next interval equals the end of this one
+    std::vector<CasadiMatrix> next = {X(::casadi::Slice(), ::casadi::Slice(1, N)), xf};
+    CasadiMatrix continuity = CasadiMatrix::horzcat(next) - out[1];
+
+    // path constraints on the nodes, the last node after the intervals
+    ::casadi::Function path_fcn = ocp.pathConstraints().map(N+1, opts.parallelization);
+    std::vector<CasadiMatrix> path = path_fcn(std::vector<CasadiMatrix>{
+        CasadiMatrix::horzcat(std::vector<CasadiMatrix>{X, xf}), CasadiMatrix::repmat(p, 1, N+1)});
+    const int n_path = ocp.numPathConstraints();
+    CasadiMatrix path_intervals = path[0](::casadi::Slice(), ::casadi::Slice(0, N));
+    CasadiMatrix path_end = path[0](::casadi::Slice(), ::casadi::Slice(N));
+
+    std::vector<CasadiMatrix> x0 = {X(::casadi::Slice(), ::casadi::Slice(0))};
+    std::vector<CasadiMatrix> bc = ocp.boundaryConditions()(std::vector<CasadiMatrix>{x0[0], xf, p});
+
+    // stage ordered constraints: vec of the columns of all intervals
+    CasadiMatrix stages = CasadiMatrix::vertcat(std::vector<CasadiMatrix>{out[0], continuity, path_intervals});
+    g = CasadiMatrix::vertcat(std::vector<CasadiMatrix>{CasadiMatrix::vec(stages), path_end, bc[0]});
+    J = CasadiMatrix::sum2(out[2]) + ocp.arrivalCosts()(std::vector<CasadiMatrix>{xf, p})[0];
+
+    cost_fcn = ::casadi::Function("nlp_cost", {w}, {J});
+    constraint_fcn = ::casadi::Function("nlp_constraints", {w}, {g});
+
+    // bounds of the constraints in the same order
+    const int n_eq = casadi::size(out[0], 0) + nx;
+    const std::vector<double> path_lb = ocp.pathConstraintsLowerBounds();
+    const std::vector<double> path_ub = ocp.pathConstraintsUpperBounds();
+    const double inf = std::numeric_limits<double>::infinity();
+    for (int k = 0; k <= N; k++)
+    {
+      if (k < N) {
+        lbg.insert(lbg.end(), n_eq, 0.);
+        ubg.insert(ubg.end(), n_eq, 0.);
+      }
+      // the constraints at the boundary nodes stay in g with infinite
+      // bounds if disabled, so that the structure does not change
+      const bool active = opts.path_constraints_at_boundary || (k > 0 && k < N);
+      for (int i = 0; i < n_path; i++)
+      {
+        lbg.push_back(active ? path_lb[i] : -inf);
+        ubg.push_back(active ? path_ub[i] : inf);
+      }
+    }
+    const std::vector<double> bc_lb = ocp.boundaryConditionsLowerBounds();
+    const std::vector<double> bc_ub = ocp.boundaryConditionsUpperBounds();
+    lbg.insert(lbg.end(), bc_lb.begin(), bc_lb.end());
+    ubg.insert(ubg.end(), bc_ub.begin(), bc_ub.end());
+  }
+
+  void setupBounds(System& system)
+  {
+    lbw.assign(nv(), -std::numeric_limits<double>::infinity());
+    ubw.assign(nv(), std::numeric_limits<double>::infinity());
+    for (auto& kv : system.bounds()) {
+      setBounds(kv.first, kv.second.lower_bound, kv.second.upper_bound);
+    }
+  }
+
+  // Bounds of variable id if it is a branch of t
+  void setBounds(const Tree& t, const std::string& id, const double lower, const double upper)
+  {
+    if (t.branches().count(id) == 0) {
+      return;
+    }
+    for (::casadi::casadi_int i : flatIndizes(t.get(id)))
+    {
+      lbw[i] = lower;
+      ubw[i] = upper;
+    }
+  }
+
+  OCP& ocp;
+  CollocationOptions opts;
+  int N;
+  CollocationCoefficients coeffs;
+  int nx, nz, nu, np;
+  Tree tree;
+
+  ::casadi::Function interval_fcn;
+  ::casadi::Function cost_fcn;
+  ::casadi::Function constraint_fcn;
+  CasadiMatrix w;
+  CasadiMatrix J;
+  CasadiMatrix g;
+
+  std::vector<double> lbg, ubg;
+  std::vector<double> lbw, ubw;
+};
+
+} // namespace ocl
+#endif // OCL_SIMULTANEOUS_H_
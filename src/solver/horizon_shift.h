@@ -0,0 +1,124 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_HORIZON_SHIFT_H_
+#define OCL_HORIZON_SHIFT_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "utils/exceptions.h"     // OclException
+#include "utils/functions.h"      // range
+#include "tensor/tree.h"          // Tree
+#include "tensor/remap_plan.h"    // RemapPlan
+
+namespace ocl {
+
+// Shifts values of a transcription with the variables interval (repeated N
+// times), xf and p by one control interval, e.g. to warm start the next
+// sample of model predictive control. Works for the layouts of Collocation
+// and MultipleShooting.
+//
+// Interval k of the result is interval k+1 of the source, the states of the
+// last interval are the final states of the source. The final states and the
+// remaining variables of the last interval are duplicated.
+//
+// The remap is computed once from the variable tree, a shift is a gather of
+// contiguous blocks.
+class HorizonShift
+{
+public:
+
+  // multipliers_per_interval is the number of multipliers of each interval
+  // that are shifted by multipliers(), e.g. nx continuity multipliers
+  HorizonShift(const Tree& variables, const int multipliers_per_interval = 0)
+      : variables_plan(stageTree(variables), stageTree(variables), shiftOptions()),
+        multipliers_plan(intervalTree(variables.get("interval").size(), multipliers_per_interval),
+                         intervalTree(variables.get("interval").size(), multipliers_per_interval),
+                         shiftOptions()) { }
+
+  std::vector<double> variables(const std::vector<double>& w) const
+  {
+    return variables_plan.apply(w);
+  }
+
+  std::vector<double> multipliers(const std::vector<double>& lambda) const
+  {
+    return multipliers_plan.apply(lambda);
+  }
+
+private:
+
+  static RemapOptions shiftOptions()
+  {
+    RemapOptions opts;
+    opts.shift = 1;
+    opts.extend_last = true;
+    return opts;
+  }
+
+  // The variables as trajectories of stages: one element per interval for
+  // each variable of the intervals, with the final states appended to x
+  static Tree stageTree(const Tree& variables)
+  {
+    const Tree intervals = variables.get("interval");
+    const int N = intervals.size();
+    if (N == 0) {
+      throw OclException("Shifting the horizon needs at least one control interval.");
+    }
+
+    std::map<std::string, Tree> branches;
+    for (const auto& kv : intervals.branches())
+    {
+      std::vector<std::vector<int> > idz;
+      for (int k = 0; k < N; k++) {
+        idz.push_back(flat(intervals.at(k).get(kv.first)));
+      }
+      if (kv.first == "x") {
+        idz.push_back(flat(variables.get("xf")));
+      }
+      branches[kv.first] = Tree(Tree::Branches(), {(int)idz[0].size(), 1}, idz);
+    }
+    branches["p"] = variables.get("p");
+    return Tree(branches, {variables.numel(), 1}, {range(0, variables.numel())});
+  }
+
+  static Tree intervalTree(const int N, const int n)
+  {
+    std::vector<std::vector<int> > idz;
+    for (int k = 0; k < N; k++) {
+      idz.push_back(range(k*n, (k+1)*n));
+    }
+    std::map<std::string, Tree> branches;
+    branches["interval"] = Tree(Tree::Branches(), {n, 1}, idz);
+    return Tree(branches, {N*n, 1}, {range(0, N*n)});
+  }
+
+  // All indizes of all repetitions of t
+  static std::vector<int> flat(const Tree& t)
+  {
+    std::vector<int> idz;
+    for (const std::vector<int>& i : t.indizes()) {
+      idz.insert(idz.end(), i.begin(), i.end());
+    }
+    return idz;
+  }
+
+  RemapPlan variables_plan;
+  RemapPlan multipliers_plan;
+};
+
+} // namespace ocl
+#endif // OCL_HORIZON_SHIFT_H_
@@ -0,0 +1,796 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_INTERIOR_POINT_H_
+#define OCL_INTERIOR_POINT_H_
+
+#include <algorithm>  // copy, fill, min, max
+#include <cmath>      // abs, isinf, isnan, log, pow
+#include <limits>     // quiet_NaN
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "thread_pool.h"
+#include "multiple_shooting.h"
+#include "solver/riccati.h"
+#include "solver/horizon_shift.h"
+
+namespace ocl {
+
+struct InteriorPointOptions
+{
+  InteriorPointOptions()
+      : max_iterations(100), tolerance(1e-8), bound_relax_factor(1e-8), bound_push(1e-2),
+        warm_start_push(1e-3), fraction_to_boundary(0.99), controls_regularization(0.),
+        max_backtracks(30), sufficient_decrease(1e-4) { }
+
+  int max_iterations;
+  double tolerance;                // on the residuals and the complementarity
+  double bound_relax_factor;       // bounds are relaxed relative to max(1, |bound|)
+  double bound_push;               // minimal initial slack of a cold start
+  double warm_start_push;          // minimal slacks and multipliers of a warm start
+  double fraction_to_boundary;     // minimal fraction of the step to the boundary
+  double controls_regularization;  // added to the diagonal of the control Hessian
+  int max_backtracks;              // halvings of the primal step in the line search
+  double sufficient_decrease;      // Armijo factor of the line search
+};
+
+// Iterate of the interior point method, the result of a solve and the
+// initial point of a warm started solve
+struct InteriorPointResult
+{
+  InteriorPointResult() : objective(0.), iterations(0), success(false) { }
+
+  std::vector<double> w;       // variables in the layout of MultipleShooting::variables
+  std::vector<double> lambda;  // multipliers of the continuity constraints, nx per interval
+  std::vector<double> s;       // slacks of the inequalities, NaN if unknown
+  std::vector<double> z;       // multipliers of the inequalities, NaN if unknown
+  double objective;
+  int iterations;
+  bool success;
+};
+
+// Primal-dual interior point method on the stage structure of a multiple
+// shooting transcription. Each iteration linearizes the problem, eliminates
+// the slacks and multipliers of the inequalities per stage and solves the
+// remaining stage structured KKT system with the Riccati recursion, so one
+// iteration is linear in the number of control intervals. Predictor and
+// corrector of Mehrotra share one factorization.
+//
+// Inequalities are the variable bounds, the path constraints and boundary
+// conditions that only depend on the initial or on the final state. The
+// continuity constraints are the dynamics of the Riccati recursion.
+// Bounds are relaxed by bound_relax_factor, so equality path constraints
+// and fixed initial states are interior. The Hessian is the Hessian of the
+// objective, regularized if the reduced Hessians are not positive
+// definite. The primal step is shortened by the fraction to the boundary
+// and a backtracking line search on a barrier merit function with an exact
+// penalty of the constraint violation, so cold starts of nonlinear problems
+// converge from points where the linearization is poor. There is no
+// restoration phase, the solve fails if the line search does.
+//
+// Linearizations, stage assembly and residuals are computed in parallel on
+// the thread pool. Parameters are not supported, they couple all stages.
+class InteriorPoint
+{
+public:
+
+  InteriorPoint(MultipleShooting& ms, ThreadPool& pool,
+                const InteriorPointOptions& opts = InteriorPointOptions())
+      : ms(ms), pool(pool), opts(opts),
+        kkt(ms.variables().get("interval"), ms.variables().get("xf")),
+        N(ms.numIntervals()), nx(kkt.nx(N)), nu(N > 0 ? kkt.nu(0) : 0),
+        horizon_shift(ms.variables(), nx)
+  {
+    if (ms.variables().get("p").numel() > 0) {
+      throw OclException("The interior point solver does not support parameters.");
+    }
+    n_cont_nz = N*(nx*(nx+nu) + nx);
+
+    // g rows that are not continuity constraints, and their stage
+    row_stage.assign(ms.ng(), -1);
+    row_entries.resize(ms.ng());
+    for (int k = 0; k < N; k++) {
+      for (int e = 0; e < nx; e++) {
+        row_stage[ms.continuityRow(k)+e] = CONTINUITY;
+      }
+    }
+    const std::vector<int>& rows = ms.jacobianRows();
+    const std::vector<int>& cols = ms.jacobianCols();
+    for (unsigned int i = n_cont_nz; i < rows.size(); i++)
+    {
+      const int k = stage(cols[i]);
+      int& rs = row_stage[rows[i]];
+      rs = (rs == -1 || rs == k) ? k : COUPLED;
+      row_entries[rows[i]].push_back(Entry(i, cols[i] - kkt.offset(k)));
+    }
+    stage_rows.resize(N+1);
+    for (int r = 0; r < ms.ng(); r++)
+    {
+      if (row_stage[r] >= 0) {
+        stage_rows[row_stage[r]].push_back(r);
+      } else if (row_stage[r] == COUPLED) {
+        coupled_rows.push_back(r);
+      }
+    }
+
+    // lower triangle of the cost Hessian per stage
+    hess_entries.resize(N+1);
+    for (unsigned int i = 0; i < ms.hessianRows().size(); i++)
+    {
+      const int k = stage(ms.hessianCols()[i]);
+      if (stage(ms.hessianRows()[i]) != k) {
+        throw OclException("The interior point solver needs costs that are separable by stage.");
+      }
+      hess_entries[k].push_back(HessianEntry(i, ms.hessianRows()[i] - kkt.offset(k),
+                                             ms.hessianCols()[i] - kkt.offset(k)));
+    }
+
+    g.resize(ms.ng());
+    grad.resize(ms.nv());
+    jac_nz.resize(rows.size());
+    hess_nz.resize(ms.hessianRows().size());
+    dw.resize(ms.nv());
+    lambda_qp.resize((N+1)*nx);
+    hessians.resize(N+1);
+    stage_vectors.resize(N+1);
+    for (int k = 0; k <= N; k++)
+    {
+      hessians[k].resize(stageSize(k)*stageSize(k));
+      stage_vectors[k].resize(stageSize(k));
+    }
+    res_dual.resize(N+1);
+    res_primal.resize(N+1);
+    complementarity.resize(N+1);
+  }
+
+  // Cold start from the variables w0
+  InteriorPointResult solve(const std::vector<double>& w0)
+  {
+    InteriorPointResult initial;
+    initial.w = w0;
+    return solve(initial, false);
+  }
+
+  // Warm start from a previous result, e.g. shifted by one interval. Slacks
+  // and multipliers are pushed away from zero, they are only used if the
+  // inequalities did not change. NaN entries start like a cold start.
+  InteriorPointResult solve(const InteriorPointResult& warm)
+  {
+    return solve(warm, true);
+  }
+
+  // Shifts an iterate of the last solve by one control interval for the
+  // next sample of model predictive control, see HorizonShift. Slacks and
+  // multipliers of inequalities move with their stage. Those without a
+  // counterpart in the next stage, e.g. of the initial conditions, are NaN
+  // and initialized like a cold start by the next solve.
+  InteriorPointResult shift(const InteriorPointResult& iterate) const
+  {
+    if ((int)iterate.w.size() != ms.nv()) {
+      throw OclException("Size of the iterate does not match the number of variables.");
+    }
+    InteriorPointResult result;
+    result.w = horizon_shift.variables(iterate.w);
+    if ((int)iterate.lambda.size() == N*nx) {
+      result.lambda = horizon_shift.multipliers(iterate.lambda);
+    }
+    if (iterate.s.size() == ineq_shift.size() && iterate.z.size() == ineq_shift.size())
+    {
+      const double nan = std::numeric_limits<double>::quiet_NaN();
+      result.s.resize(ineq_shift.size());
+      result.z.resize(ineq_shift.size());
+      for (unsigned int j = 0; j < ineq_shift.size(); j++)
+      {
+        result.s[j] = ineq_shift[j] >= 0 ? iterate.s[ineq_shift[j]] : nan;
+        result.z[j] = ineq_shift[j] >= 0 ? iterate.z[ineq_shift[j]] : nan;
+      }
+    }
+    result.objective = iterate.objective;
+    return result;
+  }
+
+  int numInequalities() const { return ineq_var.size(); }
+
+protected:
+
+  enum { CONTINUITY = -2, COUPLED = -3 };
+
+  struct Entry
+  {
+    Entry(const int nz, const int col) : nz(nz), col(col) { }
+    int nz;   // index in the Jacobian nonzeros
+    int col;  // column in the stage
+  };
+
+  struct HessianEntry
+  {
+    HessianEntry(const int nz, const int row, const int col) : nz(nz), row(row), col(col) { }
+    int nz, row, col;
+  };
+
+  InteriorPointResult solve(const InteriorPointResult& initial, const bool warm)
+  {
+    initialize(initial, warm);
+    const int m = ineq_var.size();
+
+    InteriorPointResult result;
+    int iter = 0;
+    for (;; iter++)
+    {
+      pool.parallelFor(N+1, [this](int k, int) { residuals(k); });
+      double dual = 0, primal = 0, comp = 0;
+      for (int k = 0; k <= N; k++)
+      {
+        dual = std::max(dual, res_dual[k]);
+        primal = std::max(primal, res_primal[k]);
+        comp += complementarity[k];
+      }
+      const double mu = m > 0 ? comp/m : 0.;
+      result.success = dual <= opts.tolerance && primal <= opts.tolerance && mu <= opts.tolerance;
+      if (result.success || iter == opts.max_iterations) {
+        break;
+      }
+
+      if (!factorize(true)) {
+        break;
+      }
+
+      // predictor, affine scaling direction
+      for (int j = 0; j < m; j++) {
+        r_sz[j] = s[j]*z[j];
+      }
+      direction();
+      double alpha_p = maxStep(s, ds, 1.);
+      double alpha_d = maxStep(z, dz, 1.);
+
+      // corrector with centering, sigma = (mu_aff/mu)^3
+      double mu_target = 0.;
+      if (m > 0)
+      {
+        double mu_aff = 0.;
+        for (int j = 0; j < m; j++) {
+          mu_aff += (s[j] + alpha_p*ds[j])*(z[j] + alpha_d*dz[j]);
+        }
+        mu_aff /= m;
+        const double sigma = std::pow(mu_aff/mu, 3);
+        mu_target = sigma*mu;
+        ds_aff = ds;
+        dz_aff = dz;
+        for (int j = 0; j < m; j++) {
+          r_sz[j] = s[j]*z[j] + ds_aff[j]*dz_aff[j] - sigma*mu;
+        }
+        direction();
+        const double tau = std::max(opts.fraction_to_boundary, 1.-mu);
+        alpha_p = maxStep(s, ds, tau);
+        alpha_d = maxStep(z, dz, tau);
+      }
+
+      if (!lineSearch(mu_target, alpha_p)) {
+        break;
+      }
+      for (int j = 0; j < m; j++) {
+        z[j] += alpha_d*dz[j];
+      }
+      for (int i = 0; i < N*nx; i++) {
+        lambda[i] += alpha_d*(lambda_qp[nx+i] - lambda[i]);
+      }
+    }
+
+    result.w = w;
+    result.lambda = lambda;
+    result.s = s;
+    result.z = z;
+    result.objective = J;
+    result.iterations = iter;
+    return result;
+  }
+
+  // Sets up the inequalities and loads the iterate, evaluated at w
+  void initialize(const InteriorPointResult& initial, const bool warm)
+  {
+    if ((int)initial.w.size() != ms.nv()) {
+      throw OclException("Size of the initial guess does not match the number of variables.");
+    }
+    setupInequalities();
+    const int m = ineq_var.size();
+
+    w = initial.w;
+    evaluate();
+    if (warm && (int)initial.lambda.size() == N*nx) {
+      lambda = initial.lambda;
+    } else {
+      lambda.assign(N*nx, 0.);
+    }
+    if (warm && (int)initial.s.size() == m && (int)initial.z.size() == m)
+    {
+      s = initial.s;
+      z = initial.z;
+      for (int j = 0; j < m; j++)
+      {
+        if (std::isnan(s[j]) || std::isnan(z[j]))
+        {
+          s[j] = std::max(e[j], opts.bound_push);
+          z[j] = 1.;
+          continue;
+        }
+        s[j] = std::max(s[j], opts.warm_start_push);
+        z[j] = std::max(z[j], opts.warm_start_push);
+      }
+    }
+    else
+    {
+      s.resize(m);
+      z.assign(m, 1.);
+      for (int j = 0; j < m; j++) {
+        s[j] = std::max(e[j], opts.bound_push);
+      }
+    }
+    penalty = 0.;
+    ds.resize(m);
+    dz.resize(m);
+    ds_aff.resize(m);
+    dz_aff.resize(m);
+    r_sz.resize(m);
+  }
+
+  // Assembles and factorizes the stage matrices, with regularization until
+  // the recursion is positive definite
+  bool factorize(const bool free_initial_state)
+  {
+    double delta = 0.;
+    pool.parallelFor(N+1, [this, &delta](int k, int) { assembleMatrices(k, delta); });
+    while (!kkt.factorize(free_initial_state))
+    {
+      delta = delta == 0. ? 1e-8 : 10*delta;
+      if (delta > 1e8) {
+        return false;
+      }
+      pool.parallelFor(N+1, [this, &delta](int k, int) { assembleMatrices(k, delta); });
+    }
+    return true;
+  }
+
+  // Stage of variable i, the final state is stage N
+  int stage(const int i) const { return std::min(i/(nx+nu), N); }
+  int stageSize(const int k) const { return k < N ? nx+nu : nx; }
+
+  // Finite variable bounds and constraint bounds of each stage, relaxed.
+  // The inequalities are only rebuilt if a bound changed between finite and
+  // infinite, otherwise only the bound values are updated.
+  void setupInequalities()
+  {
+    const std::vector<double>& lbw = ms.variableLowerBounds();
+    const std::vector<double>& ubw = ms.variableUpperBounds();
+    const std::vector<double>& lbg = ms.constraintLowerBounds();
+    const std::vector<double>& ubg = ms.constraintUpperBounds();
+    for (int r : coupled_rows) {
+      if (!(std::isinf(lbg[r]) && std::isinf(ubg[r]))) {
+        throw OclException("The interior point solver does not support constraints that couple stages.");
+      }
+    }
+
+    std::vector<bool> finite;
+    finite.reserve(2*(ms.nv() + ms.ng()));
+    for (int k = 0; k <= N; k++)
+    {
+      for (int i = kkt.offset(k); i < kkt.offset(k) + stageSize(k); i++)
+      {
+        finite.push_back(!std::isinf(lbw[i]));
+        finite.push_back(!std::isinf(ubw[i]));
+      }
+      for (int r : stage_rows[k])
+      {
+        finite.push_back(!std::isinf(lbg[r]));
+        finite.push_back(!std::isinf(ubg[r]));
+      }
+    }
+
+    if (!ineq_offsets.empty() && finite == ineq_finite)
+    {
+      for (unsigned int j = 0; j < ineq_var.size(); j++)
+      {
+        const int v = ineq_var[j];
+        const int r = ineq_row[j];
+        const double bound = ineq_sign[j] > 0 ? (v >= 0 ? lbw[v] : lbg[r]) : (v >= 0 ? ubw[v] : ubg[r]);
+        ineq_bound[j] = relaxedBound(bound, ineq_sign[j]);
+      }
+      ineq_active.assign(ineq_var.size(), true);
+      return;
+    }
+    ineq_finite.swap(finite);
+
+    ineq_var.clear();
+    ineq_row.clear();
+    ineq_sign.clear();
+    ineq_bound.clear();
+    ineq_local.clear();
+    ineq_offsets.assign(1, 0);
+    for (int k = 0; k <= N; k++)
+    {
+      for (int l = 0; l < stageSize(k); l++)
+      {
+        const int i = kkt.offset(k) + l;
+        addInequality(i, -1, l, lbw[i], ubw[i]);
+      }
+      for (unsigned int n = 0; n < stage_rows[k].size(); n++)
+      {
+        const int r = stage_rows[k][n];
+        addInequality(-1, r, -1 - (int)n, lbg[r], ubg[r]);
+      }
+      ineq_offsets.push_back(ineq_var.size());
+    }
+    e.resize(ineq_var.size());
+    ineq_active.assign(ineq_var.size(), true);
+    setupShift();
+  }
+
+  // Position of an inequality in the lookup table of stage k, variables
+  // first, then the rows, two signs each
+  int shiftSlot(const int k, const int local, const double sign) const
+  {
+    const int position = local >= 0 ? local : stageSize(k) - 1 - local;
+    return 2*position + (sign > 0 ? 0 : 1);
+  }
+
+  // Source of each inequality in a shifted iterate: the inequality with the
+  // same position and sign in the next stage. Like in HorizonShift the states
+  // of the last interval come from the final stage and its controls stay.
+  void setupShift()
+  {
+    std::vector<std::vector<int> > lookup(N+1);
+    for (int k = 0; k <= N; k++)
+    {
+      lookup[k].assign(2*(stageSize(k) + stage_rows[k].size()), -1);
+      for (int j = ineq_offsets[k]; j < ineq_offsets[k+1]; j++) {
+        lookup[k][shiftSlot(k, ineq_local[j], ineq_sign[j])] = j;
+      }
+    }
+    ineq_shift.assign(ineq_var.size(), -1);
+    for (int k = 0; k <= N; k++)
+    {
+      for (int j = ineq_offsets[k]; j < ineq_offsets[k+1]; j++)
+      {
+        const bool control = ineq_var[j] >= 0 && ineq_local[j] >= nx;
+        const int source = std::min(k+1, control ? N-1 : N);
+        const int slot = shiftSlot(source, ineq_local[j], ineq_sign[j]);
+        if (slot < (int)lookup[source].size()) {
+          ineq_shift[j] = lookup[source][slot];
+        }
+      }
+    }
+  }
+
+  double relaxedBound(const double bound, const double sign) const
+  {
+    return bound - sign*opts.bound_relax_factor*std::max(1., std::abs(bound));
+  }
+
+  // local is the position of the variable in its stage, or -1 minus the
+  // position of the row among the constraint rows of the stage
+  void addInequality(const int var, const int row, const int local, const double lower, const double upper)
+  {
+    if (!std::isinf(lower))
+    {
+      ineq_var.push_back(var);
+      ineq_row.push_back(row);
+      ineq_local.push_back(local);
+      ineq_sign.push_back(1.);
+      ineq_bound.push_back(relaxedBound(lower, 1.));
+    }
+    if (!std::isinf(upper))
+    {
+      ineq_var.push_back(var);
+      ineq_row.push_back(row);
+      ineq_local.push_back(local);
+      ineq_sign.push_back(-1.);
+      ineq_bound.push_back(relaxedBound(upper, -1.));
+    }
+  }
+
+  // Objective, constraints and derivatives at w, integrated in parallel,
+  // and the inequalities e = sign*(value - bound) >= 0
+  void evaluate()
+  {
+    ms.evaluate(w.data(), J, g.data(), grad.data(), jac_nz.data());
+    ms.evaluateCostHessian(w.data(), hess_nz.data());
+    for (unsigned int j = 0; j < e.size(); j++) {
+      e[j] = ineq_sign[j]*((ineq_var[j] >= 0 ? w[ineq_var[j]] : g[ineq_row[j]]) - ineq_bound[j]);
+    }
+  }
+
+  // v += factor * de_j/d(stage variables)
+  void addInequalityGradient(const int j, const double factor, double* v) const
+  {
+    const int k = ineq_var[j] >= 0 ? stage(ineq_var[j]) : row_stage[ineq_row[j]];
+    if (ineq_var[j] >= 0) {
+      v[ineq_var[j] - kkt.offset(k)] += factor*ineq_sign[j];
+      return;
+    }
+    for (const Entry& en : row_entries[ineq_row[j]]) {
+      v[en.col] += factor*ineq_sign[j]*jac_nz[en.nz];
+    }
+  }
+
+  // Continuity Jacobian [A_k B_k] of interval k, nx-by-(nx+nu) column major
+  const double* continuityJacobian(const int k) const { return &jac_nz[k*(nx*(nx+nu) + nx)]; }
+
+  // Dual and primal residuals and complementarity of stage k
+  void residuals(const int k)
+  {
+    const int n = stageSize(k);
+    std::vector<double>& rd = stage_vectors[k];
+    std::copy(&grad[kkt.offset(k)], &grad[kkt.offset(k)] + n, rd.begin());
+    if (k < N) {
+      dense::gemm(true, false, n, 1, nx, 1., continuityJacobian(k), nx, &lambda[k*nx], nx, 1., &rd[0], n);
+    }
+    if (k > 0) {
+      for (int i = 0; i < nx; i++) {
+        rd[i] -= lambda[(k-1)*nx + i];
+      }
+    }
+
+    double primal = 0, comp = 0;
+    for (int j = ineq_offsets[k]; j < ineq_offsets[k+1]; j++)
+    {
+      addInequalityGradient(j, -z[j], &rd[0]);
+      primal = std::max(primal, std::abs(e[j] - s[j]));
+      comp += s[j]*z[j];
+    }
+    if (k < N) {
+      for (int i = 0; i < nx; i++) {
+        primal = std::max(primal, std::abs(g[ms.continuityRow(k)+i]));
+      }
+    }
+
+    double dual = 0;
+    for (int i = 0; i < n; i++) {
+      dual = std::max(dual, std::abs(rd[i]));
+    }
+    res_dual[k] = dual;
+    res_primal[k] = primal;
+    complementarity[k] = comp;
+  }
+
+  // Stage Hessian H_k + delta*I + E_k'*diag(z/s)*E_k and the linearized
+  // dynamics of stage k in the Riccati solver
+  void assembleMatrices(const int k, const double delta)
+  {
+    const int n = stageSize(k);
+    std::vector<double>& H = hessians[k];
+    std::fill(H.begin(), H.end(), 0.);
+    for (const HessianEntry& he : hess_entries[k])
+    {
+      H[he.col*n + he.row] += hess_nz[he.nz];
+      if (he.row != he.col) {
+        H[he.row*n + he.col] += hess_nz[he.nz];
+      }
+    }
+    for (int i = 0; i < n; i++) {
+      H[i*n + i] += delta + (i >= nx ? opts.controls_regularization : 0.);
+    }
+
+    std::vector<double>& grad_e = stage_vectors[k];
+    for (int j = ineq_offsets[k]; j < ineq_offsets[k+1]; j++)
+    {
+      if (!ineq_active[j]) {
+        continue;
+      }
+      std::fill(grad_e.begin(), grad_e.end(), 0.);
+      addInequalityGradient(j, 1., &grad_e[0]);
+      dense::gemm(false, true, n, n, 1, z[j]/s[j], &grad_e[0], n, &grad_e[0], n, 1., &H[0], n);
+    }
+
+    double* Q = kkt.Q(k);
+    for (int c = 0; c < nx; c++) {
+      for (int r = 0; r < nx; r++) {
+        Q[c*nx + r] = H[c*n + r];
+      }
+    }
+    if (k == N) {
+      return;
+    }
+    double* S = kkt.S(k);
+    double* R = kkt.R(k);
+    for (int c = 0; c < nx; c++) {
+      for (int r = 0; r < nu; r++) {
+        S[c*nu + r] = H[c*n + nx + r];
+      }
+    }
+    for (int c = 0; c < nu; c++) {
+      for (int r = 0; r < nu; r++) {
+        R[c*nu + r] = H[(nx+c)*n + nx + r];
+      }
+    }
+    const double* AB = continuityJacobian(k);
+    std::copy(AB, AB + nx*nx, kkt.A(k));
+    std::copy(AB + nx*nx, AB + nx*(nx+nu), kkt.B(k));
+    std::copy(&g[ms.continuityRow(k)], &g[ms.continuityRow(k)] + nx, kkt.c(k));
+  }
+
+  // Gradient of the reduced QP of stage k for the complementarity residual
+  // r_sz, grad f - E'z + E'*S^-1*(r_sz + Z*(e - s))
+  void assembleGradient(const int k)
+  {
+    std::vector<double>& v = stage_vectors[k];
+    std::copy(&grad[kkt.offset(k)], &grad[kkt.offset(k)] + stageSize(k), v.begin());
+    for (int j = ineq_offsets[k]; j < ineq_offsets[k+1]; j++) {
+      if (ineq_active[j]) {
+        addInequalityGradient(j, -z[j] + (r_sz[j] + z[j]*(e[j] - s[j]))/s[j], &v[0]);
+      }
+    }
+    std::copy(v.begin(), v.begin() + nx, kkt.q(k));
+    if (k < N) {
+      std::copy(v.begin() + nx, v.end(), kkt.r(k));
+    }
+  }
+
+  // Slack and multiplier steps of stage k from the primal step
+  void recoverStage(const int k)
+  {
+    const int n = stageSize(k);
+    std::vector<double>& grad_e = stage_vectors[k];
+    for (int j = ineq_offsets[k]; j < ineq_offsets[k+1]; j++)
+    {
+      if (!ineq_active[j])
+      {
+        ds[j] = dz[j] = 0.;
+        continue;
+      }
+      std::fill(grad_e.begin(), grad_e.end(), 0.);
+      addInequalityGradient(j, 1., &grad_e[0]);
+      double de = 0;
+      for (int i = 0; i < n; i++) {
+        de += grad_e[i]*dw[kkt.offset(k) + i];
+      }
+      ds[j] = de + e[j] - s[j];
+      dz[j] = -(r_sz[j] + z[j]*ds[j])/s[j];
+    }
+  }
+
+  // Newton direction for the current r_sz with the factorized recursion
+  void direction()
+  {
+    pool.parallelFor(N+1, [this](int k, int) { assembleGradient(k); });
+    kkt.solve(nullptr, dw.data(), lambda_qp.data());
+    pool.parallelFor(N+1, [this](int k, int) { recoverStage(k); });
+  }
+
+  // Backtracking from alpha until the barrier merit function decreases
+  // sufficiently, the primal iterate w, s is moved and evaluated. The
+  // penalty is increased to exceed the multipliers of the step, so the
+  // direction descends for a positive definite reduced Hessian.
+  bool lineSearch(const double mu, double& alpha)
+  {
+    const int m = ineq_var.size();
+    for (int i = 0; i < N*nx; i++) {
+      penalty = std::max(penalty, 1.1*std::abs(lambda_qp[nx+i]));
+    }
+    for (int j = 0; j < m; j++) {
+      penalty = std::max(penalty, 1.1*std::abs(z[j] + dz[j]));
+    }
+
+    // the step solves the linearized constraints, so the violation decreases
+    // at the rate of its l1 norm
+    double slope = -penalty*infeasibility();
+    for (int i = 0; i < ms.nv(); i++) {
+      slope += grad[i]*dw[i];
+    }
+    for (int j = 0; j < m; j++) {
+      slope -= mu*ds[j]/s[j];
+    }
+    const double phi0 = merit(mu);
+    w_start = w;
+    s_start = s;
+    for (int backtracks = 0;; backtracks++)
+    {
+      for (int i = 0; i < ms.nv(); i++) {
+        w[i] = w_start[i] + alpha*dw[i];
+      }
+      for (int j = 0; j < m; j++) {
+        s[j] = s_start[j] + alpha*ds[j];
+      }
+      evaluate();
+      // rounding errors close to the solution are accepted
+      const double phi = merit(mu);
+      if (phi <= phi0 + opts.sufficient_decrease*alpha*std::min(slope, 0.) +
+                 10*std::numeric_limits<double>::epsilon()*std::abs(phi0)) {
+        return true;
+      }
+      if (backtracks == opts.max_backtracks) {
+        w = w_start;
+        s = s_start;
+        evaluate();
+        return false;
+      }
+      alpha /= 2;
+    }
+  }
+
+  // Barrier function of the slacks with the l1 penalty of the violation
+  double merit(const double mu) const
+  {
+    double phi = J + penalty*infeasibility();
+    for (unsigned int j = 0; j < s.size(); j++) {
+      phi -= mu*std::log(s[j]);
+    }
+    return phi;
+  }
+
+  // l1 norm of the continuity constraints and of e - s
+  double infeasibility() const
+  {
+    double theta = 0.;
+    for (int k = 0; k < N; k++) {
+      for (int i = 0; i < nx; i++) {
+        theta += std::abs(g[ms.continuityRow(k)+i]);
+      }
+    }
+    for (unsigned int j = 0; j < e.size(); j++) {
+      theta += std::abs(e[j] - s[j]);
+    }
+    return theta;
+  }
+
+  // Largest step in (0, 1] with v + alpha*dv >= (1-tau)*v
+  static double maxStep(const std::vector<double>& v, const std::vector<double>& dv, const double tau)
+  {
+    double alpha = 1.;
+    for (unsigned int j = 0; j < v.size(); j++) {
+      if (dv[j] < 0) {
+        alpha = std::min(alpha, -tau*v[j]/dv[j]);
+      }
+    }
+    return alpha;
+  }
+
+  MultipleShooting& ms;
+  ThreadPool& pool;
+  InteriorPointOptions opts;
+  RiccatiSolver kkt;
+  int N, nx, nu;
+  int n_cont_nz;
+  HorizonShift horizon_shift;
+
+  std::vector<int> row_stage;  // stage of a constraint row, CONTINUITY or COUPLED
+  std::vector<std::vector<int> > stage_rows;  // rows of each stage
+  std::vector<int> coupled_rows;
+  std::vector<std::vector<Entry> > row_entries;
+  std::vector<std::vector<HessianEntry> > hess_entries;
+
+  // inequalities, a variable bound (var) or a constraint bound (row)
+  std::vector<int> ineq_var, ineq_row;
+  std::vector<double> ineq_sign, ineq_bound;
+  std::vector<int> ineq_local;    // position in the stage, see addInequality
+  std::vector<int> ineq_offsets;  // first inequality of each stage
+  std::vector<int> ineq_shift;    // source in a shifted iterate, or -1
+  std::vector<bool> ineq_finite;  // finite lower and upper bounds the layout was built for
+  std::vector<bool> ineq_active;  // inactive ones are constant in the steps
+
+  // iterate and linearization
+  std::vector<double> w, lambda, s, z;
+  double J;
+  double penalty;  // of the merit function, only increases during a solve
+  std::vector<double> g, grad, jac_nz, hess_nz, e;
+
+  // steps and workspace
+  std::vector<double> dw, lambda_qp, ds, dz, ds_aff, dz_aff, r_sz;
+  std::vector<double> w_start, s_start;
+  std::vector<std::vector<double> > hessians;
+  std::vector<std::vector<double> > stage_vectors;
+  std::vector<double> res_dual, res_primal, complementarity;
+};
+
+} // namespace ocl
+#endif // OCL_INTERIOR_POINT_H_
@@ -0,0 +1,232 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_REAL_TIME_ITERATION_H_
+#define OCL_REAL_TIME_ITERATION_H_
+
+#include <algorithm>  // min, max
+#include <chrono>
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "utils/assertions.h"  // assertEqual
+#include "solver/interior_point.h"
+
+namespace ocl {
+
+struct RealTimeIterationOptions : public InteriorPointOptions
+{
+  RealTimeIterationOptions() : centering(0.1) { }
+
+  double centering;  // target complementarity relative to the current one
+};
+
+// Real-time iteration for model predictive control: one Newton step of the
+// interior point method per sample, split into two phases.
+//
+//   preparation  linearizes at the current iterate (integration and
+//                sensitivities), factorizes the Riccati recursion and runs
+//                its backward recursion, before the state is measured
+//   feedback     sets the measured initial state and runs the forward
+//                sweep of the recursion, the new controls are available
+//                after O(N*(nx+nu)^2) operations
+//
+// The Hessian is the Hessian of the objective without the curvature of the
+// constraints, which is the Gauss-Newton Hessian for least squares costs.
+// The step is centered towards centering*mu, there is no corrector because
+// it would need a second solve after the state is known. Inequalities that
+// only depend on the initial state are ignored, the initial state is fixed
+// by the measurement.
+//
+// Start from an iterate of solve (e.g. the converged problem for the first
+// state) or from initialize, then call preparation and feedback once per
+// sample. The duration of the last call of each phase is recorded.
+class RealTimeIteration : public InteriorPoint
+{
+public:
+
+  RealTimeIteration(MultipleShooting& ms, ThreadPool& pool,
+                    const RealTimeIterationOptions& opts = RealTimeIterationOptions())
+      : InteriorPoint(ms, pool, opts), centering(opts.centering), prepared(false),
+        dx0(nx), preparation_time(0.), feedback_time(0.) { }
+
+  // Loads an iterate, e.g. the result of solve or a shifted iterate
+  void initialize(const InteriorPointResult& iterate)
+  {
+    InteriorPoint::initialize(iterate, true);
+    prepared = false;
+  }
+
+  // Solve to convergence, the solution is kept as the iterate
+  InteriorPointResult solve(const std::vector<double>& w0)
+  {
+    prepared = false;
+    return InteriorPoint::solve(w0);
+  }
+
+  InteriorPointResult solve(const InteriorPointResult& warm)
+  {
+    prepared = false;
+    return InteriorPoint::solve(warm);
+  }
+
+  void preparation()
+  {
+    const auto start = std::chrono::steady_clock::now();
+    if (w.empty()) {
+      throw OclException("Real-time iteration needs an iterate, call solve or initialize first.");
+    }
+    evaluate();
+
+    // inequalities on the initial state alone are fixed by the measurement
+    double comp = 0.;
+    int m = 0;
+    for (int j = ineq_offsets[0]; j < ineq_offsets[1]; j++)
+    {
+      bool depends_on_controls = ineq_var[j] >= nx;
+      if (ineq_var[j] < 0) {
+        for (const Entry& en : row_entries[ineq_row[j]]) {
+          depends_on_controls = depends_on_controls || en.col >= nx;
+        }
+      }
+      ineq_active[j] = depends_on_controls;
+    }
+    for (unsigned int j = 0; j < s.size(); j++)
+    {
+      if (ineq_active[j])
+      {
+        comp += s[j]*z[j];
+        m++;
+      }
+    }
+    const double mu = m > 0 ? comp/m : 0.;
+    for (unsigned int j = 0; j < s.size(); j++) {
+      r_sz[j] = s[j]*z[j] - centering*mu;
+    }
+
+    prepared = factorize(false);
+    if (prepared)
+    {
+      pool.parallelFor(N+1, [this](int k, int) { assembleGradient(k); });
+      kkt.backwardSolve();
+    }
+    preparation_time = seconds(start);
+  }
+
+  // Step for the measured initial state x0 (size nx), writes the controls
+  // of the first interval to u0 (size nu). Returns false if the preparation
+  // failed, the iterate is not changed then.
+  bool feedback(const double* x0, double* u0)
+  {
+    const auto start = std::chrono::steady_clock::now();
+    if (!prepared) {
+      return false;
+    }
+    prepared = false;
+
+    // the recursion solves for the step, dx0 = x0 - x0 of the iterate
+    for (int i = 0; i < nx; i++) {
+      dx0[i] = x0[i] - w[i];
+    }
+    kkt.forwardSolve(dx0.data(), dw.data(), lambda_qp.data());
+
+    // the controls take the step of the first stage to its boundary, and
+    // are clipped to their bounds, which are relaxed in the iterate
+    recoverStage(0);
+    const double alpha_0 = stageStep(s, ds, 0);
+    const std::vector<double>& lbw = ms.variableLowerBounds();
+    const std::vector<double>& ubw = ms.variableUpperBounds();
+    for (int i = 0; i < nu; i++) {
+      u0[i] = std::min(std::max(w[nx+i] + alpha_0*dw[nx+i], lbw[nx+i]), ubw[nx+i]);
+    }
+    feedback_time = seconds(start);
+
+    // update of the iterate, the first stage moves with the sent controls
+    for (int k = 1; k <= N; k++) {
+      recoverStage(k);
+    }
+    const double alpha_p = maxStep(s, ds, opts.fraction_to_boundary);
+    const double alpha_d = maxStep(z, dz, opts.fraction_to_boundary);
+    for (int i = 0; i < nx; i++) {
+      w[i] = x0[i];
+    }
+    for (int i = 0; i < nu; i++) {
+      w[nx+i] = u0[i];
+    }
+    for (int i = nx+nu; i < ms.nv(); i++) {
+      w[i] += alpha_p*dw[i];
+    }
+    for (int j = 0; j < (int)s.size(); j++)
+    {
+      s[j] += (j < ineq_offsets[1] ? alpha_0 : alpha_p)*ds[j];
+      z[j] += alpha_d*dz[j];
+    }
+    for (int i = 0; i < N*nx; i++) {
+      lambda[i] += alpha_d*(lambda_qp[nx+i] - lambda[i]);
+    }
+    return true;
+  }
+
+  bool feedback(const std::vector<double>& x0, std::vector<double>& u0)
+  {
+    assertEqual(x0.size(), nx, "Size of the initial state does not match nx.");
+    u0.resize(nu);
+    return feedback(x0.data(), u0.data());
+  }
+
+  // Current iterate, e.g. for shifting or inspection
+  InteriorPointResult iterate() const
+  {
+    InteriorPointResult result;
+    result.w = w;
+    result.lambda = lambda;
+    result.s = s;
+    result.z = z;
+    result.objective = J;
+    return result;
+  }
+
+  // Duration of the last preparation and feedback phase in seconds. The
+  // feedback time ends when the controls are available.
+  double preparationTime() const { return preparation_time; }
+  double feedbackTime() const { return feedback_time; }
+
+private:
+
+  // Largest step with v + alpha*dv >= (1-tau)*v for the inequalities of stage k
+  double stageStep(const std::vector<double>& v, const std::vector<double>& dv, const int k) const
+  {
+    double alpha = 1.;
+    for (int j = ineq_offsets[k]; j < ineq_offsets[k+1]; j++) {
+      if (dv[j] < 0) {
+        alpha = std::min(alpha, -opts.fraction_to_boundary*v[j]/dv[j]);
+      }
+    }
+    return alpha;
+  }
+
+  static double seconds(const std::chrono::steady_clock::time_point& start)
+  {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  double centering;
+  bool prepared;
+  std::vector<double> dx0;
+  double preparation_time;
+  double feedback_time;
+};
+
+} // namespace ocl
+#endif // OCL_REAL_TIME_ITERATION_H_
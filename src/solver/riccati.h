@@ -0,0 +1,358 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_RICCATI_H_
+#define OCL_RICCATI_H_
+
+#include <algorithm>  // copy, fill, min
+#include <cmath>      // sqrt
+#include <vector>
+
+#include "utils/exceptions.h"  // OclException
+#include "tensor/tree.h"
+
+namespace ocl {
+
+// Small dense kernels on column major blocks for the stage matrices
+namespace dense {
+
+// C = alpha*op(A)*op(B) + beta*C with op(A) m-by-k, op(B) k-by-n. Leading
+// dimensions are the number of rows of the stored (not transposed) blocks.
+inline void gemm(const bool ta, const bool tb, const int m, const int n, const int k, const double alpha,
+                 const double* A, const int lda, const double* B, const int ldb, const double beta,
+                 double* C, const int ldc)
+{
+  for (int j = 0; j < n; j++)
+  {
+    for (int i = 0; i < m; i++)
+    {
+      double sum = 0;
+      for (int l = 0; l < k; l++) {
+        sum += (ta ? A[i*lda+l] : A[l*lda+i]) * (tb ? B[l*ldb+j] : B[j*ldb+l]);
+      }
+      C[j*ldc+i] = alpha*sum + (beta == 0. ? 0. : beta*C[j*ldc+i]);
+    }
+  }
+}
+
+// In place Cholesky factorization A = L*L' of an n-by-n block, the lower
+// triangle is overwritten by L. Returns false if A is not positive definite.
+inline bool cholesky(const int n, double* A)
+{
+  for (int j = 0; j < n; j++)
+  {
+    double d = A[j*n+j];
+    for (int l = 0; l < j; l++) {
+      d -= A[l*n+j]*A[l*n+j];
+    }
+    if (!(d > 0.)) {
+      return false;
+    }
+    d = std::sqrt(d);
+    A[j*n+j] = d;
+    for (int i = j+1; i < n; i++)
+    {
+      double s = A[j*n+i];
+      for (int l = 0; l < j; l++) {
+        s -= A[l*n+i]*A[l*n+j];
+      }
+      A[j*n+i] = s/d;
+    }
+  }
+  return true;
+}
+
+// Solves L*L'*X = B in place for the n-by-m block B, L from cholesky
+inline void choleskySolve(const int n, const double* L, const int m, double* B)
+{
+  for (int c = 0; c < m; c++)
+  {
+    double* b = &B[c*n];
+    for (int i = 0; i < n; i++)
+    {
+      for (int l = 0; l < i; l++) {
+        b[i] -= L[l*n+i]*b[l];
+      }
+      b[i] /= L[i*n+i];
+    }
+    for (int i = n-1; i >= 0; i--)
+    {
+      for (int l = i+1; l < n; l++) {
+        b[i] -= L[i*n+l]*b[l];
+      }
+      b[i] /= L[i*n+i];
+    }
+  }
+}
+
+} // namespace dense
+
+// Solver for the KKT system of the stage structured quadratic program
+//
+//   min  sum_k 1/2 [x_k;u_k]'[Q_k S_k'; S_k R_k][x_k;u_k] + [q_k;r_k]'[x_k;u_k]
+//        + 1/2 x_N'Q_N x_N + q_N'x_N
+//   s.t. x_k+1 = A_k x_k + B_k u_k + c_k,  x_0 = x0
+//
+// by a backward Riccati recursion and a forward sweep, in O(N*(nx+nu)^3)
+// operations and without fill-in. The stage variables u_k are the
+// controls together with all other stage local variables (e.g. algebraic
+// variables), they have no dynamics of their own.
+//
+// All matrices are dense column major stage blocks, allocated once in the
+// constructor and filled in place through the accessors. The solution is
+// stored stage major, [x_0; u_0; x_1; u_1; ...; x_N], which is the layout
+// of control intervals added with TreeBuilder::addRepeated followed by the
+// final state.
+class RiccatiSolver
+{
+public:
+
+  // nx has N+1 entries (the final state included), nu has N entries
+  RiccatiSolver(const std::vector<int>& nx, const std::vector<int>& nu)
+  {
+    setup(nx, nu);
+  }
+
+  // Stage sizes from a tree of control intervals, each interval has the
+  // state "x" first followed by the stage local variables, and the final
+  // state (e.g. variables.get("interval") and variables.get("xf")).
+  RiccatiSolver(const Tree& intervals, const Tree& final_state)
+  {
+    std::vector<int> nx, nu;
+    for (int k = 0; k < intervals.size(); k++)
+    {
+      Tree interval = intervals.at(k);
+      Tree x = interval.get("x");
+      nx.push_back(x.numel());
+      nu.push_back(interval.numel() - x.numel());
+      const int first = interval.indizes(0)[0];
+      for (int i : x.indizes(0)) {
+        if (i >= first + nx.back()) {
+          throw OclException("The state must be the first block of a control interval.");
+        }
+      }
+    }
+    nx.push_back(final_state.numel());
+    setup(nx, nu);
+  }
+
+  int numStages() const { return N; }
+  int nx(const int k) const { return n_x[k]; }
+  int nu(const int k) const { return n_u[k]; }
+
+  // Number of primal variables, the size of the solution
+  int size() const { return offsets.back() + n_x[N]; }
+
+  // Offset of x_k in the solution, u_k follows
+  int offset(const int k) const { return offsets[k]; }
+
+  // Stage data, k = 0..N-1 (Q and q also for k = N)
+  double* Q(const int k) { return &data[k].Q[0]; }
+  double* S(const int k) { return &data[k].S[0]; }
+  double* R(const int k) { return &data[k].R[0]; }
+  double* q(const int k) { return &data[k].q[0]; }
+  double* r(const int k) { return &data[k].r[0]; }
+  double* A(const int k) { return &data[k].A[0]; }
+  double* B(const int k) { return &data[k].B[0]; }
+  double* c(const int k) { return &data[k].c[0]; }
+
+  // Backward recursion of the matrices, depends on Q, S, R, A and B only.
+  // Returns false if a reduced Hessian R_k + B_k'P_k+1 B_k is not positive
+  // definite, e.g. for a Hessian that needs regularization. With a free
+  // initial state P_0 has to be positive definite as well.
+  bool factorize(const bool free_initial_state = false)
+  {
+    Stage& last = data[N];
+    std::copy(last.Q.begin(), last.Q.end(), last.P.begin());
+
+    for (int k = N-1; k >= 0; k--)
+    {
+      Stage& s = data[k];
+      const Stage& next = data[k+1];
+      const int mx = n_x[k], mu = n_u[k], mn = n_x[k+1];
+
+      // PA = P_k+1*A_k, PB = P_k+1*B_k
+      dense::gemm(false, false, mn, mx, mn, 1., &next.P[0], mn, &s.A[0], mn, 0., &s.PA[0], mn);
+      dense::gemm(false, false, mn, mu, mn, 1., &next.P[0], mn, &s.B[0], mn, 0., &s.PB[0], mn);
+
+      // Re = R + B'PB, Se = S + B'PA
+      std::copy(s.R.begin(), s.R.end(), s.L.begin());
+      dense::gemm(true, false, mu, mu, mn, 1., &s.B[0], mn, &s.PB[0], mn, 1., &s.L[0], mu);
+      std::copy(s.S.begin(), s.S.end(), s.Se.begin());
+      dense::gemm(true, false, mu, mx, mn, 1., &s.B[0], mn, &s.PA[0], mn, 1., &s.Se[0], mu);
+      if (!dense::cholesky(mu, &s.L[0])) {
+        return false;
+      }
+
+      // feedback K = -Re^-1*Se, P = Q + A'PA + Se'*K
+      std::copy(s.Se.begin(), s.Se.end(), s.K.begin());
+      dense::choleskySolve(mu, &s.L[0], mx, &s.K[0]);
+      for (double& v : s.K) {
+        v = -v;
+      }
+      std::copy(s.Q.begin(), s.Q.end(), s.P.begin());
+      dense::gemm(true, false, mx, mx, mn, 1., &s.A[0], mn, &s.PA[0], mn, 1., &s.P[0], mx);
+      dense::gemm(true, false, mx, mx, mu, 1., &s.Se[0], mu, &s.K[0], mu, 1., &s.P[0], mx);
+    }
+
+    free_x0 = free_initial_state;
+    if (free_x0)
+    {
+      L0 = data[0].P;
+      return dense::cholesky(n_x[0], &L0[0]);
+    }
+    return true;
+  }
+
+  // Backward recursion of the vectors (q, r, c) and forward sweep after
+  // factorize, several right hand sides can be solved with one
+  // factorization. Writes the primal solution (size()) and the multipliers
+  // of x_0 = x0 and of the dynamics, lambda_0..lambda_N stacked (sum of nx),
+  // with the Lagrangian
+  //   cost + lambda_0'(x0 - x_0) + sum_k lambda_k+1'(A_k x_k + B_k u_k + c_k - x_k+1).
+  // With a free initial state x0 is nullptr, x_0 is optimized as well and
+  // lambda_0 is zero.
+  void solve(const double* x0, double* sol, double* lambda)
+  {
+    backwardSolve();
+    forwardSolve(x0, sol, lambda);
+  }
+
+  // The two parts of solve. The backward recursion does not depend on x0,
+  // it can run before the initial state is known.
+  void backwardSolve()
+  {
+    Stage& last = data[N];
+    std::copy(last.q.begin(), last.q.end(), last.p.begin());
+    for (int k = N-1; k >= 0; k--)
+    {
+      Stage& s = data[k];
+      const Stage& next = data[k+1];
+      const int mx = n_x[k], mu = n_u[k], mn = n_x[k+1];
+
+      // Pc = P_k+1*c_k + p_k+1, feedforward kff = -Re^-1*(r + B'Pc)
+      std::copy(next.p.begin(), next.p.end(), s.Pc.begin());
+      dense::gemm(false, false, mn, 1, mn, 1., &next.P[0], mn, &s.c[0], mn, 1., &s.Pc[0], mn);
+      std::copy(s.r.begin(), s.r.end(), s.kff.begin());
+      dense::gemm(true, false, mu, 1, mn, 1., &s.B[0], mn, &s.Pc[0], mn, 1., &s.kff[0], mu);
+      dense::choleskySolve(mu, &s.L[0], 1, &s.kff[0]);
+      for (double& v : s.kff) {
+        v = -v;
+      }
+
+      // p = q + A'Pc + Se'*kff
+      std::copy(s.q.begin(), s.q.end(), s.p.begin());
+      dense::gemm(true, false, mx, 1, mn, 1., &s.A[0], mn, &s.Pc[0], mn, 1., &s.p[0], mx);
+      dense::gemm(true, false, mx, 1, mu, 1., &s.Se[0], mu, &s.kff[0], mu, 1., &s.p[0], mx);
+    }
+  }
+
+  void forwardSolve(const double* x0, double* sol, double* lambda) const
+  {
+    if (!x0 && !free_x0) {
+      throw OclException("Riccati solver was not factorized for a free initial state.");
+    }
+
+    // x_0 = -P_0^-1*p_0 for a free initial state
+    if (x0) {
+      std::copy(x0, x0 + n_x[0], &sol[offsets[0]]);
+    } else {
+      for (int i = 0; i < n_x[0]; i++) {
+        sol[offsets[0]+i] = -data[0].p[i];
+      }
+      dense::choleskySolve(n_x[0], &L0[0], 1, &sol[offsets[0]]);
+    }
+
+    int l = 0;
+    for (int k = 0; k <= N; k++)
+    {
+      const Stage& s = data[k];
+      const double* x = &sol[offsets[k]];
+
+      // lambda_k = P_k*x_k + p_k
+      if (lambda)
+      {
+        std::copy(s.p.begin(), s.p.end(), &lambda[l]);
+        dense::gemm(false, false, n_x[k], 1, n_x[k], 1., &s.P[0], n_x[k], x, n_x[k], 1., &lambda[l], n_x[k]);
+        l += n_x[k];
+      }
+      if (k == N) {
+        break;
+      }
+
+      // u_k = K_k*x_k + kff_k, x_k+1 = A_k*x_k + B_k*u_k + c_k
+      double* u = &sol[offsets[k] + n_x[k]];
+      double* x_next = &sol[offsets[k+1]];
+      std::copy(s.kff.begin(), s.kff.end(), u);
+      dense::gemm(false, false, n_u[k], 1, n_x[k], 1., &s.K[0], n_u[k], x, n_x[k], 1., u, n_u[k]);
+      std::copy(s.c.begin(), s.c.end(), x_next);
+      dense::gemm(false, false, n_x[k+1], 1, n_x[k], 1., &s.A[0], n_x[k+1], x, n_x[k], 1., x_next, n_x[k+1]);
+      dense::gemm(false, false, n_x[k+1], 1, n_u[k], 1., &s.B[0], n_x[k+1], u, n_u[k], 1., x_next, n_x[k+1]);
+    }
+    if (lambda && !x0) {
+      std::fill(lambda, lambda + n_x[0], 0.);
+    }
+  }
+
+private:
+
+  struct Stage
+  {
+    // problem data
+    std::vector<double> Q, S, R, q, r, A, B, c;
+    // cost-to-go P_k, p_k, Cholesky factor of Re, feedback and workspace
+    std::vector<double> P, p, L, K, kff, Se, PA, PB, Pc;
+  };
+
+  void setup(const std::vector<int>& nx, const std::vector<int>& nu)
+  {
+    if (nx.size() != nu.size() + 1) {
+      throw OclException("Riccati solver needs one more state block than control blocks.");
+    }
+    N = nu.size();
+    free_x0 = false;
+    n_x = nx;
+    n_u = nu;
+    n_u.push_back(0);
+
+    data.resize(N+1);
+    offsets.push_back(0);
+    for (int k = 0; k <= N; k++)
+    {
+      const int mx = n_x[k], mu = n_u[k], mn = k < N ? n_x[k+1] : 0;
+      Stage& s = data[k];
+      s.Q.assign(mx*mx, 0.); s.S.assign(mu*mx, 0.); s.R.assign(mu*mu, 0.);
+      s.q.assign(mx, 0.); s.r.assign(mu, 0.);
+      s.A.assign(mn*mx, 0.); s.B.assign(mn*mu, 0.); s.c.assign(mn, 0.);
+      s.P.assign(mx*mx, 0.); s.p.assign(mx, 0.);
+      s.L.assign(mu*mu, 0.); s.K.assign(mu*mx, 0.); s.kff.assign(mu, 0.);
+      s.Se.assign(mu*mx, 0.);
+      s.PA.assign(mn*mx, 0.); s.PB.assign(mn*mu, 0.); s.Pc.assign(mn, 0.);
+      if (k < N) {
+        offsets.push_back(offsets.back() + mx + mu);
+      }
+    }
+  }
+
+  int N;
+  bool free_x0;
+  std::vector<double> L0;  // Cholesky factor of P_0 for a free initial state
+  std::vector<int> n_x;
+  std::vector<int> n_u;
+  std::vector<int> offsets;
+  std::vector<Stage> data;
+};
+
+} // namespace ocl
+#endif // OCL_RICCATI_H_
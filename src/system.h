@@ -15,9 +15,18 @@
 #ifndef OCL_SYSTEM_H_
 #define OCL_SYSTEM_H_
 
+#include <algorithm>  // max
+#include <map>
+#include <memory>  // unique_ptr
+#include <mutex>
+#include <string>
+
 #include "utils/typedefs.h"
+#include "tensor/tree_builder.h"
 #include "tensor/tree_tensor.h"
 #include "function_interface.h"
+#include "system_structure.h"
+#include "thread_pool.h"
 
 namespace ocl {
 
@@ -65,10 +74,34 @@ public:
     bounds[id] = Bound(lower_bound,upper_bound);
   }
 
+  // N states of the same shape stored under one id (e.g. the positions of N
+  // bodies). x.get(id) is then a tensor of length N, its equation can be
+  // given as tensor of length N as well.
+  void stackedState( const std::string& id, const int N, const std::vector<int>& shape = {1,1},
+                     const double& lower_bound = -std::numeric_limits<double>::infinity(),
+                     const double& upper_bound = std::numeric_limits<double>::infinity())
+  {
+    for (int i = 0; i < N; i++) {
+      states_struct.add(id, shape);
+    }
+    bounds[id] = Bound(lower_bound,upper_bound);
+  }
+
+  void stackedAlgebraic( const std::string& id, const int N, const std::vector<int>& shape = {1,1},
+                         const double& lower_bound = -std::numeric_limits<double>::infinity(),
+                         const double& upper_bound = std::numeric_limits<double>::infinity())
+  {
+    for (int i = 0; i < N; i++) {
+      algebraics_struct.add(id, shape);
+    }
+    bounds[id] = Bound(lower_bound,upper_bound);
+  }
+
   Tree getStates() { return states_struct.tree(); }
   Tree getAlgebraics() { return algebraics_struct.tree(); }
   Tree getControls() { return controls_struct.tree(); }
   Tree getParameters() { return parameters_struct.tree(); }
+  std::map<std::string, Bound> getBounds() const { return bounds; }
 
 private:
   std::map<std::string, Bound> bounds;
@@ -124,11 +157,113 @@ public:
 typedef void (*VariablesFunctionPtr)(SystemVariablesHandler& sh);
 typedef void (*EquationsFunctionPtr)(SystemEquationsHandler& eh, const TreeTensor& x, const TreeTensor& z, const TreeTensor& u, const TreeTensor& p);
 
+// Places the equations given by variable id into one column vector, the
+// equation of each variable at the indizes of the variable in the tree
+// (e.g. the differential equation of a state at the index of the state).
+//
+// The slots are computed once from the tree, assembling is a single
+// concatenation followed by a permutation. Equations of stacked variables
+// are tensors with one matrix per element of the stack, which are placed
+// at the indizes of the elements in order. Each matrix must have the shape
+// of the variable, so that no equation is silently reordered.
+class OutputAssemblyPlan
+{
+public:
+
+  OutputAssemblyPlan(const Tree& tree) : n(tree.numel()), permutation(tree.numel(), -1)
+  {
+    int k = 0;
+    for (auto& kv : tree.branches())
+    {
+      Tree var = tree.get(kv.first);
+      ids.push_back(kv.first);
+      shapes.push_back(var.shape());
+      lengths.push_back(var.size());
+      for (const std::vector<int>& idz : var.indizes()) {
+        for (int slot : idz) {
+          permutation[slot] = k++;
+        }
+      }
+    }
+    assertEqual(k, n, "Variables do not cover the tree.");
+  }
+
+  int size() const { return n; }
+
+  // Throws if an equation is missing, given for an unknown variable, or
+  // does not have the stack length and shape of its variable.
+  Matrix assemble(const std::map<std::string, Tensor>& equations) const
+  {
+    if (n == 0) {
+      return Matrix::Zero(0,1);
+    }
+
+    for (auto& kv : equations) {
+      if (std::find(ids.begin(), ids.end(), kv.first) == ids.end()) {
+        throw OclException(("Equation given for unknown variable " + kv.first).c_str());
+      }
+    }
+
+    // one piece per matrix of the equation tensors, in the order of the slots
+    std::vector<CasadiMatrix> pieces;
+    for (unsigned int i=0; i < ids.size(); i++)
+    {
+      auto it = equations.find(ids[i]);
+      if (it == equations.end()) {
+        throw OclException(("No equation given for variable " + ids[i]).c_str());
+      }
+      if (!matchesShape(it->second, shapes[i], lengths[i])) {
+        throw OclException(("Size of the equation does not match the variable " + ids[i]).c_str());
+      }
+      appendColumns(it->second, pieces);
+    }
+    return Matrix(CasadiMatrix::vertcat(pieces)(permutation));
+  }
+
+  // Appends the matrices of a (trajectory valued) tensor as columns,
+  // returns the number of elements appended.
+  static int appendColumns(const Tensor& t, std::vector<CasadiMatrix>& columns)
+  {
+    int n_el = 0;
+    for (unsigned int j=0; j < t.length(); j++) {
+      columns.push_back(column(t.get(j)).raw());
+      n_el += columns.back().numel();
+    }
+    return n_el;
+  }
+
+private:
+
+  // One matrix of the shape of the variable per element of the stack
+  static bool matchesShape(const Tensor& t, const std::vector<int>& shape, const int length)
+  {
+    if ((int)t.length() != length) {
+      return false;
+    }
+    const int rows = shape.size() > 0 ? shape[0] : 1;
+    const int cols = shape.size() > 1 ? shape[1] : 1;
+    for (unsigned int j=0; j < t.length(); j++)
+    {
+      Matrix m = t.get(j);
+      if (m.size(0) != rows || m.size(1) != cols) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  int n;
+  std::vector<std::string> ids;
+  std::vector<std::vector<int> > shapes;
+  std::vector<int> lengths;
+  std::vector< ::casadi::casadi_int > permutation;  // slot -> element of the concatenated pieces
+};
+
 class SystemFunction : public FunctionInterface
 {
 public:
   SystemFunction(const EquationsFunctionPtr& fcn_ptr, const std::vector<Tree>& inputs, const int n_outputs)
-      : FunctionInterface(inputs, n_outputs), equations_fcn_ptr(fcn_ptr), input_structs(inputs) { }
+      : FunctionInterface(inputs, n_outputs), equations_fcn_ptr(fcn_ptr), diff_plan(inputs[0]) { }
 
   std::vector<Matrix> fcnEvaluate(const std::vector<Matrix>& args) const override
   {
@@ -150,28 +285,13 @@ public:
 
     this->equations_fcn_ptr(eh, x, z, u, p);
 
-    // Concatenate differential equation in the same order as the states
-    //
-    Matrix diff_eq = Matrix::Zero(0,1);
-    for (auto& kv : this->input_structs[0].branches())
-    {
-      std::string id = kv.first;
-      assertEqual(eh.sys_eq.differential.eq[id].length(), 1, "Support for matrix (2-dimensional) variables and equations only.");
-
-      Matrix eq = eh.sys_eq.differential.eq[id].get(0);
-      eq = column(eq);
-      diff_eq = vertcat(diff_eq, eq);
-    }
-
-    Matrix implicit_eq = Matrix::Zero(0,1);
-    for (auto el : eh.sys_eq.implicit.eq)
-    {
-      assertEqual(el.length(), 1, "Support for matrix (2-dimensional) variables and equations only.");
+    Matrix diff_eq = diff_plan.assemble(eh.sys_eq.differential.eq);
 
-      Matrix eq = el.get(0);
-      eq = column(eq);
-      implicit_eq = vertcat(implicit_eq, eq);
+    std::vector<CasadiMatrix> implicit_eqs;
+    for (const Tensor& el : eh.sys_eq.implicit.eq) {
+      OutputAssemblyPlan::appendColumns(el, implicit_eqs);
     }
+    Matrix implicit_eq = implicit_eqs.empty() ? Matrix::Zero(0,1) : Matrix(CasadiMatrix::vertcat(implicit_eqs));
 
     std::vector<Matrix> outputs(2);
     outputs[0] = diff_eq;
@@ -182,10 +302,23 @@ public:
 
 private:
   EquationsFunctionPtr equations_fcn_ptr;
-  std::vector<Tree> input_structs;
+  OutputAssemblyPlan diff_plan;
 };
 
 
+// Derivative functions of the system, generated once with algorithmic
+// differentiation from the traced equations.
+// All functions have the inputs (x, z, u, p) followed by the seed, the
+// outputs f = [ode; implicit] are differentiated with respect to the
+// variables v = [x; z; u; p].
+struct SystemDerivatives
+{
+  ::casadi::Function jacobian;   // (x,z,u,p) -> df/dv, sparse
+  ::casadi::Function hessian;    // (x,z,u,p,lambda) -> d2(lambda'*f)/dv2, sparse
+  ::casadi::Function forward;    // (x,z,u,p,seed_v) -> df/dv*seed_v
+  ::casadi::Function adjoint;    // (x,z,u,p,seed_f) -> (df/dv)'*seed_f
+};
+
 typedef SystemVariablesHandler SVH;
 typedef SystemEquationsHandler SEH;
 typedef TreeTensor TT;
@@ -194,14 +327,39 @@ class System
 {
 public:
 
-  static std::vector<Tree> setupVariables(const VariablesFunctionPtr variables_fcn_ptr) {
+  static SystemVariablesHandler setupVariables(const VariablesFunctionPtr variables_fcn_ptr) {
     SystemVariablesHandler svh;
     variables_fcn_ptr(svh);
-    return {svh.getStates(),svh.getAlgebraics(),svh.getControls(),svh.getParameters()};
+    return svh;
   }
 
+  // The equations are traced once on symbolic inputs and compiled,
+  // evaluations only run the compiled expression graph.
   System(const VariablesFunctionPtr variables_fcn_ptr, const EquationsFunctionPtr equations_fcn_ptr)
-      : system_fcn(equations_fcn_ptr, System::setupVariables(variables_fcn_ptr), 2) { }
+      : System(System::setupVariables(variables_fcn_ptr), equations_fcn_ptr) { }
+
+  Tree states() const { return system_fcn.inputStructs()[0]; }
+  Tree algebraics() const { return system_fcn.inputStructs()[1]; }
+  Tree controls() const { return system_fcn.inputStructs()[2]; }
+  Tree parameters() const { return system_fcn.inputStructs()[3]; }
+
+  // Bounds of the variables by id as declared in the variables function
+  const std::map<std::string, Bound>& bounds() const { return variable_bounds; }
+
+  int nx() const { return casadiFunction().numel_in(0); }
+  int nz() const { return casadiFunction().numel_in(1); }
+  int nu() const { return casadiFunction().numel_in(2); }
+  int np() const { return casadiFunction().numel_in(3); }
+
+  // Number of implicit equations
+  int ni() const { return casadiFunction().numel_out(1); }
+
+  // Compiled system function with inputs (x,z,u,p) and outputs (ode, implicit)
+  const ::casadi::Function& casadiFunction() const { return system_fcn.casadiFunction(); }
+
+  // Expression graph of the system, for building larger expressions from
+  // symbolic calls (e.g. integrator stage equations)
+  const ::casadi::Function& expressionFunction() const { return system_fcn.expressionFunction(); }
 
   void evaluate(const Matrix& x, const Matrix& z, const Matrix& u, const Matrix& p, Matrix& diff_out, Matrix& implicit_out)
   {
@@ -212,8 +370,216 @@ public:
     implicit_out = outputs[1];
   }
 
+  // Allocation free evaluation on raw buffers. Inputs have sizes nx, nz, nu,
+  // np and outputs sizes nx and ni. Calls on the same workspace must not run
+  // concurrently, use one workspace per thread.
+  void evaluate(const double* x, const double* z, const double* u, const double* p,
+                double* diff_out, double* implicit_out, FunctionWorkspace& ws) const
+  {
+    const double* inputs[4] = {x, z, u, p};
+    double* outputs[2] = {diff_out, implicit_out};
+    ws.evaluate(inputs, outputs);
+  }
+
+  FunctionWorkspace workspace() const { return system_fcn.workspace(); }
+
+  // System function mapped over N points. Inputs and outputs are column
+  // stacked, e.g. x is nx-by-N and diff_out is nx-by-N in column major order.
+  // parallelization is "serial", "openmp" or "thread" (max_num_threads is
+  // used for "thread" only). Mapped functions are created once and cached,
+  // the cache can be filled from several threads. Returned by value, a
+  // reference counted handle that stays valid when generateCode clears the
+  // cache.
+  ::casadi::Function batchFunction(const int N, const std::string& parallelization = "serial",
+                                          const int max_num_threads = 4)
+  {
+    std::string key = std::to_string(N) + ":" + parallelization + ":" + std::to_string(max_num_threads);
+    std::lock_guard<std::mutex> lock(*batch_mutex);
+    auto it = batch_fcns.find(key);
+    if (it == batch_fcns.end())
+    {
+      ::casadi::Function f;
+      if (parallelization == "thread") {
+        f = casadiFunction().map(N, parallelization, max_num_threads);
+      } else {
+        f = casadiFunction().map(N, parallelization);
+      }
+      it = batch_fcns.insert(std::make_pair(key, f)).first;
+    }
+    return it->second;
+  }
+
+  // Workspace for the batch evaluation of N points. Pass it to the raw
+  // buffer evaluate method with inputs and outputs of N stacked columns.
+  FunctionWorkspace batchWorkspace(const int N, const std::string& parallelization = "serial",
+                                   const int max_num_threads = 4)
+  {
+    return FunctionWorkspace(batchFunction(N, parallelization, max_num_threads));
+  }
+
+  // Derivative functions, generated on the first call and cached, the first
+  // call can come from several threads
+  const SystemDerivatives& derivatives()
+  {
+    std::lock_guard<std::mutex> lock(*derivatives_mutex);
+    if (derivative_fcns.jacobian.is_null())
+    {
+      const std::vector<CasadiMatrix>& in = system_fcn.symbolicInputs();
+      const std::vector<CasadiMatrix>& out = system_fcn.symbolicOutputs();
+      CasadiMatrix v = CasadiMatrix::vertcat(in);
+      CasadiMatrix f = CasadiMatrix::vertcat(out);
+      CasadiMatrix lambda = CasadiMatrix::sym("lambda", f.size1());
+      CasadiMatrix seed_v = CasadiMatrix::sym("seed_v", v.size1());
+
+      std::vector<CasadiMatrix> in_lambda = in;
+      in_lambda.push_back(lambda);
+      std::vector<CasadiMatrix> in_seed = in;
+      in_seed.push_back(seed_v);
+
+      CasadiMatrix lagrangian = CasadiMatrix::dot(lambda, f);
+
+      derivative_fcns.jacobian = ::casadi::Function("system_jac", in, {CasadiMatrix::jacobian(f, v)});
+      derivative_fcns.hessian = ::casadi::Function("system_hess", in_lambda, {CasadiMatrix::hessian(lagrangian, v)});
+      derivative_fcns.forward = ::casadi::Function("system_fwd", in_seed,
+                                                   {CasadiMatrix::densify(CasadiMatrix::jtimes(f, v, seed_v))});
+      derivative_fcns.adjoint = ::casadi::Function("system_adj", in_lambda,
+                                                   {CasadiMatrix::densify(CasadiMatrix::jtimes(f, v, lambda, true))});
+    }
+    return derivative_fcns;
+  }
+
+  // Sparsity patterns of the Jacobian and of the Hessian of the Lagrangian.
+  // Raw derivative buffers hold the nonzeros in casadi (column compressed) order.
+  const ::casadi::Sparsity& jacobianSparsity() { return derivatives().jacobian.sparsity_out(0); }
+  const ::casadi::Sparsity& hessianSparsity() { return derivatives().hessian.sparsity_out(0); }
+
+  // Structural dependency of the equations on the variables, from the
+  // traced expressions. Rows are named "ode.<state>" and "implicit",
+  // columns "x.<id>", "z.<id>", "u.<id>" and "p.<id>".
+  const SystemStructure& structure()
+  {
+    std::lock_guard<std::mutex> lock(*structure_mutex);
+    if (structure_info.rowBlocks().empty() && structure_info.colBlocks().empty())
+    {
+      std::vector<PatternBlock> rows = patternBlocks(states(), "ode.", 0);
+      if (ni() > 0) {
+        rows.push_back({"implicit", range(nx(), nx()+ni())});
+      }
+
+      std::vector<PatternBlock> cols = patternBlocks(states(), "x.", 0);
+      const std::vector<std::pair<std::string, Tree> > groups = {
+          {"z.", algebraics()}, {"u.", controls()}, {"p.", parameters()}};
+      int offset = nx();
+      for (auto& g : groups) {
+        std::vector<PatternBlock> blocks = patternBlocks(g.second, g.first, offset);
+        cols.insert(cols.end(), blocks.begin(), blocks.end());
+        offset += g.second.numel();
+      }
+      structure_info = SystemStructure(jacobianSparsity(), rows, cols);
+    }
+    return structure_info;
+  }
+
+  FunctionWorkspace jacobianWorkspace() { return FunctionWorkspace(derivatives().jacobian); }
+  FunctionWorkspace hessianWorkspace() { return FunctionWorkspace(derivatives().hessian); }
+  FunctionWorkspace forwardWorkspace() { return FunctionWorkspace(derivatives().forward); }
+  FunctionWorkspace adjointWorkspace() { return FunctionWorkspace(derivatives().adjoint); }
+
+  // Nonzeros of df/dv, ws from jacobianWorkspace
+  void jacobian(const double* x, const double* z, const double* u, const double* p,
+                double* jac_nz, FunctionWorkspace& ws) const
+  {
+    const double* inputs[4] = {x, z, u, p};
+    double* outputs[1] = {jac_nz};
+    ws.evaluate(inputs, outputs);
+  }
+
+  // Nonzeros of the Hessian of lambda'*f, ws from hessianWorkspace
+  void hessianLagrangian(const double* x, const double* z, const double* u, const double* p,
+                         const double* lambda, double* hess_nz, FunctionWorkspace& ws) const
+  {
+    const double* inputs[5] = {x, z, u, p, lambda};
+    double* outputs[1] = {hess_nz};
+    ws.evaluate(inputs, outputs);
+  }
+
+  // Forward directional derivative df/dv*seed, ws from forwardWorkspace
+  void forwardDerivative(const double* x, const double* z, const double* u, const double* p,
+                         const double* seed, double* sens, FunctionWorkspace& ws) const
+  {
+    const double* inputs[5] = {x, z, u, p, seed};
+    double* outputs[1] = {sens};
+    ws.evaluate(inputs, outputs);
+  }
+
+  // Adjoint directional derivative (df/dv)'*seed, ws from adjointWorkspace
+  void adjointDerivative(const double* x, const double* z, const double* u, const double* p,
+                         const double* seed, double* sens, FunctionWorkspace& ws) const
+  {
+    const double* inputs[5] = {x, z, u, p, seed};
+    double* outputs[1] = {sens};
+    ws.evaluate(inputs, outputs);
+  }
+
+  // Jacobian df/dv as Matrix, for numeric inputs
+  Matrix jacobian(const Matrix& x, const Matrix& z, const Matrix& u, const Matrix& p)
+  {
+    std::vector< ::casadi::DM > args = {::casadi::DM(x.raw()), ::casadi::DM(z.raw()),
+                                        ::casadi::DM(u.raw()), ::casadi::DM(p.raw())};
+    std::vector< ::casadi::DM > outputs;
+    derivatives().jacobian.call(args, outputs);
+    return Matrix(outputs[0]);
+  }
+
+  // Runs all numeric evaluations (single, batch, parallel) on generated and
+  // compiled C code, see FunctionInterface::generate.
+  void generateCode(const CodegenOptions& opts = CodegenOptions())
+  {
+    system_fcn.generate(opts);
+    std::lock_guard<std::mutex> lock(*batch_mutex);
+    batch_fcns.clear();
+  }
+
+  bool isGenerated() const { return system_fcn.isGenerated(); }
+
+  // Evaluates the system at many points (e.g. shooting nodes) across the
+  // workers of the pool, each worker uses its own workspace.
+  ParallelFunction parallelFunction(ThreadPool& pool) const
+  {
+    return ParallelFunction(casadiFunction(), pool);
+  }
+
+  // Evaluates N points given as columns of x, z, u, p. Inputs with a single
+  // column are used for all points.
+  void evaluateBatch(const Matrix& x, const Matrix& z, const Matrix& u, const Matrix& p,
+                     Matrix& diff_out, Matrix& implicit_out, const std::string& parallelization = "serial")
+  {
+    int N = std::max(std::max(x.size(1), z.size(1)), std::max(u.size(1), p.size(1)));
+    std::vector< ::casadi::DM > args = {::casadi::DM(x.raw()), ::casadi::DM(z.raw()),
+                                        ::casadi::DM(u.raw()), ::casadi::DM(p.raw())};
+    std::vector< ::casadi::DM > outputs;
+    batchFunction(N, parallelization).call(args, outputs);
+    diff_out = Matrix(outputs[0]);
+    implicit_out = Matrix(outputs[1]);
+  }
+
 private:
+  System(SystemVariablesHandler svh, const EquationsFunctionPtr equations_fcn_ptr)
+      : system_fcn(equations_fcn_ptr, {svh.getStates(),svh.getAlgebraics(),svh.getControls(),svh.getParameters()}, 2),
+        variable_bounds(svh.getBounds()), batch_mutex(new std::mutex()),
+        derivatives_mutex(new std::mutex()), structure_mutex(new std::mutex())
+  {
+    system_fcn.compile("system");
+  }
+
   SystemFunction system_fcn;
+  std::map<std::string, Bound> variable_bounds;
+  std::map<std::string, ::casadi::Function> batch_fcns;
+  std::unique_ptr<std::mutex> batch_mutex;  // guards batch_fcns, keeps System movable
+  std::unique_ptr<std::mutex> derivatives_mutex;  // guards building derivative_fcns
+  std::unique_ptr<std::mutex> structure_mutex;    // guards building structure_info
+  SystemDerivatives derivative_fcns;
+  SystemStructure structure_info;
 };
 
 } // namespace ocl
@@ -0,0 +1,155 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_SYSTEM_STRUCTURE_H_
+#define OCL_SYSTEM_STRUCTURE_H_
+
+#include <algorithm>  // max
+#include <iomanip>    // setw
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "utils/assertions.h"  // assertTrue
+#include "utils/exceptions.h"  // OclException
+#include "tensor/casadi.h"     // casadi::Sparsity
+#include "tensor/tree.h"       // Tree
+
+namespace ocl {
+
+// Named set of rows or columns of a pattern, e.g. the elements of a variable
+struct PatternBlock
+{
+  std::string name;
+  std::vector<int> indizes;
+};
+
+// Blocks for all variables of a tree, named prefix + id. The indizes are
+// the indizes of the variables shifted by offset.
+static inline std::vector<PatternBlock> patternBlocks(const Tree& tree, const std::string& prefix, const int offset)
+{
+  std::vector<PatternBlock> blocks;
+  for (auto& kv : tree.branches())
+  {
+    PatternBlock block;
+    block.name = prefix + kv.first;
+    for (const std::vector<int>& idz : tree.get(kv.first).indizes()) {
+      for (int i : idz) {
+        block.indizes.push_back(offset + i);
+      }
+    }
+    blocks.push_back(block);
+  }
+  return blocks;
+}
+
+// Structural dependency pattern of the system equations (rows) on the
+// system variables (columns), element-wise as sparsity and aggregated per
+// variable and equation block.
+class SystemStructure
+{
+public:
+
+  SystemStructure() { }
+
+  SystemStructure(const ::casadi::Sparsity& sparsity, const std::vector<PatternBlock>& row_blocks,
+                  const std::vector<PatternBlock>& col_blocks)
+      : sp(sparsity), row_blocks(row_blocks), col_blocks(col_blocks),
+        block_nnz(row_blocks.size(), std::vector<int>(col_blocks.size(), 0))
+  {
+    std::vector<int> row_block(sp.size1(), -1);
+    std::vector<int> col_block(sp.size2(), -1);
+    for (unsigned int b=0; b < row_blocks.size(); b++) {
+      for (int i : row_blocks[b].indizes) {
+        row_block[i] = b;
+      }
+    }
+    for (unsigned int b=0; b < col_blocks.size(); b++) {
+      for (int i : col_blocks[b].indizes) {
+        col_block[i] = b;
+      }
+    }
+
+    std::vector< ::casadi::casadi_int > rows, cols;
+    sp.get_triplet(rows, cols);
+    for (unsigned int k=0; k < rows.size(); k++)
+    {
+      int r = row_block[rows[k]];
+      int c = col_block[cols[k]];
+      assertTrue(r >= 0 && c >= 0, "Pattern blocks do not cover the sparsity pattern.");
+      block_nnz[r][c]++;
+    }
+  }
+
+  // Element-wise pattern, rows are [ode; implicit], columns are [x; z; u; p]
+  const ::casadi::Sparsity& sparsity() const { return sp; }
+
+  const std::vector<PatternBlock>& rowBlocks() const { return row_blocks; }
+  const std::vector<PatternBlock>& colBlocks() const { return col_blocks; }
+
+  // Number of structural nonzeros between row block r and column block c
+  int blockNnz(const int r, const int c) const { return block_nnz[r][c]; }
+
+  // e.g. dependsOn("ode.v", "u.F")
+  bool dependsOn(const std::string& row, const std::string& col) const
+  {
+    return block_nnz[find(row_blocks, row)][find(col_blocks, col)] > 0;
+  }
+
+  // Table with one line per equation block and one column per variable,
+  // showing the number of nonzeros of each block ('.' for none).
+  std::string table() const
+  {
+    int w = 1;
+    for (const PatternBlock& b : row_blocks) {
+      w = std::max(w, (int)b.name.size());
+    }
+    std::ostringstream ss;
+    ss << std::setw(w) << "";
+    for (const PatternBlock& b : col_blocks) {
+      ss << "  " << b.name;
+    }
+    ss << "\n";
+    for (unsigned int r=0; r < row_blocks.size(); r++)
+    {
+      ss << std::left << std::setw(w) << row_blocks[r].name << std::right;
+      for (unsigned int c=0; c < col_blocks.size(); c++)
+      {
+        std::string cell = block_nnz[r][c] > 0 ? std::to_string(block_nnz[r][c]) : ".";
+        ss << "  " << std::setw(col_blocks[c].name.size()) << cell;
+      }
+      ss << "\n";
+    }
+    return ss.str();
+  }
+
+private:
+  static int find(const std::vector<PatternBlock>& blocks, const std::string& name)
+  {
+    for (unsigned int i=0; i < blocks.size(); i++) {
+      if (blocks[i].name == name) {
+        return i;
+      }
+    }
+    throw OclException(("No block named " + name).c_str());
+  }
+
+  ::casadi::Sparsity sp;
+  std::vector<PatternBlock> row_blocks;
+  std::vector<PatternBlock> col_blocks;
+  std::vector<std::vector<int> > block_nnz;
+};
+
+} // namespace ocl
+#endif // OCL_SYSTEM_STRUCTURE_H_
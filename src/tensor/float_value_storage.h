@@ -0,0 +1,112 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_FLOAT_VALUE_STORAGE_H_
+#define OCL_FLOAT_VALUE_STORAGE_H_
+
+#include <vector>
+
+#include "utils/typedefs.h"        // single_p, double_p
+#include "utils/assertions.h"      // assertEqual
+#include "tensor/matrix.h"         // Matrix
+#include "tensor/value_storage.h"  // ValueStorage
+
+namespace ocl {
+
+// Stores values in single precision (float32) for trajectories, ensembles
+// and logging where bandwidth matters more than precision.
+//
+// Values are widened to double when read, all reductions accumulate in
+// double. Use ValueStorage for everything that goes into the solver.
+class FloatValueStorage : public Slicable
+{
+public:
+
+  FloatValueStorage(const int size, const single_p val = 0.f)
+      : values(size, val) { }
+
+  FloatValueStorage(const std::vector<double_p>& v)
+      : values(v.begin(), v.end()) { }
+
+  FloatValueStorage(const ValueStorage& vs)
+      : FloatValueStorage(vs.data()) { }
+
+  virtual int size(const int dim) const override {
+    return dim == 0 ? values.size() : 1;
+  }
+
+  int size() const { return values.size(); }
+
+  // Widened copy of the values
+  std::vector<double_p> data() const {
+    return std::vector<double_p>(values.begin(), values.end());
+  }
+
+  // Raw single precision values
+  const single_p* ptr() const { return values.data(); }
+  single_p* ptr() { return values.data(); }
+
+  ValueStorage toValueStorage() const {
+    return ValueStorage(Matrix(data()));
+  }
+
+  std::vector<double_p> subsindex(const std::vector<int>& indizes) const
+  {
+    std::vector<double_p> r(indizes.size());
+    for (unsigned int i=0; i < indizes.size(); i++) {
+      r[i] = values[indizes[i]];
+    }
+    return r;
+  }
+
+  void assign(const std::vector<int>& indizes, const std::vector<double_p>& v)
+  {
+    assertEqual(indizes.size(), v.size(), "Number of indizes and values must be equal.");
+    for (unsigned int i=0; i < indizes.size(); i++) {
+      values[indizes[i]] = (single_p)v[i];
+    }
+  }
+
+  // Narrows a full vector of double values into the storage
+  void assign(const double_p* v)
+  {
+    for (unsigned int i=0; i < values.size(); i++) {
+      values[i] = (single_p)v[i];
+    }
+  }
+
+  // Widens the full storage into a double buffer
+  void widen(double_p* v) const
+  {
+    for (unsigned int i=0; i < values.size(); i++) {
+      v[i] = values[i];
+    }
+  }
+
+  // Sum of the values at indizes, accumulated in double precision
+  double_p sum(const std::vector<int>& indizes) const
+  {
+    double_p s = 0.;
+    for (unsigned int i=0; i < indizes.size(); i++) {
+      s += values[indizes[i]];
+    }
+    return s;
+  }
+
+private:
+  std::vector<single_p> values;
+};
+
+} // namespace ocl
+#endif // OCL_FLOAT_VALUE_STORAGE_H_
@@ -0,0 +1,237 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_REMAP_PLAN_H_
+#define OCL_REMAP_PLAN_H_
+
+#include <algorithm>  // copy, sort
+#include <vector>
+
+#include "utils/assertions.h"      // assertEqual
+#include "tensor/tree.h"           // Tree
+#include "tensor/value_storage.h"  // ValueStorage
+
+namespace ocl {
+
+struct RemapOptions
+{
+  // Destination trajectory element k reads source element k+shift,
+  // e.g. shift=1 for shifting a MPC solution by one stage.
+  int shift = 0;
+
+  // If the trajectories of a variable have a different length in source and
+  // destination (e.g. a changed discretization), resample the source
+  // trajectory linearly instead of matching elements by index.
+  bool interpolate = false;
+
+  // Destination elements past the end of the source trajectory duplicate
+  // the last source element, otherwise they are set to default_value.
+  bool extend_last = true;
+
+  // Value for variables that are missing in the source tree
+  double default_value = 0.;
+};
+
+// Precomputed mapping between the values of two trees.
+//
+// Variables are matched by their id path. The plan is computed once from the
+// tree structures, applying it is a gather over flat value vectors:
+// contiguous pieces are copied as blocks, interpolated entries are weighted
+// sums of two source values and missing entries are filled with a default.
+class RemapPlan
+{
+public:
+
+  RemapPlan(const Tree& source, const Tree& destination,
+            const RemapOptions& options = RemapOptions())
+      : options(options), source_size(source.numel()),
+        destination_size(destination.numel())
+  {
+    std::vector<Entry> copies;
+    build(source, destination, copies);
+    compress(copies);
+  }
+
+  int sourceSize() const { return source_size; }
+  int destinationSize() const { return destination_size; }
+
+  // Number of destination values that are filled with the default value
+  int numFilled() const { return fill_idz.size(); }
+
+  void apply(const double* src, double* dst) const
+  {
+    for (unsigned int i = 0; i < blocks.size(); i++) {
+      const Block& b = blocks[i];
+      std::copy(src + b.src, src + b.src + b.length, dst + b.dst);
+    }
+    for (unsigned int i = 0; i < interp_dst.size(); i++) {
+      dst[interp_dst[i]] = (1.-interp_w[i]) * src[interp_src0[i]] + interp_w[i] * src[interp_src1[i]];
+    }
+    for (unsigned int i = 0; i < fill_idz.size(); i++) {
+      dst[fill_idz[i]] = options.default_value;
+    }
+  }
+
+  void apply(const std::vector<double>& src, std::vector<double>& dst) const
+  {
+    assertEqual(src.size(), source_size, "Size of source values does not match the source tree.");
+    dst.resize(destination_size);
+    apply(src.data(), dst.data());
+  }
+
+  std::vector<double> apply(const std::vector<double>& src) const
+  {
+    std::vector<double> dst(destination_size);
+    apply(src, dst);
+    return dst;
+  }
+
+  ValueStorage apply(const ValueStorage& src) const
+  {
+    return ValueStorage(Matrix(apply(src.data())));
+  }
+
+private:
+
+  struct Entry
+  {
+    int dst;
+    int src;
+    bool operator<(const Entry& other) const { return dst < other.dst; }
+  };
+
+  struct Block
+  {
+    int dst;
+    int src;
+    int length;
+  };
+
+  // Walks the destination tree and matches variables in the source tree
+  void build(const Tree& source, const Tree& destination, std::vector<Entry>& copies)
+  {
+    std::map<std::string, Tree> branches = destination.branches();
+    if (branches.empty()) {
+      buildLeaf(source, destination, copies);
+      return;
+    }
+
+    std::map<std::string, Tree> source_branches = source.branches();
+    for (auto& kv : branches)
+    {
+      Tree dst_child = destination.get(kv.first);
+      if (source_branches.find(kv.first) != source_branches.end()) {
+        build(source.get(kv.first), dst_child, copies);
+      } else {
+        fill(dst_child);
+      }
+    }
+  }
+
+  void buildLeaf(const Tree& source, const Tree& destination, std::vector<Entry>& copies)
+  {
+    const int ns = source.size();
+    const int nd = destination.size();
+    if (!source.branches().empty() || ns == 0 || prod(source.shape()) != prod(destination.shape())) {
+      fill(destination);
+      return;
+    }
+
+    for (int k = 0; k < nd; k++)
+    {
+      std::vector<int> dst_idz = destination.indizes(k);
+
+      if (options.interpolate && ns != nd)
+      {
+        double s = nd > 1 ? (double)k*(ns-1)/(nd-1) : 0.;
+        int j0 = std::min((int)s, ns-1);
+        int j1 = std::min(j0+1, ns-1);
+        double w = s - j0;
+        std::vector<int> src0 = source.indizes(j0);
+        std::vector<int> src1 = source.indizes(j1);
+        for (unsigned int i = 0; i < dst_idz.size(); i++)
+        {
+          if (w == 0.) {
+            copies.push_back({dst_idz[i], src0[i]});
+          } else {
+            interp_dst.push_back(dst_idz[i]);
+            interp_src0.push_back(src0[i]);
+            interp_src1.push_back(src1[i]);
+            interp_w.push_back(w);
+          }
+        }
+        continue;
+      }
+
+      int j = k + options.shift;
+      if (j < 0 || (j >= ns && !options.extend_last)) {
+        fill(dst_idz);
+        continue;
+      }
+      j = std::min(j, ns-1);
+
+      std::vector<int> src_idz = source.indizes(j);
+      for (unsigned int i = 0; i < dst_idz.size(); i++) {
+        copies.push_back({dst_idz[i], src_idz[i]});
+      }
+    }
+  }
+
+  void fill(const Tree& destination)
+  {
+    for (int k = 0; k < destination.size(); k++) {
+      fill(destination.indizes(k));
+    }
+  }
+
+  void fill(const std::vector<int>& idz)
+  {
+    fill_idz.insert(fill_idz.end(), idz.begin(), idz.end());
+  }
+
+  // Merges copy entries into contiguous blocks
+  void compress(std::vector<Entry>& copies)
+  {
+    std::sort(copies.begin(), copies.end());
+    for (unsigned int i = 0; i < copies.size(); i++)
+    {
+      const Entry& e = copies[i];
+      if (!blocks.empty()) {
+        Block& last = blocks.back();
+        if (e.dst == last.dst + last.length && e.src == last.src + last.length) {
+          last.length++;
+          continue;
+        }
+      }
+      blocks.push_back({e.dst, e.src, 1});
+    }
+    std::sort(fill_idz.begin(), fill_idz.end());
+  }
+
+  RemapOptions options;
+  int source_size;
+  int destination_size;
+
+  std::vector<Block> blocks;
+
+  std::vector<int> interp_dst;
+  std::vector<int> interp_src0;
+  std::vector<int> interp_src1;
+  std::vector<double> interp_w;
+
+  std::vector<int> fill_idz;
+};
+
+} // namespace ocl
+#endif // OCL_REMAP_PLAN_H_
@@ -0,0 +1,110 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_SHARED_VALUE_STORAGE_H_
+#define OCL_SHARED_VALUE_STORAGE_H_
+
+#include <algorithm>  // copy
+#include <atomic>
+#include <vector>
+
+#include "utils/assertions.h"      // assertEqual
+#include "tensor/matrix.h"         // Matrix
+#include "tensor/value_storage.h"  // ValueStorage
+
+namespace ocl {
+
+// Passes value data from one writer thread (e.g. the solver) to one reader
+// thread without locks and without copying on the reader side.
+//
+// Three buffers are used (triple buffering): the writer owns the back buffer,
+// the reader owns the front buffer, and the middle buffer holds the most
+// recently published data. Publishing and fetching are a single atomic
+// exchange of the middle buffer, so the reader always sees a complete
+// snapshot and never blocks the writer.
+//
+// Only one writer thread and one reader thread may use an instance.
+class SharedValueStorage
+{
+public:
+
+  SharedValueStorage(const int size, const double val = 0.)
+      : buffers(3, std::vector<double>(size, val)),
+        back(0), front(1), middle(2) { }
+
+  int size() const { return buffers[0].size(); }
+
+  //
+  // Writer side
+
+  // Back buffer to be filled by the writer. It contains the data of an older
+  // publish, so the writer has to overwrite all values before publishing.
+  std::vector<double>& writeBuffer() { return buffers[back]; }
+
+  // Makes the back buffer visible to the reader.
+  void publish()
+  {
+    // release: values written to the back buffer become visible together with the index
+    // acquire: the buffer we get back is no longer read by the reader
+    back = middle.exchange(back | kDirty, std::memory_order_acq_rel) & kIndexMask;
+  }
+
+  // Copies values into the back buffer and publishes them.
+  void publish(const std::vector<double>& values)
+  {
+    assertEqual(values.size(), size(), "Size of published values must match the storage size.");
+    std::copy(values.begin(), values.end(), buffers[back].begin());
+    publish();
+  }
+
+  void publish(const ValueStorage& vs) { publish(vs.data()); }
+
+  //
+  // Reader side
+
+  // Fetches the most recently published data into the front buffer.
+  // Returns false if nothing new was published since the last update.
+  bool update()
+  {
+    if ((middle.load(std::memory_order_relaxed) & kDirty) == 0) {
+      return false;
+    }
+    front = middle.exchange(front, std::memory_order_acq_rel) & kIndexMask;
+    return true;
+  }
+
+  // Front buffer, valid until the next call of update.
+  const std::vector<double>& read() const { return buffers[front]; }
+
+  // Latest published values as ValueStorage, e.g. to be wrapped in a TreeTensor.
+  // Note that this creates casadi objects which are not thread safe; it must
+  // not run concurrently with other casadi operations.
+  ValueStorage snapshot()
+  {
+    update();
+    return ValueStorage(Matrix(read()));
+  }
+
+private:
+  static const int kIndexMask = 3;
+  static const int kDirty = 4;
+
+  std::vector<std::vector<double> > buffers;
+  int back;                 // owned by writer
+  int front;                // owned by reader
+  std::atomic<int> middle;  // index of the shared buffer and dirty flag
+};
+
+} // namespace ocl
+#endif // OCL_SHARED_VALUE_STORAGE_H_
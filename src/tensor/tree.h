@@ -88,12 +88,12 @@ public:
   }
 
   // get indizes of trajectory element i
-  std::vector<int> indizes(int i) {
+  std::vector<int> indizes(int i) const {
     return this->_indizes[i];
   }
 
   // Return indizes vector
-  std::vector<std::vector<int> > indizes() {
+  std::vector<std::vector<int> > indizes() const {
     return this->_indizes;
   }
 
@@ -15,12 +15,27 @@
 #ifndef OCLCPP_OCL_TREEBUILDER_H_
 #define OCLCPP_OCL_TREEBUILDER_H_
 
-#include "utils/assertions.h"   // assertEqual
+#include <algorithm>            // min
+
+#include "utils/assertions.h"   // assertEqual, assertTrue
 #include "utils/functions.h"    // prod, merge
 #include "tensor/tree.h"        // Tree
 
 namespace ocl {
 
+// Memory layout of the variables added by TreeBuilder::addRepeated
+enum class TreeLayout
+{
+  // All variables of stage 0, then all variables of stage 1, ...
+  // Good for evaluating one stage at a time.
+  StageMajor,
+  // Each scalar of a variable is contiguous over all stages.
+  // Good for scans over trajectories and SIMD across stages.
+  VariableMajor,
+  // Stages are grouped in blocks, within a block the layout is variable major.
+  Blocked
+};
+
 class TreeBuilder
 {
 public:
@@ -59,6 +74,52 @@ public:
     }
   }
 
+  // Adds N repetitions of the trees with the given memory layout. The
+  // resulting tree is accessed the same way for all layouts, only the
+  // indizes differ.
+  void addRepeated(const std::vector<std::string>& ids, const std::vector<Tree>& trees, const int N,
+                   const TreeLayout layout, const int block_size = 4)
+  {
+    if (layout == TreeLayout::StageMajor) {
+      addRepeatedBlocked(ids, trees, N, 1);
+    } else if (layout == TreeLayout::VariableMajor) {
+      addRepeatedBlocked(ids, trees, N, N);
+    } else {
+      addRepeatedBlocked(ids, trees, N, block_size);
+    }
+  }
+
+  // Adds N repetitions in blocks of block_size stages. Within a block, scalar e
+  // of stage k (relative to the block) is stored at e*block_size+k.
+  // block_size=1 is the stage major layout, block_size=N the variable major.
+  void addRepeatedBlocked(const std::vector<std::string>& ids, const std::vector<Tree>& trees,
+                          const int N, const int block_size)
+  {
+    assertEqual(ids.size(), trees.size(), "Number of ids must correspond to the number of trees to add.");
+    assertTrue(block_size > 0, "Block size must be positive.");
+
+    for (int k0 = 0; k0 < N; k0 += block_size)
+    {
+      int nb = std::min(block_size, N-k0);
+      for (unsigned int j = 0; j < ids.size(); j++)
+      {
+        const Tree& tree = trees[j];
+        int n = tree.size()*prod(tree.shape());
+        int base = _len;
+        _len += n*nb;
+
+        for (int k = 0; k < nb; k++)
+        {
+          std::vector<int> idz(n);
+          for (int e = 0; e < n; e++) {
+            idz[e] = base + e*nb + k;
+          }
+          addTree(ids[j], Tree(tree._branches, tree.shape(), {idz}));
+        }
+      }
+    }
+  }
+
   void addTree(const std::string& id, const Tree& tree)
   {
     auto it =  _tree._branches.find(id);
@@ -18,6 +18,8 @@
 #include "utils/typedefs.h"
 #include "utils/assertions.h"      // assertTrue
 #include "utils/slicing.h"         // Slicable
+#include "tensor/tree.h"           // Tree
+#include "tensor/tensor.h"         // Tensor
 #include "tensor/value_storage.h"  // ValueStorage, assign, subsindex
 
 // This file implements class TreeTensor and static functions on TreeTensor
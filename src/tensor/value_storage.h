@@ -15,6 +15,9 @@
 #ifndef OCL_VALUE_STORAGE_H_
 #define OCL_VALUE_STORAGE_H_
 
+#include "utils/slicing.h"   // Slicable
+#include "tensor/matrix.h"   // Matrix
+
 namespace ocl {
 
 // Stores matrix data in column major format
@@ -0,0 +1,287 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_THREAD_POOL_H_
+#define OCL_THREAD_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>  // pair
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>  // pthread_setaffinity_np
+#endif
+
+#include "utils/assertions.h"  // assertTrue
+#include "function_interface.h"
+
+namespace ocl {
+
+// Fixed set of worker threads for evaluating functions across stages.
+//
+// parallelFor hands out indices to the workers and passes the worker id to
+// the callback, so that callers can keep one workspace per worker.
+// The pool is meant to be created once and reused for all evaluations, it
+// can be shared: calls from several threads are serialized and nested calls
+// from inside a callback run on the calling worker.
+class ThreadPool
+{
+public:
+
+  // Starts n_workers threads (hardware concurrency if n_workers <= 0).
+  // With pin, worker i is bound to core i (Linux only). If pinning fails the
+  // workers are stopped and the error is thrown.
+  ThreadPool(const int n_workers = 0, const bool pin = false)
+      : task(nullptr), generation(0), n_tasks(0), next_task(0), n_busy(0), stop(false)
+  {
+    int n = n_workers > 0 ? n_workers : (int)std::thread::hardware_concurrency();
+    n = n > 0 ? n : 1;
+    for (int i = 0; i < n; i++) {
+      workers.push_back(std::thread(&ThreadPool::work, this, i));
+    }
+    if (pin)
+    {
+      try {
+        for (int i = 0; i < n; i++) {
+          pinWorker(i);
+        }
+      } catch (...) {
+        shutdown();
+        throw;
+      }
+    }
+  }
+
+  ~ThreadPool()
+  {
+    shutdown();
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  int size() const { return workers.size(); }
+
+  // Calls fcn(index, worker) for all index in [0,n) and blocks until all
+  // calls returned. The first exception thrown by fcn is rethrown here.
+  void parallelFor(const int n, const std::function<void(int, int)>& fcn)
+  {
+    if (n <= 0) {
+      return;
+    }
+
+    // nested call from a worker of this pool, the other workers may be busy
+    // with the outer call, so the loop runs on this worker
+    const std::pair<const ThreadPool*, int>& current = currentWorker();
+    if (current.first == this)
+    {
+      runInline(n, fcn, current.second);
+      return;
+    }
+
+    std::lock_guard<std::mutex> call_lock(call_mutex);
+    std::unique_lock<std::mutex> lock(mutex);
+    task = &fcn;
+    n_tasks = n;
+    next_task.store(0);
+    n_busy = workers.size();
+    error = nullptr;
+    generation++;
+    start_cv.notify_all();
+    done_cv.wait(lock, [this]() { return n_busy == 0; });
+    task = nullptr;
+
+    if (error) {
+      std::rethrow_exception(error);
+    }
+  }
+
+private:
+
+  // Pool and worker id of the calling thread, null if it is no worker
+  static std::pair<const ThreadPool*, int>& currentWorker()
+  {
+    static thread_local std::pair<const ThreadPool*, int> current(nullptr, -1);
+    return current;
+  }
+
+  static void runInline(const int n, const std::function<void(int, int)>& fcn, const int worker)
+  {
+    std::exception_ptr first;
+    for (int i = 0; i < n; i++)
+    {
+      try {
+        fcn(i, worker);
+      } catch (...) {
+        if (!first) {
+          first = std::current_exception();
+        }
+      }
+    }
+    if (first) {
+      std::rethrow_exception(first);
+    }
+  }
+
+  void work(const int worker)
+  {
+    currentWorker() = std::make_pair(this, worker);
+    unsigned long seen = 0;
+    while (true)
+    {
+      const std::function<void(int, int)>* fcn;
+      int n;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        start_cv.wait(lock, [this, seen]() { return stop || generation != seen; });
+        if (stop) {
+          return;
+        }
+        seen = generation;
+        fcn = task;
+        n = n_tasks;
+      }
+
+      for (int i = next_task.fetch_add(1); i < n; i = next_task.fetch_add(1))
+      {
+        try {
+          (*fcn)(i, worker);
+        } catch (...) {
+          std::lock_guard<std::mutex> lock(mutex);
+          if (!error) {
+            error = std::current_exception();
+          }
+        }
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        n_busy--;
+        if (n_busy == 0) {
+          done_cv.notify_one();
+        }
+      }
+    }
+  }
+
+  // Stops and joins all workers
+  void shutdown()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    start_cv.notify_all();
+    for (auto& w : workers) {
+      w.join();
+    }
+  }
+
+  void pinWorker(const int worker)
+  {
+#ifdef __linux__
+    int n_cores = std::thread::hardware_concurrency();
+    cpu_set_t cpuset;
+    CPU_ZERO(&cpuset);
+    CPU_SET(n_cores > 0 ? worker % n_cores : 0, &cpuset);
+    int rc = pthread_setaffinity_np(workers[worker].native_handle(), sizeof(cpu_set_t), &cpuset);
+    assertTrue(rc == 0, "Could not pin worker thread to core.");
+#else
+    (void)worker;
+#endif
+  }
+
+  std::vector<std::thread> workers;
+
+  std::mutex call_mutex;  // one parallelFor at a time
+  std::mutex mutex;
+  std::condition_variable start_cv;
+  std::condition_variable done_cv;
+
+  const std::function<void(int, int)>* task;
+  unsigned long generation;
+  int n_tasks;
+  std::atomic<int> next_task;
+  int n_busy;
+  bool stop;
+  std::exception_ptr error;
+};
+
+// Evaluates a compiled function at many points (e.g. stages) in parallel
+// with one FunctionWorkspace per worker of the pool.
+class ParallelFunction
+{
+public:
+
+  ParallelFunction(const ::casadi::Function& fcn, ThreadPool& pool)
+      : fcn(fcn), pool(pool)
+  {
+    for (int i = 0; i < fcn.n_in(); i++) {
+      nnz_in.push_back(fcn.nnz_in(i));
+    }
+    for (int i = 0; i < fcn.n_out(); i++) {
+      nnz_out.push_back(fcn.nnz_out(i));
+    }
+    for (int i = 0; i < pool.size(); i++) {
+      workspaces.push_back(FunctionWorkspace(fcn));
+      args.push_back(std::vector<const double*>(fcn.n_in()));
+      results.push_back(std::vector<double*>(fcn.n_out()));
+    }
+  }
+
+  // Evaluates the function at N points. inputs and outputs hold one pointer
+  // per function input/output to N stacked (column major) dense blocks.
+  // Inputs flagged in shared are the same for all points (e.g. parameters).
+  void evaluate(const int N, const std::vector<const double*>& inputs,
+                const std::vector<double*>& outputs, const std::vector<bool>& shared = {})
+  {
+    const int n_in = nnz_in.size();
+    const int n_out = nnz_out.size();
+    assertTrue((int)inputs.size() == n_in && (int)outputs.size() == n_out,
+               "Number of inputs or outputs does not match the function.");
+
+    pool.parallelFor(N, [&](int k, int worker)
+    {
+      std::vector<const double*>& arg = args[worker];
+      std::vector<double*>& res = results[worker];
+      for (int i = 0; i < n_in; i++) {
+        bool is_shared = i < (int)shared.size() && shared[i];
+        arg[i] = (inputs[i] && !is_shared) ? inputs[i] + k*nnz_in[i] : inputs[i];
+      }
+      for (int i = 0; i < n_out; i++) {
+        res[i] = outputs[i] ? outputs[i] + k*nnz_out[i] : nullptr;
+      }
+      workspaces[worker].evaluate(arg.data(), res.data());
+    });
+  }
+
+private:
+  ::casadi::Function fcn;
+  ThreadPool& pool;
+  std::vector<int> nnz_in;
+  std::vector<int> nnz_out;
+  std::vector<FunctionWorkspace> workspaces;
+
+  // pointer arrays per worker
+  std::vector<std::vector<const double*> > args;
+  std::vector<std::vector<double*> > results;
+};
+
+} // namespace ocl
+#endif // OCL_THREAD_POOL_H_
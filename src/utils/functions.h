@@ -15,6 +15,8 @@
 #ifndef OCL_UTILS_FUNCTIONS_H_
 #define OCL_UTILS_FUNCTIONS_H_
 
+#include <vector>
+
 namespace ocl {
 
 // End is included (closed interval)
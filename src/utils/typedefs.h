@@ -30,6 +30,7 @@ typedef unsigned int uint;
 // program specific types
 typedef double_t float_p;
 typedef double_t double_p;
+typedef float single_p;  // reduced precision storage, see FloatValueStorage
 typedef int64_t int_p;
 typedef uint64_t uint_p;
 
@@ -0,0 +1,70 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#ifndef OCL_TEST_BENCHMARK_H_
+#define OCL_TEST_BENCHMARK_H_
+
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+// Helpers for the benchmark programs (make benchmark)
+namespace ocl
+{
+namespace bench
+{
+
+// Best wall time in seconds of repetitions calls of fcn
+static inline double seconds(const std::function<void()>& fcn, const int repetitions = 5)
+{
+  double best = 1e100;
+  for (int i = 0; i < repetitions; i++)
+  {
+    auto start = std::chrono::steady_clock::now();
+    fcn();
+    auto stop = std::chrono::steady_clock::now();
+    double t = std::chrono::duration<double>(stop - start).count();
+    best = t < best ? t : best;
+  }
+  return best;
+}
+
+static inline void header(const std::string& title)
+{
+  std::cout << std::endl << title << std::endl
+            << std::string(title.size(), '-') << std::endl;
+}
+
+static inline void report(const std::string& name, const double t_seconds)
+{
+  std::cout << std::left << std::setw(40) << name << std::right
+            << std::setw(12) << std::setprecision(4) << t_seconds*1e3 << " ms" << std::endl;
+}
+
+static inline void report(const std::string& name, const double t_seconds, const double t_reference)
+{
+  std::cout << std::left << std::setw(40) << name << std::right
+            << std::setw(12) << std::setprecision(4) << t_seconds*1e3 << " ms"
+            << std::setw(10) << std::setprecision(3) << t_reference/t_seconds << "x" << std::endl;
+}
+
+// Prevents the compiler from optimizing away a result
+static volatile double sink;
+static inline void keep(const double v) { sink = v; }
+
+} // namespace bench
+} // namespace ocl
+#endif // OCL_TEST_BENCHMARK_H_
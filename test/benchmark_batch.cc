@@ -0,0 +1,80 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <iostream>
+#include "benchmark.h"
+#include "system.h"
+
+// Compares N single System::evaluate calls with one batch evaluation of N
+// points (casadi map, serial and thread parallelization) to find the
+// crossover point.
+
+// Chain of 10 masses with nonlinear springs, 20 states
+void varsChain(ocl::SVH& sh)
+{
+  sh.state("q", {10,1});
+  sh.state("v", {10,1});
+  sh.control("F", {1,1});
+  sh.parameter("k", {1,1});
+}
+
+void eqChain(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor q = x.get("q");
+  ocl::Tensor v = x.get("v");
+  ocl::Tensor k = p.get("k");
+  ocl::Tensor d = 0.1;
+
+  ocl::Tensor spring = k*ocl::sin(q) + ocl::ctimes(q, ocl::square(q));
+  eh.differentialEquation("q", v);
+  eh.differentialEquation("v", -spring - d*v + u.get("F"));
+  (void) z;
+}
+
+int main()
+{
+  ocl::System sys(&varsChain, &eqChain);
+  const int nx = sys.nx();
+  const int max_N = 1024;
+
+  std::vector<double> x(nx*max_N, 0.3);
+  std::vector<double> u(max_N, 1.0);
+  std::vector<double> p(max_N, 2.0);
+  std::vector<double> diff(nx*max_N);
+
+  ocl::FunctionWorkspace ws = sys.workspace();
+
+  for (int N = 1; N <= max_N; N *= 4)
+  {
+    ocl::bench::header("N = " + std::to_string(N));
+
+    double t_single = ocl::bench::seconds([&]() {
+      for (int i = 0; i < N; i++) {
+        sys.evaluate(&x[i*nx], nullptr, &u[i], &p[i], &diff[i*nx], nullptr, ws);
+      }
+    });
+    ocl::bench::report("N single calls", t_single, t_single);
+
+    const std::vector<std::string> modes = {"serial", "thread"};
+    for (const std::string& mode : modes)
+    {
+      ocl::FunctionWorkspace batch_ws = sys.batchWorkspace(N, mode);
+      double t_batch = ocl::bench::seconds([&]() {
+        sys.evaluate(x.data(), nullptr, u.data(), p.data(), diff.data(), nullptr, batch_ws);
+      });
+      ocl::bench::report("batch (" + mode + ")", t_batch, t_single);
+    }
+  }
+  return 0;
+}
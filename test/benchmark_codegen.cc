@@ -0,0 +1,82 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <iostream>
+#include "benchmark.h"
+#include "system.h"
+
+// Compares the evaluation of the system with the casadi virtual machine
+// (interpreted expression graph) and with generated and compiled C code.
+// The first run compiles the code, later runs load it from the cache.
+
+// Chain of 10 masses with nonlinear springs, 20 states
+void varsChain(ocl::SVH& sh)
+{
+  sh.state("q", {10,1});
+  sh.state("v", {10,1});
+  sh.control("F", {1,1});
+  sh.parameter("k", {1,1});
+}
+
+void eqChain(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor q = x.get("q");
+  ocl::Tensor v = x.get("v");
+  ocl::Tensor k = p.get("k");
+  ocl::Tensor d = 0.1;
+
+  ocl::Tensor spring = k*ocl::sin(q) + ocl::ctimes(q, ocl::square(q));
+  eh.differentialEquation("q", v);
+  eh.differentialEquation("v", -spring - d*v + u.get("F"));
+  (void) z;
+}
+
+int main()
+{
+  const int n_calls = 100000;
+
+  ocl::System interpreted(&varsChain, &eqChain);
+  ocl::System generated(&varsChain, &eqChain);
+
+  double t_generate = ocl::bench::seconds([&]() { generated.generateCode(); });
+
+  const int nx = interpreted.nx();
+  std::vector<double> x(nx, 0.3);
+  std::vector<double> u(1, 1.0);
+  std::vector<double> p(1, 2.0);
+  std::vector<double> diff(nx);
+
+  ocl::bench::header(std::to_string(n_calls) + " evaluations");
+
+  ocl::FunctionWorkspace ws_interpreted = interpreted.workspace();
+  double t_interpreted = ocl::bench::seconds([&]() {
+    for (int i = 0; i < n_calls; i++) {
+      interpreted.evaluate(x.data(), nullptr, u.data(), p.data(), diff.data(), nullptr, ws_interpreted);
+    }
+  });
+  ocl::bench::keep(diff[0]);
+  ocl::bench::report("interpreted", t_interpreted, t_interpreted);
+
+  ocl::FunctionWorkspace ws_generated = generated.workspace();
+  double t_generated = ocl::bench::seconds([&]() {
+    for (int i = 0; i < n_calls; i++) {
+      generated.evaluate(x.data(), nullptr, u.data(), p.data(), diff.data(), nullptr, ws_generated);
+    }
+  });
+  ocl::bench::keep(diff[0]);
+  ocl::bench::report("generated", t_generated, t_interpreted);
+
+  std::cout << "code generation and loading: " << t_generate << " s" << std::endl;
+  return 0;
+}
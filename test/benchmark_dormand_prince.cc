@@ -0,0 +1,112 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <cmath>
+#include <iostream>
+#include "benchmark.h"
+#include "system.h"
+#include "integrator/explicit_rk.h"
+#include "integrator/dormand_prince.h"
+
+// Compares adaptive Dormand-Prince 5(4) with fixed step RK4 at equal
+// accuracy of the final state over a long horizon. The number of RK4 steps
+// is doubled until its error is below the error of Dormand-Prince.
+
+// Chain of 10 masses with nonlinear springs, 20 states
+void varsChain(ocl::SVH& sh)
+{
+  sh.state("q", {10,1});
+  sh.state("v", {10,1});
+  sh.control("F", {1,1});
+  sh.parameter("k", {1,1});
+}
+
+void eqChain(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor q = x.get("q");
+  ocl::Tensor v = x.get("v");
+  ocl::Tensor k = p.get("k");
+  ocl::Tensor d = 0.1;
+
+  ocl::Tensor spring = k*ocl::sin(q) + ocl::ctimes(q, ocl::square(q));
+  eh.differentialEquation("q", v);
+  eh.differentialEquation("v", -spring - d*v + u.get("F"));
+  (void) z;
+}
+
+static double maxError(const std::vector<double>& a, const double* b)
+{
+  double err = 0;
+  for (unsigned int i = 0; i < a.size(); i++) {
+    err = std::max(err, std::fabs(a[i] - b[i]));
+  }
+  return err;
+}
+
+int main()
+{
+  ocl::System sys(&varsChain, &eqChain);
+  const int nx = sys.nx();
+  const double T = 20.;
+
+  std::vector<double> x0(nx, 0.5);
+  std::vector<double> u = {0.2};
+  std::vector<double> p = {2.0};
+  std::vector<double> times = {0., T};
+  std::vector<double> out(2*nx);
+
+  // reference solution
+  ocl::DormandPrinceOptions ref_opts;
+  ref_opts.rel_tol = 1e-13;
+  ref_opts.abs_tol = 1e-13;
+  ocl::DormandPrince reference(sys, ref_opts);
+  reference.simulate(x0.data(), u.data(), p.data(), times.data(), 2, out.data());
+  std::vector<double> x_ref(out.begin() + nx, out.end());
+
+  const std::vector<double> tolerances = {1e-4, 1e-6, 1e-8};
+  for (double tol : tolerances)
+  {
+    ocl::bench::header("tolerance " + std::to_string(tol));
+
+    ocl::DormandPrinceOptions opts;
+    opts.rel_tol = tol;
+    opts.abs_tol = tol;
+    ocl::DormandPrince dp(sys, opts);
+    double t_dp = ocl::bench::seconds([&]() {
+      dp.simulate(x0.data(), u.data(), p.data(), times.data(), 2, out.data());
+    });
+    double err_dp = maxError(x_ref, &out[nx]);
+    int evals_dp = dp.numEvaluations();
+    ocl::bench::report("dormand-prince", t_dp, t_dp);
+    std::cout << "  error " << err_dp << ", evaluations " << evals_dp << std::endl;
+
+    ocl::ExplicitRungeKutta rk4(sys, ocl::ButcherTableau::RK4());
+    std::vector<double> xf(nx);
+    int n_steps = 8;
+    double err_rk4;
+    do {
+      n_steps *= 2;
+      rk4.integrate(x0.data(), u.data(), p.data(), T/n_steps, n_steps, xf.data());
+      err_rk4 = maxError(x_ref, xf.data());
+    } while (err_rk4 > err_dp && n_steps < (1 << 22));
+
+    double t_rk4 = ocl::bench::seconds([&]() {
+      rk4.integrate(x0.data(), u.data(), p.data(), T/n_steps, n_steps, xf.data());
+    });
+    ocl::bench::keep(xf[0]);
+    ocl::bench::report("rk4 (equal accuracy)", t_rk4, t_dp);
+    std::cout << "  error " << err_rk4 << ", evaluations " << 4*n_steps << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <iostream>
+#include <vector>
+#include "benchmark.h"
+#include "system.h"
+#include "integrator/ensemble.h"
+
+// Throughput of ensemble integration for a Monte-Carlo sweep over
+// perturbed initial states and parameters, one trajectory at a time versus
+// chunks of several lanes per batched system evaluation.
+
+// Pendulum on a cart
+void varsCartPole(ocl::SVH& sh)
+{
+  sh.state("p");
+  sh.state("theta");
+  sh.state("v");
+  sh.state("omega");
+  sh.control("F");
+  sh.parameter("l");
+}
+
+void eqCartPole(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor theta = x.get("theta");
+  ocl::Tensor omega = x.get("omega");
+  ocl::Tensor l = p.get("l");
+  ocl::Tensor F = u.get("F");
+  ocl::Tensor g = 9.81;
+  ocl::Tensor two = 2.;
+
+  ocl::Tensor s = ocl::sin(theta);
+  ocl::Tensor c = ocl::cos(theta);
+  ocl::Tensor denom = two - ocl::square(c);
+  ocl::Tensor a = (F + l*ocl::square(omega)*s - g*s*c) / denom;
+
+  eh.differentialEquation("p", x.get("v"));
+  eh.differentialEquation("theta", omega);
+  eh.differentialEquation("v", a);
+  eh.differentialEquation("omega", (g*s - a*c) / l);
+  (void) z;
+}
+
+int main()
+{
+  ocl::System sys(&varsCartPole, &eqCartPole);
+  const int K = 4096;
+  const int n_steps = 200;
+  const double h = 0.01;
+
+  std::vector<double> x0, u, p;
+  for (int k = 0; k < K; k++)
+  {
+    double r = (double)k/K;
+    x0.insert(x0.end(), {0., 0.1 + 0.5*r, 0., 0.});
+    u.push_back(0.);
+    p.push_back(0.8 + 0.4*r);
+  }
+  std::vector<double> out(sys.nx()*(n_steps/10+1)*K);
+
+  ocl::bench::header("ensemble of " + std::to_string(K) + " trajectories");
+  double t_ref = 0;
+  for (int lanes : {1, 8, 32, 128})
+  {
+    ocl::Ensemble ensemble(sys, ocl::ButcherTableau::RK4(), lanes);
+    double t = ocl::bench::seconds([&]() {
+      ensemble.simulate(x0.data(), u.data(), p.data(), K, h, n_steps, 10, out.data());
+    });
+    if (lanes == 1) {
+      t_ref = t;
+    }
+    ocl::bench::keep(out[0]);
+    ocl::bench::report(std::to_string(lanes) + " lanes", t, t_ref);
+    std::cout << "  " << K*n_steps/t << " steps/s" << std::endl;
+  }
+  return 0;
+}
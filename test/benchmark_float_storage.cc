@@ -0,0 +1,187 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <algorithm>  // copy, max
+#include <cmath>
+#include <iostream>
+#include "benchmark.h"
+#include "system.h"
+#include "tensor/float_value_storage.h"
+
+// Compares double storage with single precision storage (FloatValueStorage)
+// for trajectory data and reports speed and error. The system is always
+// evaluated in double, float storage only saves memory and bandwidth.
+
+void varsParticle(ocl::SVH& sh)
+{
+  sh.state("p");
+  sh.state("v");
+  sh.control("F");
+}
+
+void eqParticle(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor g = 9.8;
+  eh.differentialEquation("p", x.get("v"));
+  eh.differentialEquation("v", -g + u.get("F"));
+  (void) z;
+  (void) p;
+}
+
+void varsPendulum(ocl::SVH& sh)
+{
+  sh.state("phi");
+  sh.state("omega");
+  sh.control("F");
+}
+
+void eqPendulum(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor g = 9.8;
+  ocl::Tensor d = 0.1;
+  ocl::Tensor phi = x.get("phi");
+  ocl::Tensor omega = x.get("omega");
+  eh.differentialEquation("phi", omega);
+  eh.differentialEquation("omega", -g*ocl::sin(phi) - d*omega + u.get("F"));
+  (void) z;
+  (void) p;
+}
+
+// Explicit Euler simulation, states are kept in double or in float between
+// steps. The system is evaluated in double in both cases, the float states
+// are widened into a reused buffer.
+static double simulationError(ocl::System& sys, const std::vector<double>& x0, const int steps)
+{
+  const double h = 0.01;
+  const int nx = x0.size();
+  const double u = 0.5;
+  ocl::FunctionWorkspace ws = sys.workspace();
+
+  std::vector<double> x_d = x0;
+  ocl::FloatValueStorage x_f(x0);
+  std::vector<double> x_buf(nx), dx(nx);
+
+  double max_error = 0;
+  for (int k = 0; k < steps; k++)
+  {
+    sys.evaluate(x_d.data(), nullptr, &u, nullptr, dx.data(), nullptr, ws);
+    for (int i = 0; i < nx; i++) {
+      x_d[i] += h*dx[i];
+    }
+
+    std::copy(x_f.ptr(), x_f.ptr() + nx, x_buf.begin());
+    sys.evaluate(x_buf.data(), nullptr, &u, nullptr, dx.data(), nullptr, ws);
+    for (int i = 0; i < nx; i++) {
+      x_f.ptr()[i] = (ocl::single_p)(x_buf[i] + h*dx[i]);
+      max_error = std::max(max_error, std::abs((double)x_f.ptr()[i] - x_d[i]));
+    }
+  }
+  return max_error;
+}
+
+// Evaluates the system at all points of a trajectory stored in double and
+// in float, the evaluation itself is in double
+static void evaluationTiming(ocl::System& sys, const int n_points)
+{
+  const int nx = 2;
+  const double u = 0.5;
+  ocl::FunctionWorkspace ws = sys.workspace();
+
+  std::vector<double> states_d(nx*n_points);
+  for (int i = 0; i < nx*n_points; i++) {
+    states_d[i] = std::sin(1e-3*i);
+  }
+  ocl::FloatValueStorage states_f(states_d);
+  std::vector<double> out_d(nx*n_points);
+  ocl::FloatValueStorage out_f(nx*n_points);
+  std::vector<double> x_buf(nx), dx(nx);
+
+  double t_d = ocl::bench::seconds([&]() {
+    for (int k = 0; k < n_points; k++) {
+      sys.evaluate(&states_d[nx*k], nullptr, &u, nullptr, &out_d[nx*k], nullptr, ws);
+    }
+    ocl::bench::keep(out_d[0]);
+  });
+  double t_f = ocl::bench::seconds([&]() {
+    for (int k = 0; k < n_points; k++)
+    {
+      std::copy(states_f.ptr() + nx*k, states_f.ptr() + nx*(k+1), x_buf.begin());
+      sys.evaluate(x_buf.data(), nullptr, &u, nullptr, dx.data(), nullptr, ws);
+      std::copy(dx.begin(), dx.end(), out_f.ptr() + nx*k);
+    }
+    ocl::bench::keep(out_f.ptr()[0]);
+  });
+  ocl::bench::report("evaluate from double storage", t_d, t_d);
+  ocl::bench::report("evaluate from float storage", t_f, t_d);
+}
+
+int main()
+{
+  // trajectory ensemble: K trajectories, N time points, nx states
+  const int K = 256;
+  const int N = 1000;
+  const int nx = 12;
+  const int n = K*N*nx;
+
+  std::vector<double> source(n);
+  for (int i = 0; i < n; i++) {
+    source[i] = std::sin(1e-3*i);
+  }
+
+  std::vector<double> storage_d(n);
+  ocl::FloatValueStorage storage_f(n);
+
+  ocl::bench::header("Trajectory storage, " + std::to_string(n) + " values");
+
+  double t_write_d = ocl::bench::seconds([&]() {
+    std::copy(source.begin(), source.end(), storage_d.begin());
+  });
+  double t_write_f = ocl::bench::seconds([&]() {
+    storage_f.assign(source.data());
+  });
+  ocl::bench::report("write double", t_write_d, t_write_d);
+  ocl::bench::report("write float", t_write_f, t_write_d);
+
+  double t_sum_d = ocl::bench::seconds([&]() {
+    double s = 0;
+    for (int i = 0; i < n; i++) { s += storage_d[i]; }
+    ocl::bench::keep(s);
+  });
+  double t_sum_f = ocl::bench::seconds([&]() {
+    const ocl::single_p* v = storage_f.ptr();
+    double s = 0;
+    for (int i = 0; i < n; i++) { s += v[i]; }
+    ocl::bench::keep(s);
+  });
+  ocl::bench::report("reduce double", t_sum_d, t_sum_d);
+  ocl::bench::report("reduce float (double accumulation)", t_sum_f, t_sum_d);
+
+  double max_error = 0;
+  std::vector<double> widened = storage_f.data();
+  for (int i = 0; i < n; i++) {
+    max_error = std::max(max_error, std::abs(widened[i] - source[i]));
+  }
+  std::cout << "max storage error " << max_error << std::endl;
+
+  ocl::bench::header("Simulation error, float storage vs double, 500 Euler steps");
+  ocl::System particle(&varsParticle, &eqParticle);
+  ocl::System pendulum(&varsPendulum, &eqPendulum);
+  std::cout << "particle  max error " << simulationError(particle, {0.0, 1.0}, 500) << std::endl;
+  std::cout << "pendulum  max error " << simulationError(pendulum, {1.0, 0.0}, 500) << std::endl;
+
+  ocl::bench::header("System evaluation at 100000 points");
+  evaluationTiming(pendulum, 100000);
+
+  return 0;
+}
@@ -0,0 +1,160 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <iostream>
+#include "benchmark.h"
+#include "tensor/tree_builder.h"
+
+// Compares the memory layouts of TreeBuilder::addRepeated for three typical
+// workloads on the NLP variables of an optimal control problem:
+//  - stage evaluation: gather the variables of each stage, evaluate, scatter
+//  - cost reduction: sum of squares of one variable over all stages
+//  - KKT assembly: accumulate stage Hessian-vector blocks into the KKT vector
+
+struct Workload
+{
+  std::vector<int> stage_idz;  // x_k and u_k for all stages, stage by stage
+  std::vector<int> p_idz;      // x_k.p for all stages
+  int nxu;
+  int N;
+  int numel;
+};
+
+static Workload setup(const ocl::TreeLayout layout, const int N, const int block_size = 4)
+{
+  ocl::TreeBuilder tb_x;
+  tb_x.add("p", {3,1});
+  tb_x.add("R", {3,3});
+  tb_x.add("v", {3,1});
+  tb_x.add("w", {3,1});
+
+  ocl::TreeBuilder tb_u;
+  tb_u.add("u", {4,1});
+
+  ocl::TreeBuilder tb;
+  tb.addRepeated({"x","u"}, {tb_x.tree(), tb_u.tree()}, N, layout, block_size);
+  ocl::Tree t = tb.tree();
+
+  Workload w;
+  w.N = N;
+  w.numel = t.numel();
+  ocl::Tree x = t.get("x");
+  ocl::Tree u = t.get("u");
+  ocl::Tree p = x.get("p");
+  for (int k = 0; k < N; k++)
+  {
+    std::vector<int> xk = x.indizes(k);
+    std::vector<int> uk = u.indizes(k);
+    w.stage_idz.insert(w.stage_idz.end(), xk.begin(), xk.end());
+    w.stage_idz.insert(w.stage_idz.end(), uk.begin(), uk.end());
+  }
+  for (int e = 0; e < 3; e++) {
+    for (int k = 0; k < N; k++) {
+      w.p_idz.push_back(p.indizes(k)[e]);
+    }
+  }
+  w.nxu = w.stage_idz.size() / N;
+  return w;
+}
+
+static void stageEvaluation(const Workload& w, const std::vector<double>& v, std::vector<double>& out)
+{
+  std::vector<double> buffer(w.nxu);
+  const int* idz = w.stage_idz.data();
+  for (int k = 0; k < w.N; k++)
+  {
+    for (int i = 0; i < w.nxu; i++) {
+      buffer[i] = v[idz[k*w.nxu + i]];
+    }
+    // stand-in for a stage function
+    for (int i = 0; i < w.nxu; i++) {
+      buffer[i] = buffer[i]*buffer[(i+1)%w.nxu] + 0.5*buffer[i];
+    }
+    for (int i = 0; i < w.nxu; i++) {
+      out[idz[k*w.nxu + i]] = buffer[i];
+    }
+  }
+}
+
+static double costReduction(const Workload& w, const std::vector<double>& v)
+{
+  double s = 0;
+  for (unsigned int i = 0; i < w.p_idz.size(); i++) {
+    double a = v[w.p_idz[i]];
+    s += a*a;
+  }
+  return s;
+}
+
+static void kktAssembly(const Workload& w, const std::vector<double>& v, std::vector<double>& kkt)
+{
+  // kkt += blockdiag(H_k) * v with dense stage blocks H_k = 0.1 + I
+  const int n = w.nxu;
+  const int* idz = w.stage_idz.data();
+  for (int k = 0; k < w.N; k++)
+  {
+    const int* sk = idz + k*n;
+    double s = 0;
+    for (int j = 0; j < n; j++) {
+      s += v[sk[j]];
+    }
+    for (int i = 0; i < n; i++) {
+      kkt[sk[i]] += 0.1*s + v[sk[i]];
+    }
+  }
+}
+
+int main()
+{
+  const std::vector<int> horizons = {20, 200, 2000};
+  const std::vector<std::string> names = {"stage major", "variable major", "blocked (4)", "blocked (16)"};
+  const std::vector<ocl::TreeLayout> layouts = {ocl::TreeLayout::StageMajor, ocl::TreeLayout::VariableMajor,
+                                                ocl::TreeLayout::Blocked, ocl::TreeLayout::Blocked};
+  const std::vector<int> block_sizes = {1, 1, 4, 16};
+  const int repeat = 200;
+
+  for (int N : horizons)
+  {
+    std::vector<double> t_ref(3);
+    for (unsigned int l = 0; l < layouts.size(); l++)
+    {
+      Workload w = setup(layouts[l], N, block_sizes[l]);
+      std::vector<double> v(w.numel, 1.0001);
+      std::vector<double> out(w.numel);
+
+      double t_stage = ocl::bench::seconds([&]() {
+        for (int r = 0; r < repeat; r++) { stageEvaluation(w, v, out); }
+        ocl::bench::keep(out[0]);
+      });
+      double t_cost = ocl::bench::seconds([&]() {
+        double s = 0;
+        for (int r = 0; r < repeat; r++) { s += costReduction(w, v); }
+        ocl::bench::keep(s);
+      });
+      double t_kkt = ocl::bench::seconds([&]() {
+        for (int r = 0; r < repeat; r++) { kktAssembly(w, v, out); }
+        ocl::bench::keep(out[0]);
+      });
+
+      if (l == 0) {
+        t_ref = {t_stage, t_cost, t_kkt};
+      }
+      ocl::bench::header(names[l] + ", N=" + std::to_string(N) + ", " + std::to_string(repeat) + " repetitions");
+      ocl::bench::report("stage evaluation", t_stage, t_ref[0]);
+      ocl::bench::report("cost reduction", t_cost, t_ref[1]);
+      ocl::bench::report("KKT assembly", t_kkt, t_ref[2]);
+    }
+  }
+  return 0;
+}
@@ -7,6 +7,13 @@
 #include "test_tree_tensor.h"
 #include "test_sym_matrix.h"
 #include "test_system.h"
+#include "test_shared_value_storage.h"
+#include "test_float_value_storage.h"
+#include "test_remap_plan.h"
+#include "test_thread_pool.h"
+#include "test_integrator.h"
+#include "test_ocp.h"
+#include "test_solver.h"
 
 int main(int argc, char **argv) {
     testing::InitGoogleTest(&argc, argv);
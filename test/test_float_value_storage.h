@@ -0,0 +1,37 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <utils/testing.h>
+#include "tensor/float_value_storage.h"
+
+TEST(FloatValueStorage, aRoundTrip)
+{
+  ocl::ValueStorage vs(ocl::Matrix({1.0, 0.1, -3.25, 1e6}));
+  ocl::FloatValueStorage fvs(vs);
+
+  ocl::test::assertEqual(fvs.data(), {1.0, 0.1, -3.25, 1e6}, OCL_INFO, 1e-6);
+  ocl::test::assertEqual(fvs.subsindex({2,0}), {-3.25, 1.0}, OCL_INFO);
+
+  fvs.assign({1,3}, {2.5, 4.0});
+  ocl::test::assertEqual(fvs.toValueStorage().data(), {1.0, 2.5, -3.25, 4.0}, OCL_INFO);
+}
+
+TEST(FloatValueStorage, bDoubleAccumulation)
+{
+  // 0.1 is not exact in float, but the sum is accumulated in double
+  const int n = 1000000;
+  ocl::FloatValueStorage fvs(n, 0.1f);
+  double s = fvs.sum(ocl::range(0, n));
+  ocl::test::assertEqual(s, n*(double)0.1f, OCL_INFO);
+}
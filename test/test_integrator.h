@@ -0,0 +1,371 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <cmath>
+#include <utils/testing.h>
+#include "system.h"
+#include "integrator/explicit_rk.h"
+#include "integrator/implicit_rk.h"
+#include "integrator/dormand_prince.h"
+#include "integrator/bdf.h"
+#include "integrator/sensitivities.h"
+#include "integrator/ensemble.h"
+
+// p' = v, v' = a with a given as control
+void varsAccelerated(ocl::SVH& sh)
+{
+  sh.state("p");
+  sh.state("v");
+  sh.control("a");
+}
+
+void eqAccelerated(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  eh.differentialEquation("p", x.get("v"));
+  eh.differentialEquation("v", u.get("a"));
+  (void) z; (void) p;
+}
+
+// q' = v, v' = -q, q(t) = cos(t) for q(0)=1, v(0)=0
+void varsOscillator(ocl::SVH& sh)
+{
+  sh.state("q");
+  sh.state("v");
+}
+
+void eqOscillator(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor q = x.get("q");
+  eh.differentialEquation("q", x.get("v"));
+  eh.differentialEquation("v", -q);
+  (void) z; (void) u; (void) p;
+}
+
+TEST(Integrator, aExplicitRungeKutta)
+{
+  ocl::System sys(&varsAccelerated, &eqAccelerated);
+
+  // one Euler step
+  {
+    ocl::ExplicitRungeKutta euler(sys, ocl::ButcherTableau::Euler());
+    std::vector<double> xf;
+    euler.integrate({0, 0}, {1}, {}, 1.0, 1, xf);
+    ocl::test::assertEqual(xf, {0, 1}, OCL_INFO);
+  }
+
+  // second and fourth order methods are exact for constant acceleration
+  const std::vector<ocl::ButcherTableau> tableaus = {ocl::ButcherTableau::Heun(), ocl::ButcherTableau::RK4()};
+  for (const ocl::ButcherTableau& tableau : tableaus)
+  {
+    ocl::ExplicitRungeKutta rk(sys, tableau);
+    std::vector<double> xf;
+    rk.integrate({0, 0}, {1}, {}, 0.5, 4, xf);
+    ocl::test::assertEqual(xf, {2, 2}, OCL_INFO);
+  }
+}
+
+TEST(Integrator, bLockstep)
+{
+  ocl::System sys(&varsAccelerated, &eqAccelerated);
+  ocl::ExplicitRungeKutta rk(sys, ocl::ButcherTableau::RK4(), 3);
+
+  // three trajectories with different initial states and controls
+  std::vector<double> x0 = {0,0, 1,1, 0,2};
+  std::vector<double> u = {1, 0, -1};
+  std::vector<double> xf;
+  rk.integrate(x0, u, {}, 0.25, 8, xf);
+  ocl::test::assertEqual(xf, {2,2, 3,1, 2,0}, OCL_INFO);
+}
+
+TEST(Integrator, cConvergenceOrder)
+{
+  ocl::System sys(&varsOscillator, &eqOscillator);
+  const std::vector<ocl::ButcherTableau> tableaus = {ocl::ButcherTableau::Euler(), ocl::ButcherTableau::Heun(),
+                                                     ocl::ButcherTableau::RK4()};
+  for (const ocl::ButcherTableau& tableau : tableaus)
+  {
+    ocl::ExplicitRungeKutta rk(sys, tableau);
+    std::vector<double> xf;
+    rk.integrate({1, 0}, {}, {}, 0.1, 10, xf);
+    double e1 = std::abs(xf[0] - std::cos(1.0));
+    rk.integrate({1, 0}, {}, {}, 0.05, 20, xf);
+    double e2 = std::abs(xf[0] - std::cos(1.0));
+
+    // halving the step size reduces the error by 2^order
+    double order = std::log2(e1/e2);
+    ocl::test::assertEqual(order, tableau.order, OCL_INFO, 0.3);
+  }
+}
+
+// x' = z + u, 0 = z + x, i.e. x' = -x + u
+void varsDecay(ocl::SVH& sh)
+{
+  sh.state("x");
+  sh.algebraic("z");
+  sh.control("u");
+}
+
+void eqDecay(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor x_x = x.get("x");
+  ocl::Tensor z_z = z.get("z");
+  eh.differentialEquation("x", z_z + u.get("u"));
+  eh.implicitEquation(z_z + x_x);
+  (void) p;
+}
+
+TEST(Integrator, dImplicitRungeKuttaDae)
+{
+  ocl::System sys(&varsDecay, &eqDecay);
+  ocl::ImplicitRungeKutta radau(sys, ocl::ButcherTableau::RadauIIA(3));
+
+  std::vector<double> x0 = {1}, z0 = {0}, u = {0.5};
+  std::vector<double> xf(1), zf(1), sens(radau.nq());
+  radau.integrate(x0.data(), z0.data(), u.data(), nullptr, 0.1, 10, xf.data(), zf.data(), sens.data());
+
+  // x(t) = u + (x0-u)*exp(-t), z = -x
+  const double e = std::exp(-1.0);
+  ocl::test::assertEqual(xf[0], 0.5 + 0.5*e, OCL_INFO, 1e-8);
+  ocl::test::assertEqual(zf[0], -xf[0], OCL_INFO, 1e-8);
+
+  // dxf/dx0 and dxf/du
+  ocl::test::assertEqual(sens, {e, 1-e}, OCL_INFO, 1e-8);
+}
+
+TEST(Integrator, eImplicitRungeKuttaStiff)
+{
+  ocl::System sys(&varsOscillator, &eqOscillator);
+  const std::vector<ocl::ButcherTableau> tableaus = {ocl::ButcherTableau::GaussLegendre(1),
+                                                     ocl::ButcherTableau::GaussLegendre(2),
+                                                     ocl::ButcherTableau::RadauIIA(2)};
+  for (const ocl::ButcherTableau& tableau : tableaus)
+  {
+    ocl::ImplicitRungeKutta irk(sys, tableau);
+    std::vector<double> x0 = {1, 0}, xf(2);
+    irk.integrate(x0.data(), nullptr, nullptr, nullptr, 0.1, 10, xf.data(), nullptr);
+    double e1 = std::abs(xf[0] - std::cos(1.0));
+    irk.integrate(x0.data(), nullptr, nullptr, nullptr, 0.05, 20, xf.data(), nullptr);
+    double e2 = std::abs(xf[0] - std::cos(1.0));
+    ocl::test::assertEqual(std::log2(e1/e2), tableau.order, OCL_INFO, 0.3);
+  }
+}
+
+TEST(Integrator, fFactorizationReuse)
+{
+  ocl::System sys(&varsDecay, &eqDecay);
+  ocl::ImplicitRungeKutta irk(sys, ocl::ButcherTableau::GaussLegendre(2));
+
+  std::vector<double> x0 = {1}, u = {0}, xf(1);
+  irk.integrate(x0.data(), nullptr, u.data(), nullptr, 0.1, 10, xf.data(), nullptr);
+  ocl::test::assertEqual(xf[0], std::exp(-1.0), OCL_INFO, 1e-8);
+
+  // linear system and constant step size: one factorization for all steps
+  ocl::test::assertEqual(irk.numFactorizations(), 1, OCL_INFO);
+}
+
+TEST(Integrator, gDormandPrince)
+{
+  ocl::System sys(&varsOscillator, &eqOscillator);
+  ocl::DormandPrinceOptions opts;
+  opts.rel_tol = 1e-8;
+  opts.abs_tol = 1e-10;
+  ocl::DormandPrince dp(sys, opts);
+
+  std::vector<double> times;
+  for (int i = 0; i <= 20; i++) {
+    times.push_back(0.5*i);
+  }
+  ocl::Trajectory trajectory = dp.simulate({1, 0}, {}, {}, times);
+
+  // samples from the dense output
+  const std::vector<double>& data = trajectory.data();
+  for (unsigned int i = 0; i < times.size(); i++) {
+    ocl::test::assertEqual(data[2*i], std::cos(times[i]), OCL_INFO, 1e-6);
+  }
+
+  ocl::TreeTensor q = trajectory.states().get("q");
+  ocl::test::assertEqual((double)q.value().length(), 21., OCL_INFO);
+  ocl::test::assertEqual(ocl::full(q.value().get(20)), {std::cos(10.)}, OCL_INFO, 1e-6);
+
+  // first same as last: six evaluations per step plus the initial one
+  int steps = dp.numAcceptedSteps() + dp.numRejectedSteps();
+  ocl::test::assertEqual(dp.numEvaluations(), 1 + 6*steps, OCL_INFO);
+
+  // grids of zero length or with a final gap below min_step
+  const std::vector<std::vector<double> > short_grids = {{0, 0}, {0, 1e-13}, {0, 1, 1+1e-13}};
+  for (const std::vector<double>& grid : short_grids)
+  {
+    ocl::Trajectory short_trajectory = dp.simulate({1, 0}, {}, {}, grid);
+    ocl::test::assertEqual(short_trajectory.data()[2*(grid.size()-1)], std::cos(grid.back()), OCL_INFO, 1e-6);
+  }
+}
+
+// stiff: x1' = -1000*x1 + x2, x2' = -x2
+void varsStiff(ocl::SVH& sh)
+{
+  sh.state("x1");
+  sh.state("x2");
+}
+
+void eqStiff(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor x1 = x.get("x1");
+  ocl::Tensor x2 = x.get("x2");
+  eh.differentialEquation("x1", x1*(-1000.) + x2);
+  eh.differentialEquation("x2", -x2);
+  (void) z; (void) u; (void) p;
+}
+
+TEST(Integrator, hBDFStiff)
+{
+  ocl::System sys(&varsStiff, &eqStiff);
+  ocl::BDF bdf(sys);
+
+  std::vector<double> x0 = {1, 1}, xf(2);
+  bdf.integrate(x0.data(), nullptr, nullptr, nullptr, 0., 10., xf.data(), nullptr);
+  ocl::test::assertEqual(xf[1], std::exp(-10.), OCL_INFO, 1e-6);
+  ocl::test::assertEqual(xf[0], std::exp(-10.)/999, OCL_INFO, 1e-6);
+
+  // explicit RK4 would need thousands of steps for stability
+  ocl::test::assertEqual(bdf.numSteps() < 500, true, OCL_INFO);
+  ocl::test::assertEqual(bdf.currentOrder() > 1, true, OCL_INFO);
+
+  // the Jacobian is reused over many steps
+  ocl::test::assertEqual(bdf.numJacobianEvaluations() < bdf.numSteps()/5, true, OCL_INFO);
+}
+
+TEST(Integrator, iBDFDae)
+{
+  ocl::System sys(&varsDecay, &eqDecay);
+  ocl::BDF bdf(sys);
+
+  // inconsistent initial guess for z
+  std::vector<double> x0 = {1}, z0 = {0}, u = {0}, xf(1), zf(1);
+  bdf.integrate(x0.data(), z0.data(), u.data(), nullptr, 0., 1., xf.data(), zf.data());
+  ocl::test::assertEqual(xf[0], std::exp(-1.), OCL_INFO, 1e-5);
+  ocl::test::assertEqual(zf[0], -xf[0], OCL_INFO, 1e-8);
+}
+
+// x' = -k*x^2 + u
+void varsLogistic(ocl::SVH& sh)
+{
+  sh.state("x");
+  sh.control("u");
+  sh.parameter("k");
+}
+
+void eqLogistic(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor x_x = x.get("x");
+  ocl::Tensor k = p.get("k");
+  eh.differentialEquation("x", u.get("u") - k*x_x*x_x);
+  (void) z;
+}
+
+TEST(Integrator, jSensitivitiesExact)
+{
+  // RK4 is exact for constant acceleration: xf = [p0 + v0*T + a*T^2/2; v0 + a*T]
+  ocl::System sys(&varsAccelerated, &eqAccelerated);
+  ocl::RungeKuttaSensitivities rk(sys, ocl::ButcherTableau::RK4());
+
+  const double T = 2.;
+  std::vector<double> xf, dxf, grad;
+  rk.forward({1, 0}, {1}, {}, T/10, 10, xf, dxf);
+  ocl::test::assertEqual(xf, {3, 2}, OCL_INFO);
+  ocl::test::assertEqual(dxf, {1,0, T,1, T*T/2,T}, OCL_INFO);
+
+  rk.adjoint({1, 0}, {1}, {}, T/10, 10, {1, 2}, xf, grad);
+  ocl::test::assertEqual(xf, {3, 2}, OCL_INFO);
+  ocl::test::assertEqual(grad, {1, T+2, T*T/2+2*T}, OCL_INFO);
+  ocl::test::assertEqual(rk.numCheckpoints(), 3, OCL_INFO);
+}
+
+TEST(Integrator, kSensitivitiesAdjoint)
+{
+  ocl::System sys(&varsLogistic, &eqLogistic);
+  const std::vector<double> x0 = {2.}, u = {0.5}, p = {1.5};
+  const int N = 50;
+  const double h = 0.02;
+
+  for (int interval : {0, 1, 7, N})
+  {
+    ocl::RungeKuttaSensitivities rk(sys, ocl::ButcherTableau::RK4(), interval);
+    std::vector<double> xf, dxf, xf_adj, grad;
+    rk.forward(x0, u, p, h, N, xf, dxf);
+    rk.adjoint(x0, u, p, h, N, {1.}, xf_adj, grad);
+    ocl::test::assertEqual(xf_adj, xf, OCL_INFO);
+    ocl::test::assertEqual(grad, dxf, OCL_INFO, 1e-12);
+
+    // central finite differences of the discrete map
+    std::vector<double> w = {x0[0], u[0], p[0]};
+    for (int c = 0; c < 3; c++)
+    {
+      std::vector<double> w1 = w, w2 = w, f1, f2, d;
+      w1[c] += 1e-6;
+      w2[c] -= 1e-6;
+      rk.forward({w1[0]}, {w1[1]}, {w1[2]}, h, N, f1, d);
+      rk.forward({w2[0]}, {w2[1]}, {w2[2]}, h, N, f2, d);
+      ocl::test::assertEqual((f1[0]-f2[0])/2e-6, dxf[c], OCL_INFO, 1e-7);
+    }
+  }
+}
+
+TEST(Integrator, lEnsemble)
+{
+  ocl::System sys(&varsAccelerated, &eqAccelerated);
+
+  // 5 trajectories in chunks of 2 lanes, the last chunk is padded
+  const int K = 5;
+  std::vector<double> x0, u;
+  for (int k = 0; k < K; k++)
+  {
+    x0.push_back(k);
+    x0.push_back(1);
+    u.push_back(0.5*k - 1);
+  }
+
+  ocl::Ensemble ensemble(sys, ocl::ButcherTableau::RK4(), 2);
+  ocl::EnsembleTrajectories result = ensemble.simulate(x0, u, {}, K, 0.25, 8, 4);
+  ocl::test::assertEqual(result.times(), {0., 1., 2.}, OCL_INFO);
+
+  // same result as one trajectory at a time
+  ocl::ExplicitRungeKutta rk(sys, ocl::ButcherTableau::RK4());
+  const std::vector<double> data = result.data();
+  for (int k = 0; k < K; k++)
+  {
+    std::vector<double> xf;
+    rk.integrate({x0[2*k], x0[2*k+1]}, {u[k]}, {}, 0.25, 8, xf);
+    ocl::test::assertEqual(data[(3*k+2)*2], xf[0], OCL_INFO);
+    ocl::test::assertEqual(data[(3*k+2)*2+1], xf[1], OCL_INFO);
+
+    // p(t) = p0 + t + a*t^2/2
+    std::vector<std::vector<double> > p = result.trajectory(k).get("p").data();
+    ocl::test::assertEqual(p[0][0], (double)k, OCL_INFO);
+    ocl::test::assertEqual(p[1][0], k + 1 + u[k]/2, OCL_INFO);
+    ocl::test::assertEqual(p[2][0], k + 2 + 2*u[k], OCL_INFO);
+  }
+  ocl::test::assertEqual((int)result.states().get("v").data().size(), 3*K, OCL_INFO);
+
+  // the sampling interval is checked before the samples are counted
+  for (int sample_every : {0, -2, 3})
+  {
+    bool thrown = false;
+    try {
+      ensemble.simulate(x0, u, {}, K, 0.25, 8, sample_every);
+    } catch (const OclException&) {
+      thrown = true;
+    }
+    ocl::test::assertEqual(thrown, true, OCL_INFO);
+  }
+}
@@ -0,0 +1,251 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <cmath>
+#include <limits>
+#include <utils/testing.h>
+#include "system.h"
+#include "ocp.h"
+#include "simultaneuous.h"
+#include "multiple_shooting.h"
+
+// Double integrator, p' = v, v' = a
+void varsCart(ocl::SVH& sh)
+{
+  sh.state("p");
+  sh.state("v", {1,1}, -5, 5);
+  sh.control("a", {1,1}, -1, 1);
+}
+
+void eqCart(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  eh.differentialEquation("p", x.get("v"));
+  eh.differentialEquation("v", u.get("a"));
+  (void) z; (void) p;
+}
+
+void pathCostsCart(ocl::CH& ch, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor a = u.get("a");
+  ch.add(a*a);
+  (void) x; (void) z; (void) p;
+}
+
+void arrivalCostsCart(ocl::CH& ch, const ocl::TT& x, const ocl::TT& p)
+{
+  ocl::Tensor v = x.get("v");
+  ch.add(v*v);
+  (void) p;
+}
+
+void pathConstraintsCart(ocl::CNH& ch, const ocl::TT& x, const ocl::TT& p)
+{
+  ch.add(x.get("v"), "<=", 2.);
+  (void) p;
+}
+
+void boundaryConditionsCart(ocl::CNH& ch, const ocl::TT& x0, const ocl::TT& xf, const ocl::TT& p)
+{
+  ch.add(x0.get("p"), "==", 0.);
+  ch.add(x0.get("v"), "==", 0.);
+  ch.add(xf.get("p"), ">=", 0.5);
+  (void) p;
+}
+
+TEST(OCP, aCollocationCoefficients)
+{
+  for (int d = 1; d <= 3; d++)
+  {
+    ocl::CollocationCoefficients coeffs(d);
+    ocl::test::assertEqual(coeffs.points[0], 0., OCL_INFO);
+    ocl::test::assertEqual(coeffs.points[d], 1., OCL_INFO, 1e-14);
+
+    double sum_b = 0;
+    for (int j = 0; j <= d; j++) {
+      sum_b += coeffs.B[j];
+      // the end point of Radau collocation is tau_d
+      ocl::test::assertEqual(coeffs.D[j], j == d ? 1. : 0., OCL_INFO, 1e-12);
+    }
+    ocl::test::assertEqual(sum_b, 1., OCL_INFO, 1e-12);
+
+    // derivatives of tau^k are exact up to degree d
+    for (int r = 0; r <= d; r++)
+    {
+      double dp = 0;
+      for (int j = 0; j <= d; j++) {
+        dp += coeffs.C[j][r]*std::pow(coeffs.points[j], d);
+      }
+      ocl::test::assertEqual(dp, d*std::pow(coeffs.points[r], d-1), OCL_INFO, 1e-10);
+    }
+  }
+}
+
+TEST(OCP, bCollocation)
+{
+  ocl::System sys(&varsCart, &eqCart);
+  ocl::OCP ocp(sys, &pathCostsCart, &arrivalCostsCart, &pathConstraintsCart, &boundaryConditionsCart);
+
+  ocl::CollocationOptions opts;
+  opts.control_intervals = 10;
+  ocl::Collocation coll(ocp, 1.0, opts);
+
+  // 10 intervals of [x, 3x(xc), u] and the final state
+  const int n_interval = 2 + 3*2 + 1;
+  ocl::test::assertEqual(coll.nv(), 10*n_interval + 2, OCL_INFO);
+  // per interval 6 collocation equations, 2 continuity, 1 path constraint
+  ocl::test::assertEqual(coll.ng(), 10*9 + 1 + 3, OCL_INFO);
+
+  // bounds of the system variables
+  const double inf = std::numeric_limits<double>::infinity();
+  ocl::Tree intervals = coll.variables().get("interval");
+  int i_a = intervals.at(3).get("u").get("a").indizes()[0][0];
+  int i_v = intervals.at(3).get("xc").get("v").indizes()[1][0];
+  int i_p = coll.variables().get("xf").get("p").indizes()[0][0];
+  ocl::test::assertEqual(coll.variableLowerBounds()[i_a], -1., OCL_INFO);
+  ocl::test::assertEqual(coll.variableUpperBounds()[i_v], 5., OCL_INFO);
+  ocl::test::assertEqual(coll.variableUpperBounds()[i_p], inf, OCL_INFO);
+
+  // p = t^2/2, v = t with a = 1 is represented exactly
+  const double h = 0.1;
+  std::vector<double> w(coll.nv(), 0.);
+  const std::vector<double>& tau = coll.coefficients().points;
+  for (int k = 0; k < 10; k++)
+  {
+    ocl::Tree interval = intervals.at(k);
+    for (int j = 0; j <= 3; j++)
+    {
+      double t = (k + tau[j])*h;
+      ocl::Tree x = j == 0 ? interval.get("x") : interval.get("xc").at(j-1);
+      w[x.get("p").indizes()[0][0]] = t*t/2;
+      w[x.get("v").indizes()[0][0]] = t;
+    }
+    w[interval.get("u").get("a").indizes()[0][0]] = 1.;
+  }
+  w[i_p] = 0.5;
+  w[coll.variables().get("xf").get("v").indizes()[0][0]] = 1.;
+
+  std::vector<casadi::DM> g = coll.constraintFunction()(std::vector<casadi::DM>{casadi::DM(w)});
+  std::vector<double> g_values = g[0].nonzeros();
+  for (int k = 0; k < 10; k++)
+  {
+    for (int i = 0; i < 8; i++) {
+      ocl::test::assertEqual(g_values[9*k+i], 0., OCL_INFO, 1e-12);
+    }
+    // path constraint v - 2 at the start of the interval
+    ocl::test::assertEqual(g_values[9*k+8], k*h - 2, OCL_INFO, 1e-12);
+  }
+  ocl::test::assertEqual(g_values[90], 1. - 2, OCL_INFO, 1e-12);
+  ocl::test::assertEqual(g_values[91], 0., OCL_INFO);
+  ocl::test::assertEqual(g_values[93], 0., OCL_INFO);
+  ocl::test::assertEqual(coll.constraintLowerBounds()[93], 0., OCL_INFO);
+  ocl::test::assertEqual(coll.constraintUpperBounds()[93], inf, OCL_INFO);
+
+  // integral of a^2 plus v(T)^2
+  std::vector<casadi::DM> J = coll.costFunction()(std::vector<casadi::DM>{casadi::DM(w)});
+  ocl::test::assertEqual(J[0].nonzeros()[0], 2., OCL_INFO, 1e-12);
+}
+
+TEST(OCP, cCollocationSparsity)
+{
+  ocl::System sys(&varsCart, &eqCart);
+  ocl::OCP ocp(sys, &pathCostsCart, &arrivalCostsCart, &pathConstraintsCart, &boundaryConditionsCart);
+
+  ocl::CollocationOptions opts;
+  opts.control_intervals = 10;
+  ocl::Collocation coll(ocp, 1.0, opts);
+
+  // constraints of interval k only depend on interval k and the start of
+  // interval k+1 (the final state for the last interval)
+  casadi::SXDict nlp = coll.nlp();
+  casadi::Sparsity sp = casadi::SX::jacobian(nlp["g"], nlp["x"]).sparsity();
+  std::vector<casadi::casadi_int> rows, cols;
+  sp.get_triplet(rows, cols);
+
+  const int n_interval = 9;
+  for (unsigned int i = 0; i < rows.size(); i++)
+  {
+    if (rows[i] >= 10*9) {
+      continue;
+    }
+    int k = rows[i]/9;
+    ocl::test::assertEqual(cols[i] >= k*n_interval && cols[i] < (k+1)*n_interval + 2, true, OCL_INFO);
+  }
+}
+
+TEST(OCP, dMultipleShooting)
+{
+  ocl::System sys(&varsCart, &eqCart);
+  ocl::OCP ocp(sys, &pathCostsCart, &arrivalCostsCart, &pathConstraintsCart, &boundaryConditionsCart);
+  ocl::ThreadPool pool(2);
+
+  ocl::MultipleShootingOptions opts;
+  opts.control_intervals = 4;
+  opts.steps_per_interval = 5;
+  ocl::MultipleShooting ms(ocp, 1.0, pool, opts);
+
+  // 4 intervals of [x, u] and the final state
+  ocl::test::assertEqual(ms.nv(), 4*3 + 2, OCL_INFO);
+  ocl::test::assertEqual(ms.ng(), 4*3 + 1 + 3, OCL_INFO);
+
+  // p = t^2/2, v = t with a = 1, RK4 is exact
+  std::vector<double> w(ms.nv());
+  ocl::Tree intervals = ms.variables().get("interval");
+  for (int k = 0; k < 4; k++)
+  {
+    double t = 0.25*k;
+    w[intervals.at(k).get("x").get("p").indizes()[0][0]] = t*t/2;
+    w[intervals.at(k).get("x").get("v").indizes()[0][0]] = t;
+    w[intervals.at(k).get("u").get("a").indizes()[0][0]] = 1.;
+  }
+  w[ms.variables().get("xf").get("p").indizes()[0][0]] = 0.5;
+  w[ms.variables().get("xf").get("v").indizes()[0][0]] = 1.;
+
+  double J;
+  std::vector<double> g(ms.ng());
+  ms.evaluate(w.data(), J, g.data());
+  for (int k = 0; k < 4; k++)
+  {
+    ocl::test::assertEqual(g[3*k], 0., OCL_INFO, 1e-12);
+    ocl::test::assertEqual(g[3*k+1], 0., OCL_INFO, 1e-12);
+    ocl::test::assertEqual(g[3*k+2], 0.25*k - 2, OCL_INFO, 1e-12);
+  }
+  // rectangle rule of a^2 plus v(T)^2
+  ocl::test::assertEqual(J, 2., OCL_INFO, 1e-12);
+
+  // derivatives against central finite differences at a perturbed point
+  for (unsigned int i = 0; i < w.size(); i++) {
+    w[i] += 0.1*std::sin(3.*i);
+  }
+  const int nnz = ms.jacobianRows().size();
+  std::vector<double> grad(ms.nv()), jac_nz(nnz), g0(ms.ng());
+  ms.evaluate(w.data(), J, g0.data(), grad.data(), jac_nz.data());
+
+  std::vector<double> jac(ms.ng()*ms.nv(), 0.);
+  for (int i = 0; i < nnz; i++) {
+    jac[ms.jacobianCols()[i]*ms.ng() + ms.jacobianRows()[i]] += jac_nz[i];
+  }
+  for (int c = 0; c < ms.nv(); c++)
+  {
+    std::vector<double> w1 = w, w2 = w, g1(ms.ng()), g2(ms.ng());
+    double J1, J2;
+    w1[c] += 1e-6;
+    w2[c] -= 1e-6;
+    ms.evaluate(w1.data(), J1, g1.data());
+    ms.evaluate(w2.data(), J2, g2.data());
+    ocl::test::assertEqual(grad[c], (J1-J2)/2e-6, OCL_INFO, 1e-6);
+    for (int r = 0; r < ms.ng(); r++) {
+      ocl::test::assertEqual(jac[c*ms.ng() + r], (g1[r]-g2[r])/2e-6, OCL_INFO, 1e-6);
+    }
+  }
+}
@@ -0,0 +1,82 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <utils/testing.h>
+#include "tensor/tree_builder.h"
+#include "tensor/remap_plan.h"
+
+static ocl::Tree ocpTree(const int N, const bool with_p = true)
+{
+  ocl::TreeBuilder tb_x;
+  tb_x.add("p", {2,1});
+  tb_x.add("v", {1,1});
+
+  ocl::TreeBuilder tb_u;
+  tb_u.add("F", {1,1});
+
+  ocl::TreeBuilder tb;
+  tb.addRepeated({"x","u"}, {tb_x.tree(), tb_u.tree()}, N);
+  tb.add("x", tb_x.tree());
+  if (with_p) {
+    tb.add("T", {1,1});
+  }
+  return tb.tree();
+}
+
+TEST(RemapPlan, aIdentity)
+{
+  ocl::Tree t = ocpTree(3);
+  ocl::RemapPlan plan(t, t);
+
+  std::vector<double> v(t.numel());
+  for (unsigned int i = 0; i < v.size(); i++) {
+    v[i] = i;
+  }
+  ocl::test::assertEqual(plan.apply(v), v, OCL_INFO);
+  ocl::test::assertEqual(plan.numFilled(), 0, OCL_INFO);
+}
+
+TEST(RemapPlan, bShiftAndMissing)
+{
+  // x0 u0 x1 u1 x2 T
+  ocl::Tree src = ocpTree(2);
+  // x0 u0 x1 u1 x2 u2 x3
+  ocl::Tree dst = ocpTree(3, false);
+
+  ocl::RemapOptions opts;
+  opts.shift = 1;
+  ocl::RemapPlan plan(src, dst, opts);
+
+  std::vector<double> v = {0,0,0, 1, 10,10,10, 11, 20,20,20, 99};
+  std::vector<double> r = plan.apply(v);
+
+  // shifted by one stage, last elements duplicated
+  ocl::test::assertEqual(r, {10,10,10, 11, 20,20,20, 11, 20,20,20, 11, 20,20,20}, OCL_INFO);
+}
+
+TEST(RemapPlan, cDefaultAndInterpolate)
+{
+  ocl::Tree src = ocpTree(1, false);  // x0 u0 x1
+  ocl::Tree dst = ocpTree(2);         // x0 u0 x1 u1 x2 T
+
+  std::vector<double> v = {0,0,0, 1, 10,10,10};
+
+  ocl::RemapOptions opts;
+  opts.interpolate = true;
+  opts.default_value = -1;
+  ocl::RemapPlan plan(src, dst, opts);
+
+  ocl::test::assertEqual(plan.apply(v), {0,0,0, 1, 5,5,5, 1, 10,10,10, -1}, OCL_INFO);
+  ocl::test::assertEqual(plan.numFilled(), 1, OCL_INFO);
+}
@@ -0,0 +1,94 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <thread>
+#include <utils/testing.h>
+#include "tensor/tree_builder.h"
+#include "tensor/tree_tensor.h"
+#include "tensor/shared_value_storage.h"
+
+TEST(SharedValueStorage, aPublishRead)
+{
+  ocl::TreeBuilder tb;
+  tb.add("x1", {1,2});
+  tb.add("x2", {2,1});
+  ocl::Tree x_structure = tb.tree();
+
+  ocl::SharedValueStorage svs(x_structure.numel());
+
+  ocl::test::assertEqual(svs.update(), false, OCL_INFO);
+  ocl::test::assertEqual(svs.read(), {0,0,0,0}, OCL_INFO);
+
+  svs.writeBuffer() = {1,2,3,4};
+  svs.publish();
+
+  ocl::ValueStorage vs = svs.snapshot();
+  ocl::TreeTensor x(x_structure, vs);
+  ocl::test::assertEqual(x.get("x2").data(), {{3,4}}, OCL_INFO);
+
+  // nothing new published, front buffer stays valid
+  ocl::test::assertEqual(svs.update(), false, OCL_INFO);
+  ocl::test::assertEqual(svs.read(), {1,2,3,4}, OCL_INFO);
+
+  svs.publish(std::vector<double>({5,6,7,8}));
+  svs.publish(std::vector<double>({9,10,11,12}));
+  ocl::test::assertEqual(svs.update(), true, OCL_INFO);
+  ocl::test::assertEqual(svs.read(), {9,10,11,12}, OCL_INFO);
+}
+
+// Writer and reader run concurrently, the reader must only ever see
+// complete snapshots. Run the tsan build (make tsan) to check for data races.
+TEST(SharedValueStorage, bConcurrentStress)
+{
+  const int n = 1000;
+  const int iterations = 20000;
+  ocl::SharedValueStorage svs(n, -1);
+
+  std::thread writer([&svs, n, iterations]() {
+    for (int k = 0; k < iterations; k++) {
+      std::vector<double>& buffer = svs.writeBuffer();
+      for (int i = 0; i < n; i++) {
+        buffer[i] = k;
+      }
+      svs.publish();
+    }
+  });
+
+  int torn = 0;
+  int out_of_order = 0;
+  double last = -1;
+  while (last < iterations-1)
+  {
+    if (!svs.update()) {
+      std::this_thread::yield();
+      continue;
+    }
+    const std::vector<double>& values = svs.read();
+    for (int i = 0; i < n; i++) {
+      if (values[i] != values[0]) {
+        torn++;
+        break;
+      }
+    }
+    if (values[0] < last) {
+      out_of_order++;
+    }
+    last = values[0];
+  }
+  writer.join();
+
+  ocl::test::assertEqual(torn, 0, OCL_INFO);
+  ocl::test::assertEqual(out_of_order, 0, OCL_INFO);
+  ocl::test::assertEqual(last, (double)(iterations-1), OCL_INFO);
+}
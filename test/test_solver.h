@@ -0,0 +1,378 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <cmath>
+#include <vector>
+#include <utils/testing.h>
+#include "tensor/tree_builder.h"
+#include "solver/riccati.h"
+#include "solver/horizon_shift.h"
+#include "solver/interior_point.h"
+#include "solver/real_time_iteration.h"
+#include "solver.h"
+
+TEST(Solver, aRiccati)
+{
+  // Stages with a state, a control and an algebraic variable
+  ocl::TreeBuilder ib;
+  ib.add("x", 2);
+  ib.add("u", 1);
+  ib.add("z", 1);
+  ocl::TreeBuilder tb;
+  tb.addRepeated({"interval"}, {ib.tree()}, 6);
+  tb.add("xf", 2);
+  ocl::Tree tree = tb.tree();
+
+  ocl::RiccatiSolver kkt(tree.get("interval"), tree.get("xf"));
+  const int N = kkt.numStages();
+  ocl::test::assertEqual(N, 6, OCL_INFO);
+  ocl::test::assertEqual(kkt.size(), tree.numel(), OCL_INFO);
+
+  // Well conditioned data with some coupling, P = diag(1, 2), R = diag(1, 3)
+  for (int k = 0; k <= N; k++)
+  {
+    const double s = std::sin(k+1.);
+    double* Q = kkt.Q(k);
+    Q[0] = 1+s*s; Q[1] = 0.1*s; Q[2] = 0.1*s; Q[3] = 2;
+    kkt.q(k)[0] = s; kkt.q(k)[1] = -1;
+    if (k == N) {
+      break;
+    }
+    double* R = kkt.R(k);
+    R[0] = 1; R[1] = 0.2; R[2] = 0.2; R[3] = 3;
+    double* S = kkt.S(k);
+    S[0] = 0.1; S[1] = 0; S[2] = 0; S[3] = 0.1*s;
+    kkt.r(k)[0] = 0.5; kkt.r(k)[1] = s;
+    double* A = kkt.A(k);
+    A[0] = 1; A[1] = 0; A[2] = 0.1; A[3] = 1;
+    double* B = kkt.B(k);
+    B[0] = 0.005; B[1] = 0.1; B[2] = s; B[3] = 0;
+    kkt.c(k)[0] = 0.01*k; kkt.c(k)[1] = 0;
+  }
+
+  // Residuals of the KKT conditions
+  std::vector<double> sol(kkt.size()), lambda(2*(N+1));
+  auto checkKkt = [&]()
+  {
+    for (int k = 0; k <= N; k++)
+    {
+      const double* x = &sol[kkt.offset(k)];
+      const double* l = &lambda[2*k];
+      std::vector<double> gx = {kkt.Q(k)[0]*x[0] + kkt.Q(k)[2]*x[1] + kkt.q(k)[0] - l[0],
+                                kkt.Q(k)[1]*x[0] + kkt.Q(k)[3]*x[1] + kkt.q(k)[1] - l[1]};
+      if (k < N)
+      {
+        const double* u = x + 2;
+        const double* x_next = &sol[kkt.offset(k+1)];
+        const double* l_next = &lambda[2*(k+1)];
+        const double* A = kkt.A(k);
+        const double* B = kkt.B(k);
+        const double* S = kkt.S(k);
+        const double* R = kkt.R(k);
+        for (int i = 0; i < 2; i++)
+        {
+          // d/dx: Q x + S'u + q + A'lambda_k+1 - lambda_k
+          gx[i] += S[2*i]*u[0] + S[2*i+1]*u[1] + A[2*i]*l_next[0] + A[2*i+1]*l_next[1];
+          // d/du: S x + R u + r + B'lambda_k+1
+          const double gu = S[i]*x[0] + S[i+2]*x[1] + R[i]*u[0] + R[i+2]*u[1] + kkt.r(k)[i]
+                            + B[2*i]*l_next[0] + B[2*i+1]*l_next[1];
+          ocl::test::assertEqual(gu, 0., OCL_INFO, 1e-10);
+          // dynamics
+          const double d = A[i]*x[0] + A[i+2]*x[1] + B[i]*u[0] + B[i+2]*u[1] + kkt.c(k)[i] - x_next[i];
+          ocl::test::assertEqual(d, 0., OCL_INFO, 1e-12);
+        }
+      }
+      ocl::test::assertEqual(gx[0], 0., OCL_INFO, 1e-10);
+      ocl::test::assertEqual(gx[1], 0., OCL_INFO, 1e-10);
+    }
+  };
+
+  ocl::test::assertEqual(kkt.factorize(), true, OCL_INFO);
+  const std::vector<double> x0 = {1, -1};
+  kkt.solve(x0.data(), sol.data(), lambda.data());
+  ocl::test::assertEqual(sol[0], x0[0], OCL_INFO, 1e-12);
+  ocl::test::assertEqual(sol[1], x0[1], OCL_INFO, 1e-12);
+  checkKkt();
+
+  // Free initial state, the multiplier of x_0 = x0 vanishes
+  ocl::test::assertEqual(kkt.factorize(true), true, OCL_INFO);
+  kkt.solve(nullptr, sol.data(), lambda.data());
+  ocl::test::assertEqual(lambda[0], 0., OCL_INFO);
+  ocl::test::assertEqual(lambda[1], 0., OCL_INFO);
+  checkKkt();
+
+  // Indefinite control Hessian
+  kkt.R(2)[0] = -10;
+  ocl::test::assertEqual(kkt.factorize(), false, OCL_INFO);
+}
+
+TEST(Solver, bInteriorPoint)
+{
+  // Cart of test_ocp.h from rest at p=0 to p(T) >= 0.5, the path costs are
+  // quadratic in the controls and RK4 is exact, so this is a QP with the
+  // minimum 6/31 for T=2 and 4 intervals
+  ocl::System sys(&varsCart, &eqCart);
+  ocl::OCP ocp(sys, &pathCostsCart, &arrivalCostsCart, &pathConstraintsCart, &boundaryConditionsCart);
+  ocl::ThreadPool pool(2);
+
+  ocl::MultipleShootingOptions opts;
+  opts.control_intervals = 4;
+  ocl::MultipleShooting ms(ocp, 2.0, pool, opts);
+  ocl::InteriorPoint ip(ms, pool);
+
+  ocl::InteriorPointResult cold = ip.solve(ms.initialGuess());
+  ocl::test::assertEqual(cold.success, true, OCL_INFO);
+  ocl::test::assertEqual(cold.objective, 6./31, OCL_INFO, 1e-6);
+  ocl::test::assertEqual(cold.w[ms.variables().get("xf").get("p").indizes()[0][0]], 0.5, OCL_INFO, 1e-6);
+
+  // warm start at the solution
+  ocl::InteriorPointResult warm = ip.solve(cold);
+  ocl::test::assertEqual(warm.success, true, OCL_INFO);
+  ocl::test::assertEqual(warm.objective, 6./31, OCL_INFO, 1e-6);
+  ocl::test::assertEqual(warm.iterations < cold.iterations, true, OCL_INFO);
+
+  // tighter horizon, the control bounds are active
+  ocl::MultipleShooting ms_short(ocp, 1.05, pool, opts);
+  ocl::InteriorPoint ip_short(ms_short, pool);
+  ocl::InteriorPointResult result = ip_short.solve(ms_short.initialGuess());
+  ocl::test::assertEqual(result.success, true, OCL_INFO);
+  ocl::test::assertEqual(result.w[ms_short.variables().get("interval").at(0).get("u").indizes()[0][0]],
+                         1., OCL_INFO, 1e-6);
+}
+
+TEST(Solver, cSolverInterface)
+{
+  ocl::Solver solver(2.0, &varsCart, &eqCart, &pathCostsCart, &arrivalCostsCart,
+                     &pathConstraintsCart, &boundaryConditionsCart);
+  solver.options.discretization = "multiple_shooting";
+  solver.options.solver = "interior_point";
+  solver.options.control_intervals = 4;
+  solver.options.controls_regularization = false;
+
+  ocl::Solution solution = solver.solve();
+  ocl::test::assertEqual(solution.success, true, OCL_INFO);
+  ocl::test::assertEqual(solution.objective, 6./31, OCL_INFO, 1e-6);
+
+  // tighter end bound, warm started from the previous solution
+  solver.setEndBounds("p", ocl::Bound(0.6, 10));
+  ocl::Solution next = solver.solve(solution);
+  ocl::test::assertEqual(next.success, true, OCL_INFO);
+  ocl::test::assertEqual(next.objective > solution.objective, true, OCL_INFO);
+
+  // the interior point solver needs the stage structure of multiple shooting
+  ocl::Solver collocation(2.0, &varsCart, &eqCart);
+  collocation.options.solver = "interior_point";
+  bool thrown = false;
+  try {
+    collocation.solve();
+  } catch (const OclException&) {
+    thrown = true;
+  }
+  ocl::test::assertEqual(thrown, true, OCL_INFO);
+}
+
+// Boundary conditions of the cart without the initial state
+void endConditionsCart(ocl::CNH& ch, const ocl::TT& x0, const ocl::TT& xf, const ocl::TT& p)
+{
+  ch.add(xf.get("p"), ">=", 0.5);
+  (void) x0; (void) p;
+}
+
+TEST(Solver, dRealTimeIteration)
+{
+  ocl::System sys(&varsCart, &eqCart);
+  ocl::OCP ocp(sys, &pathCostsCart, &arrivalCostsCart, &pathConstraintsCart, &boundaryConditionsCart);
+  ocl::ThreadPool pool(2);
+
+  ocl::MultipleShootingOptions opts;
+  opts.control_intervals = 10;
+  ocl::MultipleShooting ms(ocp, 2.0, pool, opts);
+  ocl::RealTimeIteration rti(ms, pool);
+
+  ocl::InteriorPointResult initial = rti.solve(ms.initialGuess());
+  ocl::test::assertEqual(initial.success, true, OCL_INFO);
+
+  // feedback at the state of the solution keeps the controls
+  std::vector<double> u0;
+  rti.preparation();
+  ocl::test::assertEqual(rti.feedback({0., 0.}, u0), true, OCL_INFO);
+  ocl::test::assertEqual(u0[0], initial.w[2], OCL_INFO, 1e-6);
+  ocl::test::assertEqual(rti.preparationTime() > 0. && rti.feedbackTime() >= 0., true, OCL_INFO);
+
+  // a new initial state, the boundary condition on x0 is replaced by the
+  // measurement and the iterations contract to the new solution
+  for (int i = 0; i < 10; i++)
+  {
+    rti.preparation();
+    rti.feedback({0.05, 0.1}, u0);
+  }
+
+  // converged solution with the initial state fixed by its bounds
+  ocl::OCP ocp_ref(sys, &pathCostsCart, &arrivalCostsCart, &pathConstraintsCart, &endConditionsCart);
+  ocl::MultipleShooting ms_ref(ocp_ref, 2.0, pool, opts);
+  ms_ref.setInitialBounds("p", 0.05, 0.05);
+  ms_ref.setInitialBounds("v", 0.1, 0.1);
+  ocl::InteriorPoint ip_ref(ms_ref, pool);
+  ocl::InteriorPointResult reference = ip_ref.solve(ms_ref.initialGuess());
+  ocl::test::assertEqual(reference.success, true, OCL_INFO);
+  ocl::test::assertEqual(u0[0], reference.w[2], OCL_INFO, 1e-6);
+
+  // feedback without preparation
+  ocl::test::assertEqual(rti.feedback({0.05, 0.1}, u0), false, OCL_INFO);
+
+  // moving backwards the control bound a <= 1 becomes active, the sent
+  // controls stay within the bounds and are the controls of the iterate
+  for (int i = 0; i < 10; i++)
+  {
+    rti.preparation();
+    rti.feedback({0., -0.7}, u0);
+    ocl::test::assertEqual(u0[0] <= 1., true, OCL_INFO);
+    ocl::test::assertEqual(rti.iterate().w[2], u0[0], OCL_INFO);
+  }
+  ocl::test::assertEqual(u0[0], 1., OCL_INFO, 1e-6);
+}
+
+TEST(Solver, eHorizonShift)
+{
+  ocl::System sys(&varsCart, &eqCart);
+  ocl::OCP ocp(sys, &pathCostsCart, &arrivalCostsCart, &pathConstraintsCart, &boundaryConditionsCart);
+  ocl::ThreadPool pool(2);
+
+  ocl::MultipleShootingOptions opts;
+  opts.control_intervals = 4;
+  ocl::MultipleShooting ms(ocp, 2.0, pool, opts);
+
+  // x0 u0 x1 u1 x2 u2 x3 u3 xf, the states of the last interval are the
+  // final states and its controls are duplicated
+  ocl::HorizonShift shift(ms.variables(), 2);
+  std::vector<double> w(ms.nv());
+  for (unsigned int i = 0; i < w.size(); i++) {
+    w[i] = i;
+  }
+  ocl::test::assertEqual(shift.variables(w), {3,4,5, 6,7,8, 9,10,11, 12,13,11, 12,13}, OCL_INFO);
+  ocl::test::assertEqual(shift.multipliers({0,1, 2,3, 4,5, 6,7}), {2,3, 4,5, 6,7, 6,7}, OCL_INFO);
+
+  // slacks and multipliers move with their stage, only the initial
+  // conditions (two equalities) have no counterpart
+  ocl::InteriorPoint ip(ms, pool);
+  ocl::InteriorPointResult cold = ip.solve(ms.initialGuess());
+  ocl::InteriorPointResult shifted = ip.shift(cold);
+  ocl::test::assertEqual(shifted.w, shift.variables(cold.w), OCL_INFO);
+  ocl::test::assertEqual(shifted.lambda, shift.multipliers(cold.lambda), OCL_INFO);
+  int unknown = 0;
+  for (unsigned int j = 0; j < shifted.s.size(); j++) {
+    unknown += std::isnan(shifted.s[j]) ? 1 : 0;
+  }
+  ocl::test::assertEqual(unknown, 4, OCL_INFO);
+
+  ocl::InteriorPointResult next = ip.solve(shifted);
+  ocl::test::assertEqual(next.success, true, OCL_INFO);
+  ocl::test::assertEqual(next.objective, 6./31, OCL_INFO, 1e-6);
+
+  // through the solver interface
+  ocl::Solver solver(2.0, &varsCart, &eqCart, &pathCostsCart, &arrivalCostsCart,
+                     &pathConstraintsCart, &boundaryConditionsCart);
+  solver.options.discretization = "multiple_shooting";
+  solver.options.solver = "interior_point";
+  solver.options.control_intervals = 4;
+
+  ocl::Solution solution = solver.solve();
+  ocl::Solution guess = solver.shift(solution);
+  ocl::test::assertEqual(guess.values(), shift.variables(solution.values()), OCL_INFO);
+  ocl::Solution warm = solver.solve(guess);
+  ocl::test::assertEqual(warm.success, true, OCL_INFO);
+  ocl::test::assertEqual(warm.objective, solution.objective, OCL_INFO, 1e-6);
+
+  // collocation with ipopt, the constraint multipliers of 9 per interval
+  // (6 collocation equations, 2 continuity, 1 path constraint) move with
+  // their interval, those of the final path constraint and the boundary
+  // conditions stay
+  ocl::Solver collocation(2.0, &varsCart, &eqCart, &pathCostsCart, &arrivalCostsCart,
+                          &pathConstraintsCart, &boundaryConditionsCart);
+  collocation.options.control_intervals = 4;
+  collocation.options.casadi_options = {{"ipopt.print_level", 0}, {"print_time", false},
+                                        {"ipopt.warm_start_init_point", "yes"}};
+  ocl::Solution coll_solution = collocation.solve();
+  ocl::test::assertEqual(coll_solution.success, true, OCL_INFO);
+  ocl::test::assertEqual((int)coll_solution.lam_g.size(), 4*9 + 1 + 3, OCL_INFO);
+
+  ocl::Solution coll_guess = collocation.shift(coll_solution);
+  const std::vector<double>& lam_g = coll_solution.lam_g;
+  for (int i = 0; i < 9; i++)
+  {
+    ocl::test::assertEqual(coll_guess.lam_g[i], lam_g[9+i], OCL_INFO);
+    ocl::test::assertEqual(coll_guess.lam_g[27+i], lam_g[27+i], OCL_INFO);
+  }
+  for (int i = 36; i < 40; i++) {
+    ocl::test::assertEqual(coll_guess.lam_g[i], lam_g[i], OCL_INFO);
+  }
+  ocl::test::assertEqual((int)coll_guess.lam_x.size(), (int)coll_solution.lam_x.size(), OCL_INFO);
+
+  ocl::Solution coll_warm = collocation.solve(coll_guess);
+  ocl::test::assertEqual(coll_warm.success, true, OCL_INFO);
+  ocl::test::assertEqual(coll_warm.objective, coll_solution.objective, OCL_INFO, 1e-6);
+}
+
+// Pendulum swinging up from rest, phi'' = F - sin(phi)
+void varsSwing(ocl::SVH& sh)
+{
+  sh.state("phi");
+  sh.state("w");
+  sh.control("F", {1,1}, -1, 1);
+}
+
+void eqSwing(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  eh.differentialEquation("phi", x.get("w"));
+  eh.differentialEquation("w", u.get("F") - ocl::sin(x.get("phi")));
+  (void) z; (void) p;
+}
+
+void pathCostsSwing(ocl::CH& ch, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor F = u.get("F");
+  ch.add(F*F);
+  (void) x; (void) z; (void) p;
+}
+
+void boundaryConditionsSwing(ocl::CNH& ch, const ocl::TT& x0, const ocl::TT& xf, const ocl::TT& p)
+{
+  ch.add(x0.get("phi"), "==", 0.);
+  ch.add(x0.get("w"), "==", 0.);
+  ch.add(xf.get("phi"), ">=", 1.);
+  (void) p;
+}
+
+TEST(Solver, fNonlinearInteriorPoint)
+{
+  // cold start at rest, where the linearized dynamics are far from the
+  // swing, the line search keeps the iterates converging
+  ocl::System sys(&varsSwing, &eqSwing);
+  ocl::OCP ocp(sys, &pathCostsSwing, nullptr, nullptr, &boundaryConditionsSwing);
+  ocl::ThreadPool pool(2);
+
+  ocl::MultipleShootingOptions opts;
+  opts.control_intervals = 20;
+  ocl::MultipleShooting ms(ocp, 10.0, pool, opts);
+  ocl::InteriorPoint ip(ms, pool);
+
+  ocl::InteriorPointResult cold = ip.solve(ms.initialGuess());
+  ocl::test::assertEqual(cold.success, true, OCL_INFO);
+  ocl::test::assertEqual(cold.w[ms.variables().get("xf").get("phi").indizes()[0][0]], 1., OCL_INFO, 1e-6);
+
+  ocl::InteriorPointResult warm = ip.solve(cold);
+  ocl::test::assertEqual(warm.success, true, OCL_INFO);
+  ocl::test::assertEqual(warm.objective, cold.objective, OCL_INFO, 1e-6);
+  ocl::test::assertEqual(warm.iterations <= cold.iterations, true, OCL_INFO);
+}
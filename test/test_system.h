@@ -12,6 +12,8 @@
  *    General Public License for more details.
  *
  */
+#include <cmath>
+#include <thread>
 #include <utils/testing.h>
 #include "system.h"
 #include "utils/constants.h"
@@ -49,6 +51,355 @@ TEST(System, aSystemEvaluation)
   }
 }
 
+TEST(System, dWorkspaceEvaluation)
+{
+  auto sys = ocl::System(&vars01Particle, &eq01Particle);
+
+  std::vector<double> x = {1.0, 2.0};
+  std::vector<double> u = {4.0};
+  std::vector<double> diff_out(sys.nx());
+
+  ocl::FunctionWorkspace ws = sys.workspace();
+  sys.evaluate(x.data(), nullptr, u.data(), nullptr, diff_out.data(), nullptr, ws);
+  ocl::test::assertEqual(diff_out, {2.0, 4-9.8}, OCL_INFO);
+
+  // one workspace per thread
+  const int n_threads = 4;
+  std::vector<ocl::FunctionWorkspace> workspaces;
+  for (int i = 0; i < n_threads; i++) {
+    workspaces.push_back(sys.workspace());
+  }
+  std::vector<double> results(n_threads);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < n_threads; i++)
+  {
+    threads.push_back(std::thread([&, i]() {
+      double xi[2] = {0.0, (double)i};
+      double ui[1] = {0.0};
+      double out[2];
+      for (int k = 0; k < 1000; k++) {
+        ui[0] = k;
+        sys.evaluate(xi, nullptr, ui, nullptr, out, nullptr, workspaces[i]);
+      }
+      results[i] = out[0] + out[1];
+    }));
+  }
+  for (auto& t : threads) {
+    t.join();
+  }
+  for (int i = 0; i < n_threads; i++) {
+    ocl::test::assertEqual(results[i], i + 999 - 9.8, OCL_INFO);
+  }
+}
+
+TEST(System, eBatchEvaluation)
+{
+  auto sys = ocl::System(&vars01Particle, &eq01Particle);
+  const int N = 3;
+
+  // x is nx-by-N, u is nu-by-N, column stacked
+  std::vector<double> x = {0,0, 1,2, 3,4};
+  std::vector<double> u = {1, 2, 3};
+  std::vector<double> diff_out(sys.nx()*N);
+
+  ocl::FunctionWorkspace ws = sys.batchWorkspace(N);
+  sys.evaluate(x.data(), nullptr, u.data(), nullptr, diff_out.data(), nullptr, ws);
+  ocl::test::assertEqual(diff_out, {0,1-9.8, 2,2-9.8, 4,3-9.8}, OCL_INFO);
+
+  ocl::Matrix diff, implicit;
+  sys.evaluateBatch(ocl::Matrix::One(2,N), ocl::Matrix::Zero(0,N), ocl::Matrix(4.0),
+                    ocl::Matrix::Zero(0,N), diff, implicit, "thread");
+  ocl::test::assertEqual(ocl::shape(diff), {2,N}, OCL_INFO);
+  ocl::test::assertEqual(ocl::full(diff), {1,4-9.8, 1,4-9.8, 1,4-9.8}, OCL_INFO);
+
+  // concurrent first calls fill the cache of mapped functions
+  std::vector<std::thread> threads;
+  std::vector<int> sizes(8);
+  for (int i = 0; i < 8; i++) {
+    threads.push_back(std::thread([&sys, &sizes, i]() {
+      sizes[i] = sys.batchFunction(10 + i%4).size1_in(0);
+    }));
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  ocl::test::assertEqual(sizes, {2, 2, 2, 2, 2, 2, 2, 2}, OCL_INFO);
+}
+
+static int eq_evaluations = 0;
+
+void eqCountedParticle(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  eq_evaluations++;
+  eq01Particle(eh, x, z, u, p);
+}
+
+TEST(System, cTraceOnce)
+{
+  eq_evaluations = 0;
+  auto sys = ocl::System(&vars01Particle, &eqCountedParticle);
+  ocl::test::assertEqual(eq_evaluations, 1, OCL_INFO);
+  ocl::test::assertEqual(sys.nx(), 2, OCL_INFO);
+  ocl::test::assertEqual(sys.nu(), 1, OCL_INFO);
+
+  ocl::Matrix diff_out;
+  ocl::Matrix implicit_out;
+  for (int i = 0; i < 3; i++) {
+    sys.evaluate(ocl::Matrix::One(2,1), ocl::Matrix::Zero(0,1), ocl::Matrix(i), ocl::Matrix::Zero(0,1),
+                 diff_out, implicit_out);
+    ocl::test::assertEqual( ocl::full(diff_out), {1,i-9.8}, OCL_INFO);
+  }
+
+  // symbolic inputs give symbolic outputs
+  ocl::Matrix u = ocl::Matrix::Sym(1,1);
+  sys.evaluate(ocl::Matrix::Zero(2,1), ocl::Matrix::Zero(0,1), u, ocl::Matrix::Zero(0,1), diff_out, implicit_out);
+  ocl::test::assertEqual( ocl::full(diff_out, {u}, {ocl::Matrix(2.0)}), {0,2-9.8}, OCL_INFO);
+
+  ocl::test::assertEqual(eq_evaluations, 1, OCL_INFO);
+}
+
+void varsPendulum(ocl::SVH& sh)
+{
+  sh.state("phi");
+  sh.state("w");
+  sh.control("F");
+}
+
+void eqPendulum(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  eh.differentialEquation("phi", x.get("w") * u.get("F"));
+  eh.differentialEquation("w", ocl::sin(x.get("phi")));
+  (void) z; (void) p;
+}
+
+TEST(System, fDerivatives)
+{
+  auto sys = ocl::System(&vars01Particle, &eq01Particle);
+
+  // f = [v; F-g] with respect to [p; v; F]
+  ocl::Matrix jac = sys.jacobian(ocl::Matrix::One(2,1), ocl::Matrix::Zero(0,1), ocl::Matrix(3.0), ocl::Matrix::Zero(0,1));
+  ocl::test::assertEqual(ocl::full(jac), {0,0, 1,0, 0,1}, OCL_INFO);
+
+  std::vector<double> x = {1,2};
+  std::vector<double> u = {3};
+
+  std::vector<double> jac_nz(sys.jacobianSparsity().nnz());
+  ocl::FunctionWorkspace jac_ws = sys.jacobianWorkspace();
+  sys.jacobian(x.data(), nullptr, u.data(), nullptr, jac_nz.data(), jac_ws);
+  ocl::test::assertEqual(jac_nz, {1,1}, OCL_INFO);
+
+  std::vector<double> seed_v = {1,2,3};
+  std::vector<double> fwd(2);
+  ocl::FunctionWorkspace fwd_ws = sys.forwardWorkspace();
+  sys.forwardDerivative(x.data(), nullptr, u.data(), nullptr, seed_v.data(), fwd.data(), fwd_ws);
+  ocl::test::assertEqual(fwd, {2,3}, OCL_INFO);
+
+  std::vector<double> seed_f = {1,2};
+  std::vector<double> adj(3);
+  ocl::FunctionWorkspace adj_ws = sys.adjointWorkspace();
+  sys.adjointDerivative(x.data(), nullptr, u.data(), nullptr, seed_f.data(), adj.data(), adj_ws);
+  ocl::test::assertEqual(adj, {0,1,2}, OCL_INFO);
+
+  // linear system, the Hessian has no nonzeros
+  ocl::test::assertEqual((double)sys.hessianSparsity().nnz(), 0., OCL_INFO);
+
+  // f = [w*F; sin(phi)] with respect to [phi; w; F], the Hessian of
+  // l1*w*F + l2*sin(phi) is [-l2*sin(phi) 0 0; 0 0 l1; 0 l1 0]
+  auto pendulum = ocl::System(&varsPendulum, &eqPendulum);
+  std::vector<double> xp = {0.7, -1.5};
+  std::vector<double> up = {2.0};
+  std::vector<double> lambda = {0.3, -2.0};
+
+  const casadi::Sparsity& sp = pendulum.hessianSparsity();
+  std::vector<double> hess_nz(sp.nnz());
+  ocl::FunctionWorkspace hess_ws = pendulum.hessianWorkspace();
+  pendulum.hessianLagrangian(xp.data(), nullptr, up.data(), nullptr, lambda.data(), hess_nz.data(), hess_ws);
+
+  std::vector<casadi::casadi_int> rows, cols;
+  sp.get_triplet(rows, cols);
+  std::vector<double> hess(9, 0.);
+  for (unsigned int i = 0; i < hess_nz.size(); i++) {
+    hess[rows[i] + 3*cols[i]] = hess_nz[i];
+  }
+  ocl::test::assertEqual(hess, {-lambda[1]*std::sin(xp[0]),0,0, 0,0,lambda[0], 0,lambda[0],0}, OCL_INFO, 1e-12);
+}
+
+TEST(System, gGeneratedCode)
+{
+  ocl::CodegenOptions opts;
+  opts.cache_dir = "/tmp/ocl_test_cache";
+
+  auto sys = ocl::System(&vars01Particle, &eq01Particle);
+  casadi::Function batch = sys.batchFunction(4);
+  sys.generateCode(opts);
+  ocl::test::assertEqual((double)sys.isGenerated(), 1., OCL_INFO);
+
+  // batch functions taken before the generation outlive the cache
+  ocl::test::assertEqual((int)batch.size1_in(0), 2, OCL_INFO);
+
+  std::vector<double> x = {1,2};
+  std::vector<double> u = {3};
+  std::vector<double> diff_out(2);
+  ocl::FunctionWorkspace ws = sys.workspace();
+  sys.evaluate(x.data(), nullptr, u.data(), nullptr, diff_out.data(), nullptr, ws);
+  ocl::test::assertEqual(diff_out, {2,3-9.8}, OCL_INFO);
+
+  // a second system with the same equations finds the library in the
+  // cache, the compiler does not run again
+  const int compilations = ocl::codegen::compilations();
+  auto sys2 = ocl::System(&vars01Particle, &eq01Particle);
+  std::string lib = ocl::codegen::compile(sys2.casadiFunction(), opts);
+  ocl::test::assertEqual((double)ocl::codegen::fileExists(lib), 1., OCL_INFO);
+  sys2.generateCode(opts);
+  ocl::test::assertEqual(ocl::codegen::compilations().load(), compilations, OCL_INFO);
+
+  ocl::FunctionWorkspace ws2 = sys2.workspace();
+  sys2.evaluate(x.data(), nullptr, u.data(), nullptr, diff_out.data(), nullptr, ws2);
+  ocl::test::assertEqual(diff_out, {2,3-9.8}, OCL_INFO);
+}
+
+void varsUnsorted(ocl::SVH& sh)
+{
+  sh.state("b", {2,1});
+  sh.state("a");
+}
+
+void eqUnsorted(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  eh.differentialEquation("a", x.get("a") + 3);
+  eh.differentialEquation("b", x.get("b") * 2);
+  (void) z; (void) u; (void) p;
+}
+
+void eqWrongSize(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  eh.differentialEquation("a", x.get("a"));
+  eh.differentialEquation("b", x.get("a"));
+  (void) z; (void) u; (void) p;
+}
+
+void eqMissing(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  eh.differentialEquation("b", x.get("b"));
+  (void) z; (void) u; (void) p;
+}
+
+TEST(System, hOutputAssembly)
+{
+  // equations are placed at the indizes of their states, not in id order
+  auto sys = ocl::System(&varsUnsorted, &eqUnsorted);
+  ocl::Matrix diff_out, implicit_out;
+  sys.evaluate(ocl::Matrix::One(3,1), ocl::Matrix::Zero(0,1), ocl::Matrix::Zero(0,1), ocl::Matrix::Zero(0,1),
+               diff_out, implicit_out);
+  ocl::test::assertEqual(ocl::full(diff_out), {2,2,4}, OCL_INFO);
+
+  // shapes are checked when the equations are traced
+  const std::vector<ocl::EquationsFunctionPtr> wrong = {&eqWrongSize, &eqMissing};
+  for (ocl::EquationsFunctionPtr eq : wrong)
+  {
+    bool thrown = false;
+    try {
+      ocl::System s(&varsUnsorted, eq);
+    } catch (const OclException&) {
+      thrown = true;
+    }
+    ocl::test::assertEqual(thrown, true, OCL_INFO);
+  }
+}
+
+TEST(System, iStructure)
+{
+  auto sys = ocl::System(&vars01Particle, &eq01Particle);
+
+  // derivatives and structure are built once by the first of several threads
+  std::vector<int> nnz(8);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++) {
+    threads.push_back(std::thread([&sys, &nnz, i]() {
+      nnz[i] = i%2 == 0 ? sys.structure().sparsity().nnz() : sys.jacobianSparsity().nnz();
+    }));
+  }
+  for (std::thread& t : threads) {
+    t.join();
+  }
+  ocl::test::assertEqual(nnz, {2, 2, 2, 2, 2, 2, 2, 2}, OCL_INFO);
+
+  const ocl::SystemStructure& st = sys.structure();
+
+  ocl::test::assertEqual((double)st.sparsity().nnz(), 2., OCL_INFO);
+  ocl::test::assertEqual(st.dependsOn("ode.p", "x.v"), true, OCL_INFO);
+  ocl::test::assertEqual(st.dependsOn("ode.p", "x.p"), false, OCL_INFO);
+  ocl::test::assertEqual(st.dependsOn("ode.v", "u.F"), true, OCL_INFO);
+  ocl::test::assertEqual(st.dependsOn("ode.v", "x.v"), false, OCL_INFO);
+
+  std::string table = "       x.p  x.v  u.F\n"
+                      "ode.p    .    1    .\n"
+                      "ode.v    .    .    1\n";
+  ocl::test::assertEqual(st.table() == table, true, OCL_INFO);
+}
+
+void varsBodies(ocl::SVH& sh)
+{
+  sh.stackedState("q", 3, {2,1});
+  sh.stackedState("v", 3, {2,1});
+  sh.stackedAlgebraic("f", 3);
+}
+
+void eqBodies(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  ocl::Tensor q = x.get("q");
+  ocl::Tensor v = x.get("v");
+  ocl::Tensor f = z.get("f");
+
+  // all bodies at once
+  eh.differentialEquation("q", v);
+  eh.differentialEquation("v", -q);
+  eh.implicitEquation(f - 1);
+  (void) u; (void) p;
+}
+
+void varsStackedRow(ocl::SVH& sh)
+{
+  sh.stackedState("c", 3);
+  sh.state("r", {1,3});
+}
+
+// the three scalar equations of c given as one 1x3 matrix
+void eqStackedRow(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p)
+{
+  eh.differentialEquation("c", x.get("r"));
+  eh.differentialEquation("r", x.get("r"));
+  (void) z; (void) u; (void) p;
+}
+
+TEST(System, jStackedStates)
+{
+  auto sys = ocl::System(&varsBodies, &eqBodies);
+  ocl::test::assertEqual((double)sys.nx(), 12., OCL_INFO);
+  ocl::test::assertEqual((double)sys.ni(), 3., OCL_INFO);
+
+  // q of the bodies at 0..5, v at 6..11
+  std::vector<double> x(12), z = {1, 2, 3};
+  for (int i = 0; i < 12; i++) {
+    x[i] = i;
+  }
+  std::vector<double> diff_out(12), implicit_out(3);
+  ocl::FunctionWorkspace ws = sys.workspace();
+  sys.evaluate(x.data(), z.data(), nullptr, nullptr, diff_out.data(), implicit_out.data(), ws);
+
+  ocl::test::assertEqual(diff_out, {6,7,8,9,10,11, 0,-1,-2,-3,-4,-5}, OCL_INFO);
+  ocl::test::assertEqual(implicit_out, {0,1,2}, OCL_INFO);
+
+  // the number of elements matches, but not the shape of the stack
+  bool thrown = false;
+  try {
+    ocl::System s(&varsStackedRow, &eqStackedRow);
+  } catch (const OclException&) {
+    thrown = true;
+  }
+  ocl::test::assertEqual(thrown, true, OCL_INFO);
+}
+
 void vars01Particle(ocl::SVH& sh)
 {
   sh.state("p", {1,1}, -5, 5);
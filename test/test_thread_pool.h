@@ -0,0 +1,127 @@
+/*
+ *    Copyright (C) 2019 Jonas Koenemann
+ *
+ *    This program is free software; you can redistribute it and/or
+ *    modify it under the terms of the GNU General Public
+ *    License as published by the Free Software Foundation; either
+ *    version 3 of the License, or (at your option) any later version.
+ *
+ *    This program is distributed in the hope that it will be useful,
+ *    but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *    General Public License for more details.
+ *
+ */
+#include <thread>
+#include <vector>
+#include <utils/testing.h>
+#include "thread_pool.h"
+#include "system.h"
+
+void vars01Particle(ocl::SVH& sh);
+void eq01Particle(ocl::SEH& eh, const ocl::TT& x, const ocl::TT& z, const ocl::TT& u, const ocl::TT& p);
+
+TEST(ThreadPool, aParallelFor)
+{
+  ocl::ThreadPool pool(4);
+  ocl::test::assertEqual(pool.size(), 4, OCL_INFO);
+
+  // reuse the pool for several loops
+  for (int r = 0; r < 10; r++)
+  {
+    const int n = 1000;
+    std::vector<int> values(n, 0);
+    std::vector<int> worker_calls(pool.size(), 0);
+    pool.parallelFor(n, [&](int i, int worker) {
+      values[i] = i*r;
+      worker_calls[worker]++;
+    });
+
+    int calls = 0;
+    for (int c : worker_calls) {
+      calls += c;
+    }
+    ocl::test::assertEqual(calls, n, OCL_INFO);
+    ocl::test::assertEqual(values[n-1], (n-1)*r, OCL_INFO);
+  }
+}
+
+TEST(ThreadPool, bException)
+{
+  ocl::ThreadPool pool(2, true);
+  bool thrown = false;
+  try {
+    pool.parallelFor(10, [](int i, int) {
+      if (i == 7) {
+        throw OclException("failed");
+      }
+    });
+  } catch (const OclException&) {
+    thrown = true;
+  }
+  ocl::test::assertEqual(thrown, true, OCL_INFO);
+
+  // pool is still usable
+  int count = 0;
+  pool.parallelFor(1, [&](int, int) { count++; });
+  ocl::test::assertEqual(count, 1, OCL_INFO);
+}
+
+TEST(ThreadPool, cParallelSystemEvaluation)
+{
+  auto sys = ocl::System(&vars01Particle, &eq01Particle);
+  ocl::ThreadPool pool(3);
+  ocl::ParallelFunction fcn = sys.parallelFunction(pool);
+
+  // N shooting nodes
+  const int N = 50;
+  std::vector<double> x(sys.nx()*N);
+  std::vector<double> u(N);
+  for (int k = 0; k < N; k++) {
+    x[2*k] = 0;
+    x[2*k+1] = k;
+    u[k] = 2*k;
+  }
+  std::vector<double> diff(sys.nx()*N);
+
+  fcn.evaluate(N, {x.data(), nullptr, u.data(), nullptr}, {diff.data(), nullptr});
+
+  for (int k = 0; k < N; k++) {
+    ocl::test::assertEqual(diff[2*k], (double)k, OCL_INFO);
+    ocl::test::assertEqual(diff[2*k+1], 2*k-9.8, OCL_INFO);
+  }
+}
+
+TEST(ThreadPool, dSharedPool)
+{
+  ocl::ThreadPool pool(4);
+
+  // several threads share the pool, their loops are serialized
+  std::vector<std::vector<int> > results(4, std::vector<int>(100, 0));
+  std::vector<std::thread> callers;
+  for (int c = 0; c < 4; c++) {
+    callers.push_back(std::thread([&pool, &results, c]() {
+      for (int r = 1; r <= 20; r++) {
+        pool.parallelFor(100, [&](int i, int) { results[c][i] += c + i; });
+      }
+    }));
+  }
+  for (std::thread& t : callers) {
+    t.join();
+  }
+  for (int c = 0; c < 4; c++) {
+    for (int i = 0; i < 100; i++) {
+      ocl::test::assertEqual(results[c][i], 20*(c+i), OCL_INFO);
+    }
+  }
+
+  // nested loops run on the calling worker
+  std::vector<int> counts(8*10, 0);
+  pool.parallelFor(8, [&](int i, int worker) {
+    pool.parallelFor(10, [&](int j, int inner_worker) {
+      counts[10*i + j]++;
+      ocl::test::assertEqual(inner_worker, worker, OCL_INFO);
+    });
+  });
+  ocl::test::assertEqual(counts, std::vector<int>(8*10, 1), OCL_INFO);
+}
@@ -87,3 +87,44 @@ TEST(Tree, fSliceMatrix)
 
   ocl::test::assertEqual(n.indizes(), {{4,5,8,9}}, OCL_INFO);
 }
+
+TEST(Tree, gRepeatedLayouts)
+{
+  ocl::TreeBuilder tb_x;
+  tb_x.add("p", {2,1});
+  tb_x.add("v", {1,1});
+
+  ocl::TreeBuilder tb_u;
+  tb_u.add("F", {1,1});
+
+  std::vector<std::string> ids = {"x","u"};
+  std::vector<ocl::Tree> trees = {tb_x.tree(), tb_u.tree()};
+
+  {
+    ocl::TreeBuilder tb;
+    tb.addRepeated(ids, trees, 3, ocl::TreeLayout::StageMajor);
+    ocl::Tree t = tb.tree();
+    ocl::test::assertEqual(t.get("x").get("p").indizes(), {{0,1},{4,5},{8,9}}, OCL_INFO);
+    ocl::test::assertEqual(t.get("u").indizes(), {{3},{7},{11}}, OCL_INFO);
+  }
+  {
+    ocl::TreeBuilder tb;
+    tb.addRepeated(ids, trees, 3, ocl::TreeLayout::VariableMajor);
+    tb.add("T", {1,1});
+    ocl::Tree t = tb.tree();
+    ocl::test::assertEqual(t.get("x").indizes(), {{0,3,6},{1,4,7},{2,5,8}}, OCL_INFO);
+    ocl::test::assertEqual(t.get("x").get("p").indizes(), {{0,3},{1,4},{2,5}}, OCL_INFO);
+    ocl::test::assertEqual(t.get("x").get("v").indizes(), {{6},{7},{8}}, OCL_INFO);
+    ocl::test::assertEqual(t.get("u").indizes(), {{9},{10},{11}}, OCL_INFO);
+    ocl::test::assertEqual(t.get("T").indizes(), {{12}}, OCL_INFO);
+    ocl::test::assertEqual(t.shape(), {13,1}, OCL_INFO);
+  }
+  {
+    ocl::TreeBuilder tb;
+    tb.addRepeated(ids, trees, 3, ocl::TreeLayout::Blocked, 2);
+    ocl::Tree t = tb.tree();
+    ocl::test::assertEqual(t.get("x").get("v").indizes(), {{4},{5},{10}}, OCL_INFO);
+    ocl::test::assertEqual(t.get("u").indizes(), {{6},{7},{11}}, OCL_INFO);
+    ocl::test::assertEqual(t.get("x").get("p").at({2}).indizes(), {{8,9}}, OCL_INFO);
+  }
+}